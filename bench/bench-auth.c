@@ -0,0 +1,156 @@
+/*
+ * Round trip of sld's AUTH_LIST request through the daemon's
+ * authentication broker, over a SOCK_SEQPACKET socket.
+ *
+ * The daemon side runs in this process, on the event loop; sld is a
+ * child process. The modules are included so that the broker listens
+ * in a fixture directory instead of AUTH_SOCKET.
+ */
+#include "../sield-config.c"
+#include "../sield-auth.c"
+
+#include <sys/wait.h>   /* waitpid() */
+
+#include "bench.h"
+
+#define PENDING 4
+#define ROUND_TRIPS 20000
+
+static void auth_done(int approved, const char *user, void *data)
+{
+}
+
+/* Listen on path the way auth_init() does on AUTH_SOCKET. */
+static void listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (fd == -1
+        || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || listen(fd, SOMAXCONN) == -1
+        || event_add_fd(fd, POLLIN, accept_event, NULL) == -1) {
+        fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    listen_fd = fd;
+}
+
+/* sld: list the pending devices ROUND_TRIPS times, like "sld" does. */
+static long long run_client(const char *path)
+{
+    int i, fd;
+    struct sockaddr_un addr;
+    struct auth_msg msg;
+    long long start;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1
+        || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        return -1;
+
+    start = bench_now_ns();
+
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        int devices = 0;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.type = AUTH_LIST;
+        if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg)) return -1;
+
+        while (1) {
+            if (recv(fd, &msg, sizeof(msg), 0) != sizeof(msg)) return -1;
+            if (msg.type == AUTH_END) break;
+            devices++;
+        }
+
+        if (devices != PENDING) return -1;
+    }
+
+    start = bench_now_ns() - start;
+    close(fd);
+    return start;
+}
+
+/* The client's timing arrived: stop the event loop. */
+static void result_event(int fd, short revents, void *data)
+{
+    if (read(fd, data, sizeof(long long)) != sizeof(long long))
+        *(long long *) data = -1;
+    event_del_fd(fd);
+}
+
+int main(void)
+{
+    char *dir = bench_tmpdir();
+    char *config = NULL, *path = NULL;
+    long long ns = 0;
+    long allocs;
+    int i, status, result[2];
+    pid_t pid;
+    FILE *fp;
+
+    if (asprintf(&config, "%s/sield.conf", dir) == -1
+        || asprintf(&path, "%s/auth.sock", dir) == -1)
+        exit(EXIT_FAILURE);
+
+    fp = fopen(config, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen(): %s: %s\n", config, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "log file = %s/sield.log\n"
+                "max password tries = 3\n", dir);
+    fclose(fp);
+
+    CONFIG_FILE = config;
+    listen_on(path);
+
+    for (i = 0; i < PENDING; i++) {
+        char devnode[16];
+        snprintf(devnode, sizeof(devnode), "/dev/sd%c1", 'b' + i);
+        auth_request("Bench", "Flash Drive", devnode, auth_done, NULL);
+    }
+
+    if (pipe(result) == -1) exit(EXIT_FAILURE);
+
+    pid = fork();
+    if (pid == -1) exit(EXIT_FAILURE);
+
+    if (pid == 0) {
+        ns = run_client(path);
+        if (write(result[1], &ns, sizeof(ns)) != sizeof(ns)) _exit(1);
+        _exit(ns == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    close(result[1]);
+    event_add_fd(result[0], POLLIN, result_event, &ns);
+
+    allocs = bench_allocs();
+    while (ns == 0) event_dispatch();
+    allocs = bench_allocs() - allocs;
+
+    if (waitpid(pid, &status, 0) == -1 || ns == -1
+        || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "sld round trips failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Allocations are the daemon's. */
+    bench_report("AUTH_LIST round trip (4 pending)", ROUND_TRIPS, ns, allocs);
+
+    close(listen_fd);
+    free(config);
+    free(path);
+    bench_rmdir(dir);
+    return 0;
+}
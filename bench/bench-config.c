@@ -0,0 +1,49 @@
+/*
+ * get_sield_attr*() lookups, against the shipped sield.conf.
+ *
+ * The module is included so that CONFIG_FILE can point at the fixture.
+ */
+#include "../sield-config.c"
+
+#include <stdio.h>      /* fprintf() */
+#include <stdlib.h>     /* exit() */
+
+#include "bench.h"
+
+static const char *FIXTURE = "../sield.conf";
+
+/* data: attribute name */
+static void lookup(void *data)
+{
+    char *value = get_sield_attr_no_log(data);
+    if (value) free(value);
+}
+
+static void lookup_int(void *data)
+{
+    get_sield_attr_int(data);
+}
+
+int main(void)
+{
+    char *value;
+
+    CONFIG_FILE = FIXTURE;
+
+    /* Make sure the fixture is what's being measured. */
+    value = get_sield_attr_no_log("mount point");
+    if (value == NULL) {
+        fprintf(stderr, "%s: fixture not found.\n", FIXTURE);
+        exit(EXIT_FAILURE);
+    }
+    free(value);
+
+    bench_run("get_sield_attr (first: enable)", 20000, lookup, "enable");
+    bench_run("get_sield_attr (last: mount point)", 20000,
+              lookup, "mount point");
+    bench_run("get_sield_attr (missing)", 20000, lookup, "no such attribute");
+    bench_run("get_sield_attr_int (max password tries)", 20000,
+              lookup_int, "max password tries");
+
+    return 0;
+}
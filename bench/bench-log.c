@@ -0,0 +1,118 @@
+/*
+ * _log_fn() throughput, alone and with concurrent writer processes
+ * appending to the same log file.
+ *
+ * The modules are included so that CONFIG_FILE can point at a fixture
+ * naming the log file.
+ */
+#include "../sield-config.c"
+#include "../sield-log.c"
+
+#include <sys/wait.h>   /* waitpid() */
+#include <unistd.h>     /* fork() */
+
+#include "bench.h"
+
+#define WRITERS 4
+#define LINES 5000
+
+static void log_line(void *data)
+{
+    log_fn("Benchmark line from %s, %d.", "bench-log", 42);
+}
+
+/* Return the number of lines, -1 if one doesn't look like ours. */
+static long count_lines(const char *path)
+{
+    long n = 0;
+    size_t len = 0;
+    char *line = NULL;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) return -1;
+
+    while (getline(&line, &len, fp) != -1) {
+        if (line[0] != '[' || strstr(line, "Benchmark line") == NULL) {
+            n = -1;
+            break;
+        }
+        n++;
+    }
+
+    if (line) free(line);
+    fclose(fp);
+    return n;
+}
+
+/* WRITERS processes logging LINES lines each, at the same time. */
+static void concurrent_writers(const char *logfile)
+{
+    int i, failed = 0;
+    long lines;
+    char name[64];
+    long long start = bench_now_ns();
+
+    for (i = 0; i < WRITERS; i++) {
+        pid_t pid = fork();
+
+        if (pid == -1) {
+            fprintf(stderr, "fork(): %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (pid == 0) {
+            int j;
+            for (j = 0; j < LINES; j++) log_line(NULL);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    for (i = 0; i < WRITERS; i++) {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != EXIT_SUCCESS)
+            failed = 1;
+    }
+
+    snprintf(name, sizeof(name), "_log_fn (%d processes)", WRITERS);
+    bench_report(name, WRITERS * LINES, bench_now_ns() - start, -1);
+
+    /* Appends from several processes must not tear or lose lines. */
+    lines = count_lines(logfile);
+    if (failed || lines != WRITERS * LINES) {
+        fprintf(stderr, "%s: %ld lines, expected %d.\n",
+                logfile, lines, WRITERS * LINES);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(void)
+{
+    char *dir = bench_tmpdir();
+    char *config = NULL, *logfile = NULL;
+    FILE *fp;
+
+    if (asprintf(&config, "%s/sield.conf", dir) == -1
+        || asprintf(&logfile, "%s/sield.log", dir) == -1)
+        exit(EXIT_FAILURE);
+
+    fp = fopen(config, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen(): %s: %s\n", config, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "log file = %s\n", logfile);
+    fclose(fp);
+
+    CONFIG_FILE = config;
+
+    bench_run("_log_fn", 20000, log_line, NULL);
+
+    unlink(logfile);
+    concurrent_writers(logfile);
+
+    free(config);
+    free(logfile);
+    bench_rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Mount table lookups, against a synthetic table of 10k mounts.
+ *
+ * The module is included so that PROC_MOUNTS can point at the fixture.
+ */
+#include "../sield-mount.c"
+
+#include <stdio.h>      /* fprintf() */
+#include <stdlib.h>     /* exit() */
+
+#include "bench.h"
+
+#define MOUNTS 10000
+
+static char devnodes[MOUNTS][32];
+static unsigned long seed = 1;
+
+/* Same sequence on every run. */
+static unsigned long next_random(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed / 65536) % 32768;
+}
+
+/*
+ * Write MOUNTS device mounts, in random order, in between pseudo file
+ * systems like a real mount table has.
+ */
+static void write_mounts(const char *path)
+{
+    int i, order[MOUNTS];
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "fopen(): %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < MOUNTS; i++) {
+        snprintf(devnodes[i], sizeof(devnodes[i]), "/dev/sd%c%c%d",
+                 'a' + i / 26 % 26, 'a' + i % 26, i / 676 + 1);
+        order[i] = i;
+    }
+
+    for (i = MOUNTS - 1; i > 0; i--) {
+        int j = (next_random() * 32768 + next_random()) % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    for (i = 0; i < MOUNTS; i++) {
+        int n = order[i];
+
+        if (i % 10 == 0)
+            fprintf(fp, "tmpfs /run/user/%d tmpfs rw,nosuid,nodev 0 0\n", i);
+
+        /* Some with a space in the mount point, escaped. */
+        fprintf(fp, "%s /media/usb%s%d ext4 rw,relatime 0 0\n",
+                devnodes[n], n % 20 == 0 ? "\\040disk" : "", n);
+    }
+
+    fclose(fp);
+}
+
+static void load(void *data)
+{
+    mount_index_free(mount_index_load());
+}
+
+static void find(void *data)
+{
+    static int i = 0;
+
+    if (mount_index_find(data, devnodes[i]) == NULL) {
+        fprintf(stderr, "%s: not found.\n", devnodes[i]);
+        exit(EXIT_FAILURE);
+    }
+    i = (i + 7919) % MOUNTS;
+}
+
+static void find_missing(void *data)
+{
+    mount_index_find(data, "/dev/sdzz9");
+}
+
+/* What a single lookup costs when the table is read for it. */
+static void load_and_find(void *data)
+{
+    struct mount_index *index = mount_index_load();
+
+    mount_index_find(index, devnodes[MOUNTS / 2]);
+    mount_index_free(index);
+}
+
+int main(void)
+{
+    char *dir = bench_tmpdir();
+    char *path = NULL;
+    struct mount_index *index;
+
+    if (asprintf(&path, "%s/mounts", dir) == -1) exit(EXIT_FAILURE);
+    write_mounts(path);
+    PROC_MOUNTS = path;
+
+    index = mount_index_load();
+    if (index == NULL || index->n != MOUNTS) {
+        fprintf(stderr, "%s: fixture not loaded.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    bench_run("mount_index_load (10k mounts)", 50, load, NULL);
+    bench_run("mount_index_load + find (10k mounts)", 50,
+              load_and_find, NULL);
+    bench_run("mount_index_find (10k mounts)", 1000000, find, index);
+    bench_run("mount_index_find (missing)", 1000000, find_missing, index);
+
+    mount_index_free(index);
+    free(path);
+    bench_rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Password checks, against fixture hashes of both supported methods.
+ *
+ * The module is included so that PASSWD_FILE can point at the fixture.
+ */
+#include "../sield-passwd-check.c"
+
+#include "bench.h"
+
+static const char *PASSWD = "bench password";
+
+/* Same salt on every run. */
+static const char SALT_BYTES[16] = "sield-bench-salt";
+
+static void write_passwd(const char *path, const char *setting)
+{
+    FILE *fp;
+    struct crypt_data data;
+    const char *hash;
+
+    memset(&data, 0, sizeof(data));
+    hash = crypt_r(PASSWD, setting, &data);
+    if (hash == NULL || hash[0] == '*') {
+        fprintf(stderr, "crypt_r(): %s: %s\n", setting, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen(): %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "%s\n", hash);
+    fclose(fp);
+}
+
+static void cached_hash_lookup(void *data)
+{
+    if (get_passwd_hash() == NULL) exit(EXIT_FAILURE);
+}
+
+static void check(void *data)
+{
+    if (is_passwd_correct(data) != (data == PASSWD)) {
+        fprintf(stderr, "Password check gave the wrong answer.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(void)
+{
+    char *dir = bench_tmpdir();
+    char *path = NULL;
+    char setting[CRYPT_GENSALT_OUTPUT_SIZE];
+
+    if (asprintf(&path, "%s/sield.passwd", dir) == -1) exit(EXIT_FAILURE);
+    PASSWD_FILE = path;
+
+    /* passwd-sield's default: yescrypt, cost 5 */
+    if (crypt_gensalt_rn("$y$", 5, SALT_BYTES, sizeof(SALT_BYTES),
+                         setting, sizeof(setting)) == NULL) {
+        fprintf(stderr, "crypt_gensalt_rn(): %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    write_passwd(path, setting);
+
+    bench_run("get_passwd_hash (cached)", 100000, cached_hash_lookup, NULL);
+    bench_run("is_passwd_correct (yescrypt 5)", 20, check, (void *) PASSWD);
+    bench_run("is_passwd_correct (yescrypt 5, wrong)", 20,
+              check, "wrong password");
+
+    write_passwd(path, "$6$rounds=5000$sieldbenchsalt$");
+    bench_run("is_passwd_correct (sha512 5000)", 50, check, (void *) PASSWD);
+
+    free(path);
+    bench_rmdir(dir);
+    return 0;
+}
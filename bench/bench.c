@@ -0,0 +1,119 @@
+#define _GNU_SOURCE     /* asprintf(), mkdtemp() */
+#include <dirent.h>     /* opendir() */
+#include <errno.h>      /* errno */
+#include <stdio.h>      /* printf() */
+#include <stdlib.h>     /* exit() */
+#include <string.h>     /* strerror() */
+#include <time.h>       /* clock_gettime() */
+#include <unistd.h>     /* rmdir() */
+
+#include "bench.h"
+
+/*
+ * Allocations are counted by standing in for glibc's malloc(); libc
+ * calls these too (getline(), strdup(), fopen()...).
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static long allocs = 0;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+/* Allocations so far. */
+long bench_allocs(void)
+{
+    return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+
+long long bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* allocs < 0 => not counted */
+void bench_report(const char *name, long ops, long long ns, long allocs)
+{
+    printf("%-40s %9ld ops %12.1f ns/op", name, ops, (double) ns / ops);
+
+    if (allocs < 0) printf(" %12s\n", "-");
+    else printf(" %8.2f allocs/op\n", (double) allocs / ops);
+
+    fflush(stdout);
+}
+
+void bench_run(const char *name, long iterations, bench_fn fn, void *data)
+{
+    long i, allocs_before;
+    long long start;
+
+    /* Warm up caches (and the code's own). */
+    fn(data);
+
+    allocs_before = bench_allocs();
+    start = bench_now_ns();
+
+    for (i = 0; i < iterations; i++) fn(data);
+
+    bench_report(name, iterations, bench_now_ns() - start,
+                 bench_allocs() - allocs_before);
+}
+
+/* Return a new directory for fixtures; exit on error. */
+char *bench_tmpdir(void)
+{
+    char *dir = NULL;
+
+    if (asprintf(&dir, "%s/sield-bench.XXXXXX",
+                 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp") == -1) {
+        fprintf(stderr, "asprintf(): Memory error.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "mkdtemp(): %s: %s\n", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return dir;
+}
+
+/* Remove a bench_tmpdir() and the files in it, and free it. */
+void bench_rmdir(char *dir)
+{
+    struct dirent *entry;
+    DIR *dp = opendir(dir);
+
+    while (dp != NULL && (entry = readdir(dp)) != NULL) {
+        char *path = NULL;
+
+        if (entry->d_name[0] == '.') continue;
+        if (asprintf(&path, "%s/%s", dir, entry->d_name) == -1) continue;
+        unlink(path);
+        free(path);
+    }
+
+    if (dp) closedir(dp);
+    rmdir(dir);
+    free(dir);
+}
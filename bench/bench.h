@@ -0,0 +1,21 @@
+#ifndef _SIELD_BENCH_H_
+#define _SIELD_BENCH_H_
+
+/*
+ * Minimal microbenchmark harness.
+ *
+ * Each benchmark is timed over a fixed number of iterations, after
+ * one untimed warm-up call, and reported as ns/op and allocations/op
+ * (malloc(), calloc() and realloc() calls, libc's own included).
+ */
+typedef void (*bench_fn)(void *data);
+
+void bench_run(const char *name, long iterations, bench_fn fn, void *data);
+void bench_report(const char *name, long ops, long long ns, long allocs);
+
+long long bench_now_ns(void);
+long bench_allocs(void);
+char *bench_tmpdir(void);
+void bench_rmdir(char *dir);
+
+#endif
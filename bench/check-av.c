@@ -0,0 +1,80 @@
+/*
+ * is_infected() against a stand-in scanner exiting with each status
+ * clamscan can give (and some it shouldn't), and the journal verdict
+ * the worker reports for each: a virus found must never end up
+ * "clean".
+ *
+ * The modules are included so that CONFIG_FILE can point at a fixture
+ * naming the scanner.
+ */
+#include "../sield-config.c"
+#include "../sield-av.c"
+
+#include <sys/stat.h>   /* chmod() */
+
+#include "bench.h"
+
+static const struct {
+    const char *exit;   /* $SCAN_EXIT, "kill" to die of SIGKILL */
+    int result;
+    int verdict;
+} CASES[] = {
+    {"0", 0, VERDICT_CLEAN},
+    {"1", 1, VERDICT_INFECTED},
+    {"2", 2, VERDICT_ERRORS},
+    {"3", 2, VERDICT_ERRORS},
+    {"kill", 2, VERDICT_ERRORS},
+};
+
+int main(void)
+{
+    char *dir = bench_tmpdir();
+    char *config = NULL, *scanner = NULL;
+    size_t i;
+    int failed = 0;
+    FILE *fp;
+
+    if (asprintf(&config, "%s/sield.conf", dir) == -1
+        || asprintf(&scanner, "%s/scanner", dir) == -1)
+        exit(EXIT_FAILURE);
+
+    fp = fopen(scanner, "w");
+    if (fp == NULL) exit(EXIT_FAILURE);
+    fprintf(fp, "#!/bin/sh\n"
+                "[ \"$SCAN_EXIT\" = kill ] && kill -9 $$\n"
+                "exit $SCAN_EXIT\n");
+    fclose(fp);
+    chmod(scanner, S_IRWXU);
+
+    fp = fopen(config, "w");
+    if (fp == NULL) exit(EXIT_FAILURE);
+    fprintf(fp, "log file = %s/sield.log\n"
+                "av path = %s\n", dir, scanner);
+    fclose(fp);
+
+    CONFIG_FILE = config;
+
+    for (i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+        int result, verdict;
+
+        setenv("SCAN_EXIT", CASES[i].exit, 1);
+        result = is_infected(dir);
+        verdict = av_verdict(result);
+
+        printf("scanner exit %-4s -> is_infected() %d, verdict %d\n",
+               CASES[i].exit, result, verdict);
+        if (result != CASES[i].result || verdict != CASES[i].verdict)
+            failed = 1;
+    }
+
+    free(config);
+    free(scanner);
+    bench_rmdir(dir);
+
+    if (failed) {
+        fprintf(stderr, "Unexpected scan verdict.\n");
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include <errno.h>          /* errno */
+#include <limits.h>         /* PATH_MAX */
+#include <signal.h>         /* kill() */
+#include <stdio.h>          /* fopen(), fscanf() */
+#include <string.h>         /* memset() */
+#include <sys/resource.h>   /* getrusage() */
+#include <sys/wait.h>       /* waitpid() */
+#include <unistd.h>         /* fork(), sleep() */
+
+#include "sield-acct.h"
+#include "sield-event.h"    /* event_now_ms() */
+#include "sield-log.h"      /* log_fn() */
+#include "sield-probe.h"    /* PROBE5() */
+
+/*
+ * Counters are read before and after the scan, the difference is the
+ * scan's:
+ *
+ * - <syspath>/stat of the partition, as in Documentation/block/stat:
+ *   reads completed, sectors read (of 512 bytes) and io_ticks.
+ * - /proc/self/io and getrusage(RUSAGE_CHILDREN): a reaped child's
+ *   I/O and CPU time are added to its parent's. A worker handles one
+ *   device at a time, so its children are that device's scanner (the
+ *   progress process is reaped after acct_end()).
+ */
+#define SECTOR_SIZE 512
+#define MB (1024.0 * 1024.0)
+#define PROGRESS_INTERVAL 1     /* s */
+
+struct counters {
+    unsigned long long reads;
+    unsigned long long sectors;
+    unsigned long long io_ticks;
+    unsigned long long rchar;
+    long user;
+    long system;
+};
+
+static void read_block_stat(struct udev_device *device,
+                            struct counters *counters);
+static void read_self_io(struct counters *counters);
+static void read_counters(struct udev_device *device,
+                          struct counters *counters);
+
+/* Not a sysattr: libudev would cache the first value read. */
+static void read_block_stat(struct udev_device *device,
+                            struct counters *counters)
+{
+    char path[PATH_MAX];
+    unsigned long long v[10];
+    FILE *fp = NULL;
+    int n;
+
+    snprintf(path, sizeof(path), "%s/stat", udev_device_get_syspath(device));
+    fp = fopen(path, "re");
+    if (fp == NULL) return;
+
+    /* reads merges sectors ticks writes merges sectors ticks
+       in_flight io_ticks ... */
+    n = fscanf(fp, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7],
+               &v[8], &v[9]);
+    fclose(fp);
+
+    if (n != 10) return;
+
+    counters->reads = v[0];
+    counters->sectors = v[2];
+    counters->io_ticks = v[9];
+}
+
+static void read_self_io(struct counters *counters)
+{
+    char name[32];
+    unsigned long long value;
+    FILE *fp = fopen("/proc/self/io", "re");
+
+    if (fp == NULL) return;
+
+    /* "rchar: 1234" ... */
+    while (fscanf(fp, "%31s %llu", name, &value) == 2)
+        if (strcmp(name, "rchar:") == 0) counters->rchar = value;
+
+    fclose(fp);
+}
+
+static void read_counters(struct udev_device *device,
+                          struct counters *counters)
+{
+    struct rusage usage;
+
+    memset(counters, 0, sizeof(*counters));
+
+    read_block_stat(device, counters);
+    read_self_io(counters);
+
+    if (getrusage(RUSAGE_CHILDREN, &usage) == 0) {
+        counters->user = usage.ru_utime.tv_sec * 1000L
+                         + usage.ru_utime.tv_usec / 1000;
+        counters->system = usage.ru_stime.tv_sec * 1000L
+                           + usage.ru_stime.tv_usec / 1000;
+    }
+}
+
+/*
+ * Start accounting a scan of device. Keeps the counters in acct until
+ * acct_end() turns them into the scan's figures.
+ */
+void acct_begin(struct acct *acct, struct udev_device *device)
+{
+    struct counters counters;
+
+    read_counters(device, &counters);
+
+    memset(acct, 0, sizeof(*acct));
+    acct->started = event_now_ms();
+    acct->reads = counters.reads;
+    acct->read_bytes = counters.sectors * SECTOR_SIZE;
+    acct->busy = counters.io_ticks;
+    acct->scanner_bytes = counters.rchar;
+    acct->user = counters.user;
+    acct->system = counters.system;
+}
+
+/*
+ * While the scan runs, call fn every PROGRESS_INTERVAL in a process of
+ * its own with the bytes read from the device since acct_begin(), as
+ * the block layer counts them. The scanner is run with system(), which
+ * doesn't return until it is done. Stop it with acct_progress_stop().
+ *
+ * Return its pid, -1 on error: the scan goes on without.
+ */
+pid_t acct_progress_start(const struct acct *acct, struct udev_device *device,
+                          acct_progress_fn fn)
+{
+    pid_t parent = getpid();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_fn("fork(): %s", strerror(errno));
+        return -1;
+    }
+    if (pid != 0) return pid;
+
+    while (getppid() == parent) {
+        struct counters counters;
+
+        sleep(PROGRESS_INTERVAL);
+
+        memset(&counters, 0, sizeof(counters));
+        read_block_stat(device, &counters);
+        if (counters.sectors * SECTOR_SIZE < acct->read_bytes) continue;
+
+        if (fn(counters.sectors * SECTOR_SIZE - acct->read_bytes) == -1)
+            break;
+    }
+
+    _exit(0);
+}
+
+void acct_progress_stop(pid_t pid)
+{
+    if (pid == -1) return;
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+void acct_end(struct acct *acct, struct udev_device *device)
+{
+    struct counters counters;
+
+    read_counters(device, &counters);
+
+    acct->elapsed = event_now_ms() - acct->started;
+    acct->reads = counters.reads - acct->reads;
+    acct->read_bytes = counters.sectors * SECTOR_SIZE - acct->read_bytes;
+    acct->busy = counters.io_ticks - acct->busy;
+    acct->scanner_bytes = counters.rchar - acct->scanner_bytes;
+    acct->user = counters.user - acct->user;
+    acct->system = counters.system - acct->system;
+}
+
+/*
+ * Log a one line summary of the scan, with what tells a slow link
+ * (device busy all along, little CPU) from a slow scanner (CPU time
+ * close to the scan's).
+ *
+ * queued: ms the device waited for a worker.
+ */
+void acct_log(const struct acct *acct, struct udev_device *device,
+              struct udev_device *parent, long queued)
+{
+    const char *speed = udev_device_get_sysattr_value(parent, "speed");
+    double seconds = acct->elapsed > 0 ? acct->elapsed / 1000.0 : 0.001;
+
+    PROBE5(scan_acct, udev_device_get_devnode(device), acct->read_bytes,
+           acct->reads, acct->user + acct->system, queued);
+
+    log_fn("Scan of %s: %.1f s, %.1f MB read (%.1f MB/s, %.0f IOPS, "
+           "device busy %.0f%%), scanner read %.1f MB, "
+           "CPU %.1f s user/%.1f s system, queued %.1f s, USB %s Mbit/s.",
+           udev_device_get_devnode(device), seconds,
+           acct->read_bytes / MB, acct->read_bytes / MB / seconds,
+           acct->reads / seconds, acct->busy / 10.0 / seconds,
+           acct->scanner_bytes / MB,
+           acct->user / 1000.0, acct->system / 1000.0,
+           queued / 1000.0, speed ? speed : "?");
+}
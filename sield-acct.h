@@ -0,0 +1,34 @@
+#ifndef _SIELD_ACCT_H_
+#define _SIELD_ACCT_H_
+
+#include <libudev.h>
+#include <sys/types.h>      /* pid_t */
+
+/*
+ * Accounting of a device scan: what the block layer saw of the device,
+ * and what the scanner (the worker's reaped children) read and used
+ * of the CPU.
+ */
+struct acct {
+    long started;                       /* ms */
+    long elapsed;                       /* ms */
+    unsigned long long reads;           /* block layer, completed reads */
+    unsigned long long read_bytes;
+    unsigned long long busy;            /* ms the device had I/O in flight */
+    unsigned long long scanner_bytes;   /* read() by the scanner */
+    long user;                          /* scanner CPU, ms */
+    long system;
+};
+
+/* Called with the bytes read from the device so far; -1 to stop. */
+typedef int (*acct_progress_fn)(unsigned long long read_bytes);
+
+void acct_begin(struct acct *acct, struct udev_device *device);
+pid_t acct_progress_start(const struct acct *acct, struct udev_device *device,
+                          acct_progress_fn fn);
+void acct_progress_stop(pid_t pid);
+void acct_end(struct acct *acct, struct udev_device *device);
+void acct_log(const struct acct *acct, struct udev_device *device,
+              struct udev_device *parent, long queued);
+
+#endif
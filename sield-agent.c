@@ -0,0 +1,392 @@
+#define _GNU_SOURCE             /* explicit_bzero() */
+#include <errno.h>              /* errno */
+#include <gtk/gtk.h>
+#include <stdio.h>              /* fprintf() */
+#include <stdlib.h>             /* getenv() */
+#include <string.h>             /* strerror() */
+#include <sys/socket.h>         /* socket() */
+#include <sys/un.h>             /* struct sockaddr_un */
+#include <unistd.h>             /* close() */
+
+#include "sield-ipc.h"          /* struct auth_msg */
+
+/*
+ * Desktop approval agent.
+ *
+ * Runs in the user's session (eg. from /etc/xdg/autostart), registers
+ * with the daemon and pops up a single dialog listing all devices
+ * awaiting a password. The dialog is built once; the daemon itself
+ * never touches the display.
+ */
+
+/* Seconds between attempts to reach the daemon. */
+#define RECONNECT_INTERVAL 5
+
+struct device {
+    int id;
+    char description[AUTH_TEXT_MAX];
+};
+
+struct agent {
+    int fd;
+    guint watch;
+    GtkWidget *dialog;
+    GtkWidget *combo;
+    GtkWidget *entry;
+    GtkWidget *status_hbox;
+    GtkWidget *status_label;
+    /* Devices shown in the dialog, and the list being received. */
+    struct device *devices;
+    int ndevices;
+    struct device *incoming;
+    int nincoming;
+    int last_seen_id;           /* Newest device shown so far */
+    int trying;                 /* AUTH_TRY sent, awaiting result */
+};
+
+static void build_dialog(struct agent *agent);
+static void update_dialog(struct agent *agent);
+static void show_status(struct agent *agent, const char *text);
+static void dialog_response(GtkWidget *widget, int response, gpointer data);
+static int agent_connect(struct agent *agent);
+static void agent_disconnect(struct agent *agent);
+static gboolean reconnect(gpointer data);
+static gboolean socket_event(GIOChannel *source, GIOCondition condition,
+                             gpointer data);
+static void handle_msg(struct agent *agent, struct auth_msg *msg);
+
+/* Build the (hidden) password dialog. */
+static void build_dialog(struct agent *agent)
+{
+    GtkWidget *dialog = NULL;
+    GtkWidget *content = NULL;
+    GtkWidget *image = NULL;
+    GtkWidget *hbox = NULL;
+    GtkWidget *vbox_labels = NULL;
+    GtkWidget *vbox_entries = NULL;
+    GtkWidget *label = NULL;
+    GtkWidget *align = NULL;
+
+    agent->dialog = dialog = gtk_dialog_new();
+    gtk_window_set_title(GTK_WINDOW(dialog), "Sield");
+    gtk_window_set_keep_above(GTK_WINDOW(dialog), TRUE);
+    content = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+
+    /* Cancel & OK buttons */
+    gtk_dialog_add_button(GTK_DIALOG(dialog), GTK_STOCK_CANCEL,
+                          GTK_RESPONSE_CANCEL);
+    gtk_dialog_add_button(GTK_DIALOG(dialog), GTK_STOCK_OK, GTK_RESPONSE_OK);
+
+    /* Default response is OK */
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_OK);
+
+    /* Authentication image */
+    image = gtk_image_new_from_stock(GTK_STOCK_DIALOG_AUTHENTICATION,
+                                     GTK_ICON_SIZE_DIALOG);
+
+    hbox = gtk_hbox_new(FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(hbox), image, FALSE, FALSE, 12);
+
+    label = gtk_label_new("USB block device inserted.\n"
+                          "Authorization needed to mount and share.");
+    gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 12);
+    gtk_box_pack_start(GTK_BOX(content), hbox, FALSE, TRUE, 5);
+
+    /* Device and password labels and entries */
+    vbox_labels = gtk_vbox_new(FALSE, 5);
+    vbox_entries = gtk_vbox_new(FALSE, 5);
+
+    hbox = gtk_hbox_new(FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(content), hbox, FALSE, TRUE, 5);
+
+    gtk_box_pack_start(GTK_BOX(hbox), vbox_labels, FALSE, TRUE, 12);
+    gtk_box_pack_start(GTK_BOX(hbox), vbox_entries, TRUE, TRUE, 12);
+
+    align = gtk_alignment_new(0.0, 0.5, 0.0, 0.0);
+    label = gtk_label_new("Device:");
+    gtk_container_add(GTK_CONTAINER(align), label);
+    gtk_box_pack_start(GTK_BOX(vbox_labels), align, TRUE, FALSE, 6);
+
+    agent->combo = gtk_combo_box_text_new();
+    gtk_box_pack_start(GTK_BOX(vbox_entries), agent->combo, TRUE, TRUE, 6);
+
+    align = gtk_alignment_new(0.0, 0.5, 0.0, 0.0);
+    label = gtk_label_new("Password:");
+    gtk_container_add(GTK_CONTAINER(align), label);
+    gtk_box_pack_start(GTK_BOX(vbox_labels), align, TRUE, FALSE, 6);
+
+    /* Password entry */
+    agent->entry = gtk_entry_new();
+    gtk_entry_set_visibility(GTK_ENTRY(agent->entry), FALSE);
+    gtk_entry_set_activates_default(GTK_ENTRY(agent->entry), TRUE);
+    gtk_box_pack_start(GTK_BOX(vbox_entries), agent->entry, TRUE, TRUE, 6);
+
+    /* Wrong password (or other status) label */
+    agent->status_hbox = hbox = gtk_hbox_new(FALSE, 5);
+
+    /* Error image */
+    image = gtk_image_new_from_stock(GTK_STOCK_DIALOG_ERROR,
+                                     GTK_ICON_SIZE_BUTTON);
+    gtk_box_pack_start(GTK_BOX(hbox), image, FALSE, FALSE, 12);
+
+    agent->status_label = gtk_label_new("");
+    gtk_box_pack_start(GTK_BOX(hbox), agent->status_label, FALSE, FALSE, 12);
+    gtk_box_pack_start(GTK_BOX(content), hbox, FALSE, TRUE, 5);
+
+    /* Hide status label. */
+    gtk_widget_set_no_show_all(hbox, TRUE);
+
+    g_signal_connect(G_OBJECT(dialog), "response",
+                     G_CALLBACK(dialog_response), agent);
+    /* Closing the window only hides it. */
+    g_signal_connect(G_OBJECT(dialog), "delete-event",
+                     G_CALLBACK(gtk_widget_hide_on_delete), NULL);
+
+    gtk_widget_show_all(content);
+}
+
+static void show_status(struct agent *agent, const char *text)
+{
+    gtk_label_set_text(GTK_LABEL(agent->status_label), text);
+    gtk_widget_set_no_show_all(agent->status_hbox, FALSE);
+    gtk_widget_show_all(agent->status_hbox);
+}
+
+/* Show the devices just received from the daemon. */
+static void update_dialog(struct agent *agent)
+{
+    int i, newest = 0, selected = 0;
+    int selected_id = -1;
+    GtkListStore *store = NULL;
+
+    /* Keep the current choice, if it's still pending. */
+    i = gtk_combo_box_get_active(GTK_COMBO_BOX(agent->combo));
+    if (i >= 0 && i < agent->ndevices) selected_id = agent->devices[i].id;
+
+    free(agent->devices);
+    agent->devices = agent->incoming;
+    agent->ndevices = agent->nincoming;
+    agent->incoming = NULL;
+    agent->nincoming = 0;
+
+    store = GTK_LIST_STORE(
+                gtk_combo_box_get_model(GTK_COMBO_BOX(agent->combo)));
+    gtk_list_store_clear(store);
+
+    for (i = 0; i < agent->ndevices; i++) {
+        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(agent->combo),
+                                       agent->devices[i].description);
+        if (agent->devices[i].id == selected_id) selected = i;
+        if (agent->devices[i].id > newest) newest = agent->devices[i].id;
+    }
+
+    if (agent->ndevices == 0) {
+        gtk_entry_set_text(GTK_ENTRY(agent->entry), "");
+        gtk_widget_hide(agent->dialog);
+        return;
+    }
+
+    gtk_combo_box_set_active(GTK_COMBO_BOX(agent->combo), selected);
+
+    /* Pop up again only for devices not seen before. */
+    if (newest > agent->last_seen_id) {
+        agent->last_seen_id = newest;
+        gtk_window_present(GTK_WINDOW(agent->dialog));
+    }
+}
+
+static void dialog_response(GtkWidget *widget, int response, gpointer data)
+{
+    struct agent *agent = (struct agent *) data;
+    struct auth_msg msg;
+    const char *display = getenv("DISPLAY");
+    int i;
+    ssize_t n;
+
+    if (response != GTK_RESPONSE_OK) {
+        /* Dismissed until another device shows up. */
+        gtk_entry_set_text(GTK_ENTRY(agent->entry), "");
+        gtk_widget_hide(agent->dialog);
+        return;
+    }
+
+    i = gtk_combo_box_get_active(GTK_COMBO_BOX(agent->combo));
+    if (agent->fd == -1 || agent->trying || i < 0 || i >= agent->ndevices)
+        return;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = AUTH_TRY;
+    msg.id = agent->devices[i].id;
+    strncpy(msg.tty, display ? display : PROGRAM_NAME, sizeof(msg.tty) - 1);
+    strncpy(msg.text, gtk_entry_get_text(GTK_ENTRY(agent->entry)),
+            sizeof(msg.text) - 1);
+
+    n = send(agent->fd, &msg, sizeof(msg), MSG_NOSIGNAL);
+    explicit_bzero(&msg, sizeof(msg));
+
+    /* Clear password entry text area */
+    gtk_entry_set_text(GTK_ENTRY(agent->entry), "");
+
+    if (n != sizeof(msg)) {
+        show_status(agent, "Could not reach sield.");
+        return;
+    }
+
+    /* The daemon may take a while; one password at a time. */
+    agent->trying = 1;
+    gtk_widget_set_sensitive(agent->dialog, FALSE);
+}
+
+/* A message from the daemon. */
+static void handle_msg(struct agent *agent, struct auth_msg *msg)
+{
+    struct device *more = NULL;
+
+    msg->text[sizeof(msg->text) - 1] = '\0';
+
+    switch (msg->type) {
+        case AUTH_DEVICE:
+            more = realloc(agent->incoming,
+                           (agent->nincoming + 1) * sizeof(struct device));
+            if (more == NULL) break;
+            agent->incoming = more;
+            agent->incoming[agent->nincoming].id = msg->id;
+            strcpy(agent->incoming[agent->nincoming].description, msg->text);
+            agent->nincoming++;
+            break;
+        case AUTH_END:
+            update_dialog(agent);
+            break;
+        case AUTH_RESULT:
+            agent->trying = 0;
+            gtk_widget_set_sensitive(agent->dialog, TRUE);
+
+            switch (msg->status) {
+                case AUTH_ACCEPTED:
+                    gtk_widget_set_no_show_all(agent->status_hbox, TRUE);
+                    gtk_widget_hide(agent->status_hbox);
+                    break;
+                case AUTH_REJECTED:
+                    show_status(agent, "Incorrect password. "
+                                "Please try again.");
+                    break;
+                case AUTH_DENIED:
+                    show_status(agent, "Incorrect password.\n"
+                                "No attempts left for this device.");
+                    break;
+                case AUTH_BUSY:
+                    show_status(agent, "Sield is busy. Please try again.");
+                    break;
+                default:
+                    /* Device is gone, the list update follows. */
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static gboolean socket_event(GIOChannel *source, GIOCondition condition,
+                             gpointer data)
+{
+    struct agent *agent = (struct agent *) data;
+    struct auth_msg msg;
+    ssize_t n;
+
+    n = recv(agent->fd, &msg, sizeof(msg), MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return TRUE;
+
+    if (n != sizeof(msg)) {
+        /* Daemon went away (or is confused); start over. */
+        agent_disconnect(agent);
+        g_timeout_add_seconds(RECONNECT_INTERVAL, reconnect, agent);
+        return FALSE;
+    }
+
+    handle_msg(agent, &msg);
+    return TRUE;
+}
+
+/*
+ * Connect to the daemon and register as an agent.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int agent_connect(struct agent *agent)
+{
+    int fd;
+    struct sockaddr_un addr;
+    struct auth_msg msg;
+    GIOChannel *channel = NULL;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, AUTH_SOCKET, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = AUTH_WATCH;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+        close(fd);
+        return -1;
+    }
+
+    channel = g_io_channel_unix_new(fd);
+    agent->fd = fd;
+    agent->watch = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                  socket_event, agent);
+    g_io_channel_unref(channel);
+
+    return 0;
+}
+
+static void agent_disconnect(struct agent *agent)
+{
+    close(agent->fd);
+    agent->fd = -1;
+    agent->watch = 0;
+    agent->trying = 0;
+
+    /* Nothing can be authorized without the daemon. */
+    free(agent->incoming);
+    agent->incoming = NULL;
+    agent->nincoming = 0;
+    update_dialog(agent);
+    gtk_widget_set_sensitive(agent->dialog, TRUE);
+}
+
+static gboolean reconnect(gpointer data)
+{
+    struct agent *agent = (struct agent *) data;
+
+    /* FALSE => done, don't call again. */
+    return agent_connect(agent) == -1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct agent agent;
+
+    PROGRAM_NAME = "sield-agent";
+    gtk_init(&argc, &argv);
+
+    memset(&agent, 0, sizeof(agent));
+    agent.fd = -1;
+    build_dialog(&agent);
+
+    /* sield may not be running yet; keep trying. */
+    if (agent_connect(&agent) == -1) {
+        fprintf(stderr, "%s: Unable to connect to %s: %s. "
+                "Retrying every %d seconds.\n",
+                PROGRAM_NAME, AUTH_SOCKET, strerror(errno), RECONNECT_INTERVAL);
+        g_timeout_add_seconds(RECONNECT_INTERVAL, reconnect, &agent);
+    }
+
+    gtk_main();
+    return 0;
+}
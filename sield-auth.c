@@ -0,0 +1,812 @@
+#define _GNU_SOURCE             /* struct ucred, asprintf() */
+#include <errno.h>              /* errno */
+#include <fnmatch.h>            /* fnmatch() */
+#include <poll.h>               /* POLLIN */
+#include <pwd.h>                /* getpwuid() */
+#include <stdio.h>              /* asprintf() */
+#include <stdlib.h>             /* free() */
+#include <string.h>             /* strerror() */
+#include <sys/socket.h>         /* socket() */
+#include <sys/stat.h>           /* chmod() */
+#include <sys/un.h>             /* struct sockaddr_un */
+#include <unistd.h>             /* unlink() */
+
+#include "sield-auth.h"
+#include "sield-config.h"       /* get_sield_attr_int() */
+#include "sield-event.h"        /* event_add_fd() */
+#include "sield-ipc.h"          /* struct auth_msg */
+#include "sield-log.h"          /* log_fn() */
+#include "sield-probe.h"        /* PROBE2() */
+#include "sield-verify.h"       /* verify_passwd_async() */
+
+/*
+ * Authentication broker.
+ *
+ * Devices waiting for a password are kept in a list of pending
+ * requests. Any number of sld clients may connect to AUTH_SOCKET at
+ * the same time, list the pending devices and send passwords for them.
+ * Desktop agents watch the list instead, they are sent a fresh copy
+ * whenever it changes.
+ *
+ * Passwords are checked on the verifier threads. Each failure doubles
+ * the delay before the next check for the same user, so guessing
+ * can't keep the CPU busy hashing. A user has one try checked at a
+ * time, and a device is never sent more tries than it has attempts
+ * left: opening more connections doesn't buy more guesses.
+ */
+
+#define BACKOFF_BASE 500            /* ms */
+#define BACKOFF_MAX 30000           /* ms */
+#define BACKOFF_FORGET 900000       /* ms without failures */
+
+struct pending {
+    int id;
+    char *description;
+    char *devnode;
+    int attempts;
+    int max_attempts;
+    int in_flight;              /* Tries being checked */
+    long since;                 /* event_now_ms() */
+    auth_done_fn done;
+    void *data;
+    struct pending *next;
+};
+
+struct client {
+    int fd;
+    uid_t uid;
+    char *user;
+    int watching;           /* Desktop agent, gets list updates */
+    int busy;               /* A try is deferred or being verified */
+    int closed;             /* Gone while busy, free when done */
+    int timer;
+    int try_id;
+    int try_match;          /* try_pattern, not try_id */
+    char try_pattern[AUTH_TEXT_MAX];
+    char try_tty[32];
+    char try_passwd[AUTH_TEXT_MAX];
+    int *try_ids;           /* Devices the try is charged to */
+    int try_n;
+    int charged;            /* try_ids and the user's busy are held */
+    struct client *next;
+};
+
+/* Failed attempts per user. */
+struct backoff {
+    uid_t uid;
+    int failures;
+    long next_try;          /* event_now_ms() */
+    int busy;               /* A try is deferred or being checked */
+    struct backoff *next;
+};
+
+static int listen_fd = -1;
+static int last_id = 0;
+static struct pending *pendings = NULL;
+static struct client *clients = NULL;
+static struct backoff *backoffs = NULL;
+
+static struct pending *find_pending(int id);
+static void finish_pending(struct pending *pending, int approved,
+                           const char *user);
+static void accept_event(int fd, short revents, void *data);
+static void client_event(int fd, short revents, void *data);
+static void client_close(struct client *client);
+static int client_send(struct client *client, int type, int id, int status,
+                       const char *text);
+static void client_list(struct client *client);
+static void push_list(void);
+static void client_try(struct client *client, struct auth_msg *msg);
+static void client_verify(void *data);
+static void client_verified(int correct, void *data);
+static void client_verified_match(struct client *client, int correct);
+static int count_matching(const char *pattern);
+static int try_charge(struct client *client);
+static void try_release(struct client *client);
+static void client_free(struct client *client);
+static struct backoff *find_backoff(uid_t uid);
+static struct backoff *get_backoff(uid_t uid);
+static void backoff_failed(uid_t uid);
+static void backoff_reset(uid_t uid);
+
+/*
+ * Create the listening socket.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int auth_init(void)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, AUTH_SOCKET, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_fn("socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    /* Left over from a previous run. */
+    unlink(AUTH_SOCKET);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        log_fn("bind(): %s: %s", AUTH_SOCKET, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* Any logged in user may authorize a device, as with the FIFOs. */
+    if (chmod(AUTH_SOCKET, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP
+                           | S_IROTH | S_IWOTH) == -1
+        || listen(fd, SOMAXCONN) == -1
+        || event_add_fd(fd, POLLIN, accept_event, NULL) == -1) {
+        log_fn("Unable to listen on %s: %s", AUTH_SOCKET, strerror(errno));
+        close(fd);
+        unlink(AUTH_SOCKET);
+        return -1;
+    }
+
+    listen_fd = fd;
+    return 0;
+}
+
+/* Remove the socket file. */
+void auth_cleanup(void)
+{
+    if (listen_fd == -1) return;
+
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(AUTH_SOCKET);
+}
+
+/*
+ * Queue a device for authorization.
+ * done(approved, user, data) is called once a password was accepted,
+ * or all attempts are used up.
+ *
+ * Return the request id, -1 on error.
+ */
+int auth_request(const char *manufacturer, const char *product,
+                 const char *devnode, auth_done_fn done, void *data)
+{
+    struct pending **pp;
+    struct pending *pending = calloc(1, sizeof(struct pending));
+
+    if (pending == NULL) {
+        log_fn("calloc(): Memory error.");
+        return -1;
+    }
+
+    if (asprintf(&pending->description, "%s %s (%s)",
+                 manufacturer, product, devnode) == -1) {
+        log_fn("asprintf(): Memory error.");
+        free(pending);
+        return -1;
+    }
+
+    pending->devnode = strdup(devnode);
+    pending->id = ++last_id;
+    pending->since = event_now_ms();
+    pending->max_attempts = get_sield_attr_int("max password tries");
+    if (pending->max_attempts <= 0) pending->max_attempts = 3;
+    pending->done = done;
+    pending->data = data;
+
+    /* Append, so that devices are listed in order of arrival. */
+    for (pp = &pendings; *pp != NULL; pp = &(*pp)->next) continue;
+    *pp = pending;
+
+    push_list();
+
+    PROBE2(auth_prompt, pending->devnode, pending->id);
+    return pending->id;
+}
+
+/* Forget a pending request without calling its callback. */
+void auth_cancel(int id)
+{
+    struct pending **pp;
+
+    for (pp = &pendings; *pp != NULL; pp = &(*pp)->next) {
+        struct pending *pending = *pp;
+
+        if (pending->id != id) continue;
+
+        *pp = pending->next;
+        free(pending->description);
+        free(pending->devnode);
+        free(pending);
+
+        push_list();
+        return;
+    }
+}
+
+/*
+ * The device went away: refuse its pending requests, which calls
+ * their callbacks.
+ *
+ * Return the number of requests withdrawn.
+ */
+int auth_withdraw(const char *devnode)
+{
+    int withdrawn = 0;
+    struct pending *pending = pendings;
+
+    while (pending != NULL) {
+        struct pending *next = pending->next;
+
+        if (strcmp(pending->devnode, devnode) == 0) {
+            finish_pending(pending, 0, NULL);
+            withdrawn++;
+        }
+
+        pending = next;
+    }
+
+    return withdrawn;
+}
+
+/* Call fn for each device waiting for a password, oldest first. */
+void auth_foreach(auth_pending_fn fn, void *data)
+{
+    struct pending *pending;
+
+    for (pending = pendings; pending != NULL; pending = pending->next)
+        fn(pending->devnode, pending->description, pending->since, data);
+}
+
+static struct pending *find_pending(int id)
+{
+    struct pending *pending;
+
+    for (pending = pendings; pending != NULL; pending = pending->next)
+        if (pending->id == id) return pending;
+
+    return NULL;
+}
+
+static void finish_pending(struct pending *pending, int approved,
+                           const char *user)
+{
+    auth_done_fn done = pending->done;
+    void *data = pending->data;
+
+    PROBE4(auth_result, pending->devnode, approved, user,
+           event_now_ms() - pending->since);
+
+    /* Unlink first, the callback may queue new requests. */
+    auth_cancel(pending->id);
+    done(approved, user, data);
+}
+
+static void accept_event(int fd, short revents, void *data)
+{
+    while (1) {
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        struct passwd *pwd = NULL;
+        struct client *client = NULL;
+        int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                log_fn("accept4(): %s", strerror(errno));
+            return;
+        }
+
+        /* Who is it? Trust the kernel, not the client. */
+        if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED,
+                       &cred, &len) == -1) {
+            log_fn("getsockopt(SO_PEERCRED): %s", strerror(errno));
+            close(client_fd);
+            continue;
+        }
+
+        client = calloc(1, sizeof(struct client));
+        if (client == NULL) {
+            log_fn("calloc(): Memory error.");
+            close(client_fd);
+            continue;
+        }
+
+        client->fd = client_fd;
+        client->uid = cred.uid;
+
+        pwd = getpwuid(cred.uid);
+        if (pwd != NULL) client->user = strdup(pwd->pw_name);
+        else if (asprintf(&client->user, "uid %ld", (long) cred.uid) == -1)
+            client->user = NULL;
+
+        if (client->user == NULL
+            || event_add_fd(client_fd, POLLIN, client_event, client) == -1) {
+            if (client->user) free(client->user);
+            free(client);
+            close(client_fd);
+            continue;
+        }
+
+        client->next = clients;
+        clients = client;
+    }
+}
+
+static void client_free(struct client *client)
+{
+    explicit_bzero(client->try_passwd, sizeof(client->try_passwd));
+    try_release(client);
+    free(client->try_ids);
+    free(client->user);
+    free(client);
+}
+
+static void client_close(struct client *client)
+{
+    struct client **cp;
+
+    for (cp = &clients; *cp != NULL; cp = &(*cp)->next) {
+        if (*cp == client) {
+            *cp = client->next;
+            break;
+        }
+    }
+
+    event_del_fd(client->fd);
+    close(client->fd);
+    client->fd = -1;
+
+    if (client->busy && client->timer == 0) {
+        /* A verifier thread has it; client_verified() frees it. */
+        client->closed = 1;
+        return;
+    }
+
+    /* Deferred, or idle; client_free() releases the try. */
+    event_del_timer(client->timer);
+    client_free(client);
+}
+
+static int client_send(struct client *client, int type, int id, int status,
+                       const char *text)
+{
+    struct auth_msg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    msg.id = id;
+    msg.status = status;
+    if (text) strncpy(msg.text, text, sizeof(msg.text) - 1);
+
+    if (send(client->fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+        log_fn("[%s] send(): %s", PROGRAM_NAME, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Send the list of pending devices, oldest first. */
+static void client_list(struct client *client)
+{
+    struct pending *pending;
+
+    for (pending = pendings; pending != NULL; pending = pending->next)
+        client_send(client, AUTH_DEVICE, pending->id, 0,
+                    pending->description);
+
+    client_send(client, AUTH_END, 0, 0, NULL);
+}
+
+/* Send the new list to all desktop agents. */
+static void push_list(void)
+{
+    struct client *client;
+
+    for (client = clients; client != NULL; client = client->next)
+        if (client->watching) client_list(client);
+}
+
+/* Number of desktop agents connected. */
+int auth_agents(void)
+{
+    int n = 0;
+    struct client *client;
+
+    for (client = clients; client != NULL; client = client->next)
+        if (client->watching) n++;
+
+    return n;
+}
+
+static struct backoff *find_backoff(uid_t uid)
+{
+    long now = event_now_ms();
+    struct backoff **bp = &backoffs;
+
+    while (*bp != NULL) {
+        struct backoff *backoff = *bp;
+
+        if (backoff->uid == uid) return backoff;
+
+        /* Forget users who stopped failing a long time ago. */
+        if (!backoff->busy && now - backoff->next_try > BACKOFF_FORGET) {
+            *bp = backoff->next;
+            free(backoff);
+            continue;
+        }
+
+        bp = &backoff->next;
+    }
+
+    return NULL;
+}
+
+/* The user's entry, added if needed; NULL on error. */
+static struct backoff *get_backoff(uid_t uid)
+{
+    struct backoff *backoff = find_backoff(uid);
+
+    if (backoff != NULL) return backoff;
+
+    backoff = calloc(1, sizeof(struct backoff));
+    if (backoff == NULL) {
+        log_fn("calloc(): Memory error.");
+        return NULL;
+    }
+    backoff->uid = uid;
+    backoff->next = backoffs;
+    backoffs = backoff;
+
+    return backoff;
+}
+
+/* Double the delay before the user's next check. */
+static void backoff_failed(uid_t uid)
+{
+    long delay = BACKOFF_MAX;
+    struct backoff *backoff = get_backoff(uid);
+
+    if (backoff == NULL) return;
+
+    backoff->failures++;
+    if (backoff->failures < 8)
+        delay = (long) BACKOFF_BASE << (backoff->failures - 1);
+    if (delay > BACKOFF_MAX) delay = BACKOFF_MAX;
+
+    backoff->next_try = event_now_ms() + delay;
+}
+
+static void backoff_reset(uid_t uid)
+{
+    struct backoff **bp;
+
+    for (bp = &backoffs; *bp != NULL; bp = &(*bp)->next) {
+        struct backoff *backoff = *bp;
+
+        if (backoff->uid != uid) continue;
+
+        /* Another try of the user's holds it. */
+        if (backoff->busy) {
+            backoff->failures = 0;
+            backoff->next_try = 0;
+            return;
+        }
+
+        *bp = backoff->next;
+        free(backoff);
+        return;
+    }
+}
+
+/* Number of pending devices whose description matches pattern. */
+static int count_matching(const char *pattern)
+{
+    int n = 0;
+    struct pending *pending;
+
+    for (pending = pendings; pending != NULL; pending = pending->next)
+        if (fnmatch(pattern, pending->description, 0) == 0) n++;
+
+    return n;
+}
+
+/*
+ * Charge a try to its user and to the devices it is for, each of which
+ * must have an attempt left that no other try holds.
+ *
+ * Return the number of devices charged, 0 if it can't be checked now,
+ * -1 on error.
+ */
+static int try_charge(struct client *client)
+{
+    int n = 0, size = 1;
+    struct backoff *backoff = get_backoff(client->uid);
+    struct pending *pending;
+
+    if (backoff == NULL) return -1;
+
+    /* One at a time, behind the delay of the last failure. */
+    if (backoff->busy) return 0;
+
+    if (client->try_match) size = count_matching(client->try_pattern);
+
+    free(client->try_ids);
+    client->try_ids = calloc(size > 0 ? size : 1, sizeof(int));
+    client->try_n = 0;
+    if (client->try_ids == NULL) {
+        log_fn("calloc(): Memory error.");
+        return -1;
+    }
+
+    for (pending = pendings; pending != NULL && n < size;
+         pending = pending->next) {
+        if (client->try_match
+            ? fnmatch(client->try_pattern, pending->description, 0) != 0
+            : pending->id != client->try_id)
+            continue;
+        if (pending->attempts + pending->in_flight >= pending->max_attempts)
+            continue;
+
+        pending->in_flight++;
+        client->try_ids[n++] = pending->id;
+    }
+
+    if (n == 0) return 0;
+
+    client->try_n = n;
+    client->charged = 1;
+    backoff->busy = 1;
+
+    return n;
+}
+
+/* The try was checked, or dropped: give back what it held. */
+static void try_release(struct client *client)
+{
+    struct backoff *backoff = NULL;
+    int i;
+
+    if (!client->charged) return;
+    client->charged = 0;
+
+    for (i = 0; i < client->try_n; i++) {
+        struct pending *pending = find_pending(client->try_ids[i]);
+        if (pending != NULL) pending->in_flight--;
+    }
+
+    backoff = find_backoff(client->uid);
+    if (backoff != NULL) backoff->busy = 0;
+}
+
+/*
+ * Check the password sent for a pending device (AUTH_TRY), or for all
+ * devices matching a pattern (AUTH_TRY_MATCH).
+ * Nothing more is read from the client until the result is sent.
+ */
+static void client_try(struct client *client, struct auth_msg *msg)
+{
+    long delay = 0;
+    struct backoff *backoff = NULL;
+    int match = (msg->type == AUTH_TRY_MATCH);
+    int charged;
+
+    msg->tty[sizeof(msg->tty) - 1] = '\0';
+    msg->text[sizeof(msg->text) - 1] = '\0';
+    msg->match[sizeof(msg->match) - 1] = '\0';
+
+    if ((match && count_matching(msg->match) == 0)
+        || (!match && find_pending(msg->id) == NULL)) {
+        client_send(client, AUTH_RESULT, msg->id, AUTH_NO_DEVICE, NULL);
+        return;
+    }
+
+    client->try_id = msg->id;
+    client->try_match = match;
+    strcpy(client->try_pattern, msg->match);
+
+    /* Other tries hold the attempts left, or the user's turn. */
+    charged = try_charge(client);
+    if (charged <= 0) {
+        explicit_bzero(msg->text, sizeof(msg->text));
+        client_send(client, AUTH_RESULT, msg->id, AUTH_BUSY, NULL);
+        return;
+    }
+
+    client->busy = 1;
+    strcpy(client->try_tty, msg->tty);
+    strcpy(client->try_passwd, msg->text);
+    event_set_fd_events(client->fd, 0);
+
+    backoff = find_backoff(client->uid);
+    if (backoff != NULL) delay = backoff->next_try - event_now_ms();
+
+    if (delay > 0) {
+        client->timer = event_add_timer(delay, client_verify, client);
+        if (client->timer > 0) return;
+        client->timer = 0;
+    }
+
+    client_verify(client);
+}
+
+/* Hand the password over to the verifier threads. */
+static void client_verify(void *data)
+{
+    struct client *client = (struct client *) data;
+
+    client->timer = 0;
+
+    if (verify_passwd_async(client->try_passwd, client_verified,
+                            client) == 0)
+        return;
+
+    explicit_bzero(client->try_passwd, sizeof(client->try_passwd));
+    try_release(client);
+    client->busy = 0;
+    event_set_fd_events(client->fd, POLLIN);
+    client_send(client, AUTH_RESULT, client->try_id, AUTH_BUSY, NULL);
+}
+
+static void client_verified(int correct, void *data)
+{
+    struct client *client = (struct client *) data;
+    struct pending *pending = NULL;
+    int id = client->try_id;
+
+    explicit_bzero(client->try_passwd, sizeof(client->try_passwd));
+    try_release(client);
+    client->busy = 0;
+
+    if (client->closed) {
+        client_free(client);
+        return;
+    }
+
+    event_set_fd_events(client->fd, POLLIN);
+
+    if (client->try_match) {
+        client_verified_match(client, correct);
+        return;
+    }
+
+    /* The device may have gone away meanwhile. */
+    pending = find_pending(id);
+    if (pending == NULL) {
+        client_send(client, AUTH_RESULT, id, AUTH_NO_DEVICE, NULL);
+        return;
+    }
+
+    if (correct) {
+        log_fn("%s (@%s) provided correct password for %s.",
+               client->user, client->try_tty, pending->devnode);
+        backoff_reset(client->uid);
+        client_send(client, AUTH_RESULT, id, AUTH_ACCEPTED, NULL);
+        finish_pending(pending, 1, client->user);
+        return;
+    }
+
+    pending->attempts++;
+    backoff_failed(client->uid);
+    log_fn("%s (@%s) entered incorrect password for %s. Attempt #%d",
+           client->user, client->try_tty, pending->devnode,
+           pending->attempts);
+
+    if (pending->attempts < pending->max_attempts) {
+        client_send(client, AUTH_RESULT, id, AUTH_REJECTED, NULL);
+        return;
+    }
+
+    log_fn("Used all password attempts for %s.", pending->devnode);
+    client_send(client, AUTH_RESULT, id, AUTH_DENIED, NULL);
+    finish_pending(pending, 0, client->user);
+}
+
+/*
+ * One password for all devices matching the pattern when it was sent:
+ * verified once, then every match is approved (or charged an attempt).
+ */
+static void client_verified_match(struct client *client, int correct)
+{
+    int i, n = client->try_n;
+    int done = 0, left = 0;
+    int *ids = client->try_ids;
+    struct pending *pending = NULL;
+
+    /* Callbacks may start a new try, which replaces try_ids. */
+    client->try_ids = NULL;
+    client->try_n = 0;
+
+    if (correct) backoff_reset(client->uid);
+    else backoff_failed(client->uid);
+
+    for (i = 0; i < n; i++) {
+        pending = find_pending(ids[i]);
+        if (pending == NULL) continue;
+
+        if (correct) {
+            log_fn("%s (@%s) provided correct password for %s.",
+                   client->user, client->try_tty, pending->devnode);
+            client_send(client, AUTH_DEVICE, pending->id, 0,
+                        pending->description);
+            finish_pending(pending, 1, client->user);
+            done++;
+            continue;
+        }
+
+        pending->attempts++;
+        log_fn("%s (@%s) entered incorrect password for %s. Attempt #%d",
+               client->user, client->try_tty, pending->devnode,
+               pending->attempts);
+
+        if (pending->attempts < pending->max_attempts) {
+            left++;
+            continue;
+        }
+
+        log_fn("Used all password attempts for %s.", pending->devnode);
+        finish_pending(pending, 0, client->user);
+    }
+
+    free(ids);
+
+    if (correct)
+        client_send(client, AUTH_RESULT, done,
+                    done > 0 ? AUTH_ACCEPTED : AUTH_NO_DEVICE, NULL);
+    else
+        client_send(client, AUTH_RESULT, 0,
+                    left > 0 ? AUTH_REJECTED : AUTH_DENIED, NULL);
+}
+
+static void client_event(int fd, short revents, void *data)
+{
+    struct client *client = (struct client *) data;
+    struct auth_msg msg;
+    ssize_t n;
+
+    /* Waiting for a result; poll(2) only reports hangups now. */
+    if (client->busy) {
+        if (revents & (POLLHUP | POLLERR)) client_close(client);
+        return;
+    }
+
+    n = recv(fd, &msg, sizeof(msg), 0);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+
+    if (n <= 0) {
+        client_close(client);
+        return;
+    }
+
+    if (n != sizeof(msg)) {
+        log_fn("[%s] Malformed request from %s.", PROGRAM_NAME, client->user);
+        client_close(client);
+        return;
+    }
+
+    switch (msg.type) {
+        case AUTH_LIST:
+            client_list(client);
+            break;
+        case AUTH_WATCH:
+            log_fn("Desktop agent of %s connected.", client->user);
+            client->watching = 1;
+            client_list(client);
+            break;
+        case AUTH_TRY:
+        case AUTH_TRY_MATCH:
+            client_try(client, &msg);
+            break;
+        default:
+            log_fn("[%s] Unknown request %d from %s.",
+                   PROGRAM_NAME, msg.type, client->user);
+            client_close(client);
+            return;
+    }
+
+    /* Don't leave passwords lying around. */
+    explicit_bzero(&msg, sizeof(msg));
+}
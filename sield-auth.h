@@ -0,0 +1,21 @@
+#ifndef _SIELD_AUTH_H_
+#define _SIELD_AUTH_H_
+
+/*
+ * Authentication broker for sld clients and desktop agents.
+ */
+typedef void (*auth_done_fn)(int approved, const char *user, void *data);
+typedef void (*auth_pending_fn)(const char *devnode, const char *description,
+                                long since, void *data);
+
+int auth_init(void);
+void auth_cleanup(void);
+
+int auth_request(const char *manufacturer, const char *product,
+                 const char *devnode, auth_done_fn done, void *data);
+void auth_cancel(int id);
+int auth_withdraw(const char *devnode);
+int auth_agents(void);
+void auth_foreach(auth_pending_fn fn, void *data);
+
+#endif
@@ -2,10 +2,12 @@
 #include <stdio.h>          /* asprintf() */
 #include <stdlib.h>         /* free() */
 #include <string.h>         /* strdup() */
+#include <sys/wait.h>       /* WEXITSTATUS() */
 #include <unistd.h>         /* access() */
 
 #include "sield-av.h"
 #include "sield-config.h"   /* get_sield_attr() */
+#include "sield-journal.h"  /* enum journal_verdict */
 #include "sield-log.h"      /* log_fn() */
 
 static const char *AVPATH = "/usr/bin/clamscan";
@@ -24,15 +26,20 @@ int is_infected(const char *dir)
     char *avpath = NULL;
     char *logfile = NULL;
     char *cmd = NULL;
-    int avresult = 2;
+    int status, avresult = 2;
 
     /* Anti-virus path */
     avpath = get_sield_attr("av path");
     if (avpath == NULL) avpath = strdup(AVPATH);
+    if (avpath == NULL) {
+        log_fn("strdup(): memory error.");
+        return 2;
+    }
 
     /* Check if avpath exists */
     if (access(avpath, F_OK) == -1) {
         log_fn("'avpath' %s doesn't exist. Will mount as read-only.", avpath);
+        free(avpath);
         return 2;
     }
 
@@ -40,15 +47,22 @@ int is_infected(const char *dir)
     logfile = get_sield_attr("log file");
     if (logfile == NULL) logfile = strdup(LOGFILE);
 
-    if (asprintf(&cmd, "%s -r -l %s %s", avpath, logfile, dir) == -1) {
+    if (logfile == NULL
+        || asprintf(&cmd, "%s -r -l %s %s", avpath, logfile, dir) == -1) {
         log_fn("asprintf(): memory error.");
+        free(avpath);
+        free(logfile);
         return 2;
     }
 
     log_fn("Starting virus scan on %s using clamscan.", dir);
-    avresult = system(cmd);
+    status = system(cmd);
     log_fn("Virus scan on %s completed.", dir);
 
+    /* A wait status; anything but exit 0 or 1 is an error. */
+    if (status != -1 && WIFEXITED(status) && WEXITSTATUS(status) <= 1)
+        avresult = WEXITSTATUS(status);
+
     if (avresult == 0) log_fn("No virus found.");
     else if (avresult == 1) log_fn("Virus(es) found.");
     else log_fn("Some error(s) occurred while scanning.");
@@ -59,3 +73,13 @@ int is_infected(const char *dir)
 
     return avresult;
 }
+
+/* Journal verdict of an is_infected() result; errors when unexpected. */
+int av_verdict(int result)
+{
+    switch (result) {
+        case 0: return VERDICT_CLEAN;
+        case 1: return VERDICT_INFECTED;
+        default: return VERDICT_ERRORS;
+    }
+}
@@ -2,5 +2,6 @@
 #define _SIELD_AV_H_
 
 int is_infected(const char *dir);
+int av_verdict(int result);
 
 #endif
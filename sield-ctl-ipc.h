@@ -0,0 +1,53 @@
+#ifndef _SIELD_CTL_IPC_H_
+#define _SIELD_CTL_IPC_H_
+
+static const char *const CTL_SOCKET = "/var/run/sield-ctl.sock";
+
+#define CTL_TEXT_MAX 256
+
+/*
+ * Control protocol over the SOCK_SEQPACKET socket CTL_SOCKET, for root
+ * only (sieldctl). Every packet is exactly one struct ctl_msg.
+ *
+ * sieldctl                     daemon
+ * CTL_STATUS           =>
+ *                      <=      CTL_DEVICE (one per device)
+ *                      <=      CTL_END (status: 1 if paused)
+ * CTL_EJECT (devnode)  =>
+ * CTL_RESCAN (devnode) =>
+ * CTL_RELOAD           =>
+ * CTL_PAUSE            =>
+ * CTL_RESUME           =>
+ *                      <=      CTL_RESULT (status, text: error)
+ *
+ * Answers come from the daemon's memory.
+ */
+enum ctl_msg_type {
+    CTL_STATUS = 1,
+    CTL_DEVICE,         /* devnode, state, elapsed, size, progress, text */
+    CTL_END,
+    CTL_EJECT,
+    CTL_RESCAN,
+    CTL_RELOAD,
+    CTL_PAUSE,
+    CTL_RESUME,
+    CTL_RESULT
+};
+
+enum ctl_status {
+    CTL_OK = 1,
+    CTL_FAILED          /* text: why */
+};
+
+struct ctl_msg {
+    int type;
+    int status;
+    long elapsed;                   /* ms in state */
+    unsigned long long size;        /* bytes, 0 => unknown */
+    int progress;                   /* percent scanned, -1 => n/a */
+    char state[32];
+    char devnode[CTL_TEXT_MAX];
+    char text[CTL_TEXT_MAX];        /* description or mount point */
+};
+
+#endif
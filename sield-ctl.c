@@ -0,0 +1,260 @@
+#define _GNU_SOURCE             /* struct ucred, accept4() */
+#include <errno.h>              /* errno */
+#include <poll.h>               /* POLLIN */
+#include <string.h>             /* strerror() */
+#include <sys/socket.h>         /* socket() */
+#include <sys/stat.h>           /* chmod() */
+#include <sys/un.h>             /* struct sockaddr_un */
+#include <unistd.h>             /* unlink() */
+
+#include "sield-auth.h"         /* auth_foreach() */
+#include "sield-ctl-ipc.h"      /* struct ctl_msg */
+#include "sield-ctl.h"
+#include "sield-event.h"        /* event_add_fd() */
+#include "sield-job.h"          /* job_foreach() */
+#include "sield-log.h"          /* log_fn() */
+#include "sield-trusted.h"      /* trusted_load() */
+
+/*
+ * Control socket, for sieldctl.
+ *
+ * Requests are answered right away from what the daemon keeps in
+ * memory; nothing is read from disk, so monitoring may ask as often
+ * as it likes. Only root may connect. The event loop never waits for
+ * a client: one that doesn't read its answers is dropped.
+ */
+
+/* A status answer, sent one packet at a time. */
+struct reply {
+    int fd;
+    int failed;
+};
+
+static int listen_fd = -1;
+
+static void accept_event(int fd, short revents, void *data);
+static void client_event(int fd, short revents, void *data);
+static void client_close(int fd);
+static int client_send(int fd, const struct ctl_msg *msg);
+static int send_result(int fd, int status, const char *text);
+static void send_pending(const char *devnode, const char *description,
+                         long since, void *data);
+static void send_job(const struct job_status *status, void *data);
+static int send_status(int fd);
+
+static void client_close(int fd)
+{
+    event_del_fd(fd);
+    close(fd);
+}
+
+/*
+ * Send a packet without waiting: the socket is non-blocking.
+ *
+ * Return 0 on success, -1 if it wasn't sent whole.
+ */
+static int client_send(int fd, const struct ctl_msg *msg)
+{
+    if (send(fd, msg, sizeof(*msg), MSG_NOSIGNAL) != sizeof(*msg)) return -1;
+    return 0;
+}
+
+static int send_result(int fd, int status, const char *text)
+{
+    struct ctl_msg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CTL_RESULT;
+    msg.status = status;
+    if (text) strncpy(msg.text, text, sizeof(msg.text) - 1);
+
+    return client_send(fd, &msg);
+}
+
+/* auth_foreach() callback */
+static void send_pending(const char *devnode, const char *description,
+                         long since, void *data)
+{
+    struct reply *reply = (struct reply *) data;
+    struct ctl_msg msg;
+
+    if (reply->failed) return;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CTL_DEVICE;
+    msg.elapsed = event_now_ms() - since;
+    msg.progress = -1;
+    strncpy(msg.state, "password", sizeof(msg.state) - 1);
+    strncpy(msg.devnode, devnode, sizeof(msg.devnode) - 1);
+    strncpy(msg.text, description, sizeof(msg.text) - 1);
+
+    if (client_send(reply->fd, &msg) == -1) reply->failed = 1;
+}
+
+/* job_foreach() callback */
+static void send_job(const struct job_status *status, void *data)
+{
+    struct reply *reply = (struct reply *) data;
+    struct ctl_msg msg;
+
+    if (reply->failed) return;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CTL_DEVICE;
+    msg.elapsed = status->elapsed;
+    msg.size = status->size;
+    msg.progress = status->progress;
+    strncpy(msg.state, status->step, sizeof(msg.state) - 1);
+    strncpy(msg.devnode, status->devnode, sizeof(msg.devnode) - 1);
+    if (status->mountpoint)
+        strncpy(msg.text, status->mountpoint, sizeof(msg.text) - 1);
+
+    if (client_send(reply->fd, &msg) == -1) reply->failed = 1;
+}
+
+/*
+ * Send the devices, then CTL_END.
+ *
+ * Return 0 on success, -1 if the answer didn't go out whole.
+ */
+static int send_status(int fd)
+{
+    struct ctl_msg msg;
+    struct reply reply = {fd, 0};
+
+    auth_foreach(send_pending, &reply);
+    job_foreach(send_job, &reply);
+    if (reply.failed) return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CTL_END;
+    msg.status = job_paused();
+    return client_send(fd, &msg);
+}
+
+static void accept_event(int fd, short revents, void *data)
+{
+    while (1) {
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                log_fn("accept4(): %s", strerror(errno));
+            return;
+        }
+
+        /* The socket is root's already; don't rely on that alone. */
+        if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED,
+                       &cred, &len) == -1 || cred.uid != 0) {
+            close(client_fd);
+            continue;
+        }
+
+        if (event_add_fd(client_fd, POLLIN, client_event, NULL) == -1)
+            close(client_fd);
+    }
+}
+
+static void client_event(int fd, short revents, void *data)
+{
+    struct ctl_msg msg;
+    ssize_t n = recv(fd, &msg, sizeof(msg), 0);
+    int rt = 0, withdrawn = 0;
+
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+
+    if (n != sizeof(msg)) {
+        client_close(fd);
+        return;
+    }
+
+    msg.devnode[sizeof(msg.devnode) - 1] = '\0';
+
+    switch (msg.type) {
+        case CTL_STATUS:
+            if (send_status(fd) == -1) client_close(fd);
+            return;
+        case CTL_EJECT:
+            withdrawn = auth_withdraw(msg.devnode);
+            rt = job_eject(msg.devnode);
+            /* Only waiting for a password: done. */
+            if (rt == -1 && errno == ENOENT && withdrawn > 0) rt = 0;
+            break;
+        case CTL_RESCAN:
+            rt = job_rescan(msg.devnode);
+            break;
+        case CTL_RELOAD:
+            log_fn("Reloading.");
+            rt = trusted_load() == -1 ? -1 : 0;
+            if (rt == -1) errno = EINVAL;
+            break;
+        case CTL_PAUSE:
+        case CTL_RESUME:
+            job_pause(msg.type == CTL_PAUSE);
+            break;
+        default:
+            rt = -1;
+            errno = EINVAL;
+            break;
+    }
+
+    if (rt == 0) rt = send_result(fd, CTL_OK, NULL);
+    else rt = send_result(fd, CTL_FAILED, strerror(errno));
+
+    /* Not reading its answers, or gone. */
+    if (rt == -1) client_close(fd);
+}
+
+/*
+ * Listen on CTL_SOCKET.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int ctl_init(void)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, CTL_SOCKET, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_fn("socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    /* Left over from a previous run. */
+    unlink(CTL_SOCKET);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        log_fn("bind(): %s: %s", CTL_SOCKET, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (chmod(CTL_SOCKET, S_IRUSR | S_IWUSR) == -1
+        || listen(fd, SOMAXCONN) == -1
+        || event_add_fd(fd, POLLIN, accept_event, NULL) == -1) {
+        log_fn("Unable to listen on %s: %s", CTL_SOCKET, strerror(errno));
+        close(fd);
+        unlink(CTL_SOCKET);
+        return -1;
+    }
+
+    listen_fd = fd;
+    return 0;
+}
+
+/* Remove the socket file. */
+void ctl_cleanup(void)
+{
+    if (listen_fd == -1) return;
+
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(CTL_SOCKET);
+}
@@ -0,0 +1,10 @@
+#ifndef _SIELD_CTL_H_
+#define _SIELD_CTL_H_
+
+/*
+ * Control socket for sieldctl.
+ */
+int ctl_init(void);
+void ctl_cleanup(void);
+
+#endif
@@ -1,33 +1,104 @@
+#define _GNU_SOURCE         /* close_range() */
+#include <dirent.h>         /* opendir() */
+#include <errno.h>          /* errno */
 #include <fcntl.h>          /* open() */
-#include <stdlib.h>         /* exit() */
+#include <stddef.h>         /* offsetof() */
+#include <stdio.h>          /* snprintf() */
+#include <stdlib.h>         /* exit(), getenv() */
+#include <string.h>         /* strerror() */
+#include <sys/socket.h>     /* sendto() */
 #include <sys/stat.h>       /* umask() */
+#include <sys/syscall.h>    /* SYS_close_range */
+#include <sys/un.h>         /* struct sockaddr_un */
 #include <unistd.h>         /* fork(), setsid(), access() */
 #include "sield-daemon.h"
 #include "sield-log.h"      /* log_fn() */
 #include "sield-pid.h"      /* write_pidfile(), ... */
 
-#define MAX_OPEN 8192       /* wild guess at number of open file descriptors */
+static int close_from(unsigned int first, unsigned int last);
 
-/* Become a SysV daemon */
-int become_daemon(void)
+/*
+ * Close descriptors first..last with close_range(2), else by going
+ * through the open ones in /proc/self/fd. Never one close(2) per
+ * possible descriptor: _SC_OPEN_MAX can be over a million.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int close_from(unsigned int first, unsigned int last)
 {
-    int fd;
-    long maxfd, i;
+    DIR *dir = NULL;
+    struct dirent *entry = NULL;
+
+    if (first > last) return 0;
+
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, first, last, 0) == 0) return 0;
+#endif
+
+    /* Older kernel */
+    dir = opendir("/proc/self/fd");
+    if (dir == NULL) return -1;
+
+    while ((entry = readdir(dir)) != NULL) {
+        long fd = strtol(entry->d_name, NULL, 10);
 
-    switch (fork()) {
-        case -1: return -1;             /* error */
-        case 0: break;                  /* child process created */
-        default: exit(EXIT_FAILURE);    /* parent receives child's PID */
+        if (entry->d_name[0] == '.' || fd == dirfd(dir)) continue;
+        if (fd >= first && fd <= last) close(fd);
     }
 
-    /* Detach from any terminal and create an independent session. */
-    if (setsid() == -1) return -1;
+    closedir(dir);
+    return 0;
+}
+
+/*
+ * Close every descriptor past stderr, except keep and keep2 (-1 for
+ * none).
+ *
+ * Return 0 on success, -1 on error.
+ */
+int close_fds_except(int keep, int keep2)
+{
+    unsigned int first = STDERR_FILENO + 1;
+    int fds[2];
+    int i;
+
+    /* In increasing order. */
+    fds[0] = keep < keep2 ? keep : keep2;
+    fds[1] = keep < keep2 ? keep2 : keep;
+
+    for (i = 0; i < 2; i++) {
+        if (fds[i] < (int) first) continue;
+        if (close_from(first, fds[i] - 1) == -1) return -1;
+        first = fds[i] + 1;
+    }
+
+    return close_from(first, ~0U);
+}
+
+/*
+ * Become a SysV daemon, or with foreground set, stay attached to the
+ * supervisor which started us (stdio is kept for it).
+ */
+int become_daemon(int foreground)
+{
+    int fd;
+
+    if (!foreground) {
+        switch (fork()) {
+            case -1: return -1;             /* error */
+            case 0: break;                  /* child process created */
+            default: exit(EXIT_FAILURE);    /* parent receives child's PID */
+        }
+
+        /* Detach from any terminal and create an independent session. */
+        if (setsid() == -1) return -1;
 
-    /* Ensure that the daemon can never re-acquire a terminal again. */
-    switch (fork()) {
-        case -1: return -1;
-        case 0: break;
-        default: exit(EXIT_FAILURE);
+        /* Ensure that the daemon can never re-acquire a terminal again. */
+        switch (fork()) {
+            case -1: return -1;
+            case 0: break;
+            default: exit(EXIT_FAILURE);
+        }
     }
 
     /* Reset file mode creation mask. */
@@ -36,23 +107,71 @@ int become_daemon(void)
     /* Change current directory to root directory (/) */
     if (chdir("/") == -1) return -1;
 
-    /* Find maximum open file descriptors */
-    maxfd = sysconf(_SC_OPEN_MAX);
-    if (maxfd == -1) maxfd = MAX_OPEN;
-
-    /* Close all open file descriptors */
-    for (i = 0; i < maxfd; i++) close(i);
+    /* Close all open file descriptors, but stdio */
+    if (close_fds_except(-1, -1) == -1) return -1;
 
-    /* Connect /dev/null to stdin, stdout, stderr */
-    close(STDIN_FILENO);
+    if (!foreground) {
+        /* Connect /dev/null to stdin, stdout, stderr */
+        close(STDIN_FILENO);
 
-    fd = open("/dev/null", O_RDWR);
-    if (fd != STDIN_FILENO) return -1;
-    if (dup2(STDIN_FILENO, STDOUT_FILENO) != STDOUT_FILENO) return -1;
-    if (dup2(STDIN_FILENO, STDERR_FILENO) != STDERR_FILENO) return -1;
+        fd = open("/dev/null", O_RDWR);
+        if (fd != STDIN_FILENO) return -1;
+        if (dup2(STDIN_FILENO, STDOUT_FILENO) != STDOUT_FILENO) return -1;
+        if (dup2(STDIN_FILENO, STDERR_FILENO) != STDERR_FILENO) return -1;
+    }
 
     /* Write PID file in /var/run/ */
     if (write_pidfile() == -1) return -1;
 
     return 0;
 }
+
+/*
+ * Tell the service manager we are up (sd_notify(3) protocol), if it
+ * asked for it with $NOTIFY_SOCKET. Without it, this does nothing.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int notify_ready(void)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    char msg[64];
+    int fd, len, rt = 0;
+
+    if (path == NULL || path[0] == '\0') return 0;
+
+    /* Only absolute paths and abstract ("@") sockets */
+    if ((path[0] != '/' && path[0] != '@')
+        || strlen(path) >= sizeof(addr.sun_path)) {
+        log_fn("Invalid NOTIFY_SOCKET: %s", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (path[0] == '@') addr.sun_path[0] = '\0';
+    addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_fn("socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    len = snprintf(msg, sizeof(msg), "READY=1\nMAINPID=%ld\n",
+                   (long int)getpid());
+    if (sendto(fd, msg, len, MSG_NOSIGNAL,
+               (struct sockaddr *) &addr, addr_len) != len) {
+        log_fn("sendto(): %s: %s", path, strerror(errno));
+        rt = -1;
+    }
+
+    close(fd);
+
+    /* Only once, and not by anything we start. */
+    unsetenv("NOTIFY_SOCKET");
+    return rt;
+}
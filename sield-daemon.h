@@ -1,6 +1,8 @@
 #ifndef _SIELD_DAEMON_H_
 #define _SIELD_DAEMON_H_
 
-int become_daemon(void);
+int become_daemon(int foreground);
+int close_fds_except(int keep, int keep2);
+int notify_ready(void);
 
 #endif
@@ -0,0 +1,261 @@
+#include <errno.h>      /* errno */
+#include <poll.h>       /* poll() */
+#include <stdlib.h>     /* realloc() */
+#include <string.h>     /* strerror() */
+#include <time.h>       /* clock_gettime() */
+
+#include "sield-event.h"
+#include "sield-log.h"  /* log_fn() */
+
+struct fd_watch {
+    event_fd_fn fn;
+    void *data;
+};
+
+struct timer {
+    int id;             /* 0 => unused slot */
+    long deadline;      /* CLOCK_MONOTONIC, in ms */
+    event_timer_fn fn;
+    void *data;
+};
+
+/* Watched descriptors. pollfds[i] belongs to watches[i]. */
+static struct pollfd *pollfds = NULL;
+static struct fd_watch *watches = NULL;
+static int nwatches = 0;
+static int watch_capacity = 0;
+
+static struct timer *timers = NULL;
+static int ntimers = 0;
+static int last_timer_id = 0;
+
+static int find_fd(int fd);
+static void compact_watches(void);
+static int next_timeout(void);
+static void run_timers(void);
+
+/* Milliseconds on the monotonic clock. */
+long event_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int find_fd(int fd)
+{
+    int i;
+
+    for (i = 0; i < nwatches; i++)
+        if (pollfds[i].fd == fd) return i;
+
+    return -1;
+}
+
+/*
+ * Call fn whenever any of the poll(2) events are pending on fd.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int event_add_fd(int fd, short events, event_fd_fn fn, void *data)
+{
+    if (nwatches == watch_capacity) {
+        int capacity = watch_capacity ? watch_capacity * 2 : 16;
+        struct pollfd *p = realloc(pollfds, capacity * sizeof(*p));
+        struct fd_watch *w = NULL;
+
+        if (p == NULL) {
+            log_fn("realloc(): Memory error.");
+            return -1;
+        }
+        pollfds = p;
+
+        w = realloc(watches, capacity * sizeof(*w));
+        if (w == NULL) {
+            log_fn("realloc(): Memory error.");
+            return -1;
+        }
+        watches = w;
+        watch_capacity = capacity;
+    }
+
+    pollfds[nwatches].fd = fd;
+    pollfds[nwatches].events = events;
+    pollfds[nwatches].revents = 0;
+    watches[nwatches].fn = fn;
+    watches[nwatches].data = data;
+    nwatches++;
+
+    return 0;
+}
+
+/* Change the events watched on fd. */
+int event_set_fd_events(int fd, short events)
+{
+    int i = find_fd(fd);
+    if (i == -1) return -1;
+
+    pollfds[i].events = events;
+    return 0;
+}
+
+/*
+ * Stop watching fd.
+ * Safe to call from within a callback; the slot is reclaimed
+ * once the current round of callbacks is over.
+ */
+void event_del_fd(int fd)
+{
+    int i = find_fd(fd);
+    if (i == -1) return;
+
+    pollfds[i].fd = -1;
+    pollfds[i].events = 0;
+    pollfds[i].revents = 0;
+}
+
+/* Remove slots released by event_del_fd(). */
+static void compact_watches(void)
+{
+    int i, j;
+
+    for (i = 0, j = 0; i < nwatches; i++) {
+        if (pollfds[i].fd == -1) continue;
+        pollfds[j] = pollfds[i];
+        watches[j] = watches[i];
+        j++;
+    }
+
+    nwatches = j;
+}
+
+/*
+ * Call fn once, msec milliseconds from now.
+ *
+ * Return a positive timer id on success, -1 on error.
+ */
+int event_add_timer(long msec, event_timer_fn fn, void *data)
+{
+    int i;
+
+    for (i = 0; i < ntimers && timers[i].id != 0; i++) continue;
+
+    if (i == ntimers) {
+        struct timer *t = realloc(timers, (ntimers + 1) * sizeof(*t));
+        if (t == NULL) {
+            log_fn("realloc(): Memory error.");
+            return -1;
+        }
+        timers = t;
+        ntimers++;
+    }
+
+    timers[i].id = ++last_timer_id;
+    timers[i].deadline = event_now_ms() + msec;
+    timers[i].fn = fn;
+    timers[i].data = data;
+
+    return timers[i].id;
+}
+
+/* Cancel a timer which hasn't fired yet. */
+void event_del_timer(int id)
+{
+    int i;
+
+    if (id <= 0) return;
+
+    for (i = 0; i < ntimers; i++) {
+        if (timers[i].id == id) {
+            timers[i].id = 0;
+            return;
+        }
+    }
+}
+
+/* poll(2) timeout until the earliest timer is due. */
+static int next_timeout(void)
+{
+    int i;
+    long now = event_now_ms();
+    long timeout = -1;
+
+    for (i = 0; i < ntimers; i++) {
+        long left;
+
+        if (timers[i].id == 0) continue;
+
+        left = timers[i].deadline - now;
+        if (left < 0) left = 0;
+        if (timeout == -1 || left < timeout) timeout = left;
+    }
+
+    return (int)timeout;
+}
+
+/* Fire (and release) all the timers that are due. */
+static void run_timers(void)
+{
+    int i;
+    long now = event_now_ms();
+
+    for (i = 0; i < ntimers; i++) {
+        event_timer_fn fn;
+        void *data;
+
+        if (timers[i].id == 0 || timers[i].deadline > now) continue;
+
+        /* Release before calling, the callback may re-arm itself. */
+        fn = timers[i].fn;
+        data = timers[i].data;
+        timers[i].id = 0;
+
+        fn(data);
+    }
+}
+
+/*
+ * Wait for one round of events and run their callbacks.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int event_dispatch(void)
+{
+    int i, n, ready;
+
+    ready = poll(pollfds, nwatches, next_timeout());
+    if (ready == -1) {
+        /* Interrupted by a signal (eg. SIGCHLD) */
+        if (errno == EINTR) return 0;
+
+        log_fn("poll(): %s", strerror(errno));
+        return -1;
+    }
+
+    /* Callbacks may add watches; only look at those polled. */
+    n = nwatches;
+    for (i = 0; i < n && ready > 0; i++) {
+        short revents = pollfds[i].revents;
+
+        if (pollfds[i].fd == -1 || revents == 0) continue;
+
+        pollfds[i].revents = 0;
+        ready--;
+        watches[i].fn(pollfds[i].fd, revents, watches[i].data);
+    }
+
+    compact_watches();
+    run_timers();
+
+    return 0;
+}
+
+/* Forget all watches and timers: in a child with a loop of its own. */
+void event_reset(void)
+{
+    int i;
+
+    nwatches = 0;
+    for (i = 0; i < ntimers; i++) timers[i].id = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef _SIELD_EVENT_H_
+#define _SIELD_EVENT_H_
+
+/*
+ * Minimal poll(2) based event loop for the daemon.
+ */
+typedef void (*event_fd_fn)(int fd, short revents, void *data);
+typedef void (*event_timer_fn)(void *data);
+
+int event_add_fd(int fd, short events, event_fd_fn fn, void *data);
+int event_set_fd_events(int fd, short events);
+void event_del_fd(int fd);
+
+int event_add_timer(long msec, event_timer_fn fn, void *data);
+void event_del_timer(int id);
+
+long event_now_ms(void);
+int event_dispatch(void);
+void event_reset(void);
+
+#endif
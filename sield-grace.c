@@ -0,0 +1,150 @@
+#define _GNU_SOURCE             /* strdup() */
+#include <stdio.h>              /* snprintf() */
+#include <stdlib.h>             /* free() */
+#include <string.h>             /* strcmp() */
+
+#include "sield-config.h"       /* get_sield_attr_int() */
+#include "sield-event.h"        /* event_add_timer() */
+#include "sield-grace.h"
+#include "sield-log.h"          /* log_fn() */
+#include "sield-session.h"      /* session_user_active() */
+
+/*
+ * Each accepted device is remembered by USB vendor id, product id and
+ * serial number, along with the user who gave the password. Entries
+ * live in the daemon's memory only and are dropped by a timer once
+ * "grace period" seconds are over.
+ */
+struct grace {
+    char *key;
+    char *user;                 /* NULL => not known */
+    int timer;
+    struct grace *next;
+};
+
+static struct grace *graces = NULL;
+
+static struct grace *find_grace(const char *key);
+static void free_grace(struct grace *grace);
+static void grace_expired(void *data);
+
+static struct grace *find_grace(const char *key)
+{
+    struct grace *grace;
+
+    for (grace = graces; grace != NULL; grace = grace->next)
+        if (strcmp(grace->key, key) == 0) return grace;
+
+    return NULL;
+}
+
+static void free_grace(struct grace *grace)
+{
+    struct grace **gp;
+
+    for (gp = &graces; *gp != NULL; gp = &(*gp)->next) {
+        if (*gp == grace) {
+            *gp = grace->next;
+            break;
+        }
+    }
+
+    event_del_timer(grace->timer);
+    free(grace->key);
+    if (grace->user) free(grace->user);
+    free(grace);
+}
+
+static void grace_expired(void *data)
+{
+    struct grace *grace = (struct grace *) data;
+
+    /* The timer is released already. */
+    grace->timer = 0;
+    free_grace(grace);
+}
+
+/*
+ * Identify a USB device ("usb_device" parent) across insertions.
+ * Devices without a serial number can't be told apart from others
+ * of the same model, so they aren't given a key.
+ *
+ * Return 0 on success, -1 if there's no usable key.
+ */
+int grace_key(struct udev_device *parent, char *key, size_t size)
+{
+    const char *vendor = udev_device_get_sysattr_value(parent, "idVendor");
+    const char *product = udev_device_get_sysattr_value(parent, "idProduct");
+    const char *serial = udev_device_get_sysattr_value(parent, "serial");
+    int n;
+
+    if (vendor == NULL || product == NULL
+        || serial == NULL || serial[0] == '\0')
+        return -1;
+
+    n = snprintf(key, size, "%s:%s:%s", vendor, product, serial);
+    if (n < 0 || (size_t) n >= size) return -1;
+
+    return 0;
+}
+
+/*
+ * Remember that user (NULL if unknown) authorized the device.
+ * Does nothing unless "grace period" is set.
+ */
+void grace_remember(const char *key, const char *user)
+{
+    long period = get_sield_attr_int("grace period");
+    struct grace *grace = NULL;
+
+    if (period <= 0) return;
+
+    /* Authorized again, start over. */
+    grace = find_grace(key);
+    if (grace) free_grace(grace);
+
+    grace = calloc(1, sizeof(struct grace));
+    if (grace == NULL) {
+        log_fn("calloc(): Memory error.");
+        return;
+    }
+
+    grace->key = strdup(key);
+    if (user) grace->user = strdup(user);
+    if (grace->key == NULL || (user && grace->user == NULL)) {
+        log_fn("strdup(): Memory error.");
+        free_grace(grace);
+        return;
+    }
+
+    grace->timer = event_add_timer(period * 1000, grace_expired, grace);
+    if (grace->timer == -1) {
+        grace->timer = 0;
+        free_grace(grace);
+        return;
+    }
+
+    grace->next = graces;
+    graces = grace;
+}
+
+/*
+ * Check whether the device was authorized within the grace period.
+ * With "grace per user" set, the authorization only holds while the
+ * user who gave the password is still logged in.
+ *
+ * Return 1 and set *user (may be NULL) if so, 0 otherwise.
+ */
+int grace_lookup(const char *key, const char **user)
+{
+    struct grace *grace = find_grace(key);
+
+    if (grace == NULL) return 0;
+
+    if (get_sield_attr_bool("grace per user") == 1
+        && (grace->user == NULL || !session_user_active(grace->user)))
+        return 0;
+
+    *user = grace->user;
+    return 1;
+}
@@ -0,0 +1,17 @@
+#ifndef _SIELD_GRACE_H_
+#define _SIELD_GRACE_H_
+
+#include <libudev.h>
+#include <stddef.h>         /* size_t */
+
+/*
+ * Authorizations remembered for a while ("grace period"), so that
+ * re-inserting the same device doesn't ask for the password again.
+ */
+#define GRACE_KEY_MAX 256
+
+int grace_key(struct udev_device *parent, char *key, size_t size);
+void grace_remember(const char *key, const char *user);
+int grace_lookup(const char *key, const char **user);
+
+#endif
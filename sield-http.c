@@ -0,0 +1,1261 @@
+#define _GNU_SOURCE             /* accept4(), asprintf() */
+#include <arpa/inet.h>          /* inet_pton() */
+#include <ctype.h>              /* isxdigit() */
+#include <dirent.h>             /* scandir() */
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* open() */
+#include <limits.h>             /* NAME_MAX, PATH_MAX */
+#include <netinet/in.h>         /* struct sockaddr_in */
+#include <poll.h>               /* POLLIN, POLLOUT */
+#include <signal.h>             /* signal() */
+#include <stdarg.h>             /* va_list */
+#include <stdio.h>              /* vsnprintf() */
+#include <stdlib.h>             /* realpath(), free() */
+#include <string.h>             /* strerror() */
+#include <sys/sendfile.h>       /* sendfile() */
+#include <sys/socket.h>         /* socket() */
+#include <sys/stat.h>           /* fstat() */
+#include <time.h>               /* gmtime_r() */
+#include <unistd.h>             /* close(), fork() */
+
+#include "sield-config.h"       /* get_sield_attr_int() */
+#include "sield-daemon.h"       /* close_fds_except() */
+#include "sield-event.h"        /* event_add_fd() */
+#include "sield-http.h"
+#include "sield-log.h"          /* log_fn() */
+
+/*
+ * Read-only HTTP (and WebDAV GET/PROPFIND) export of mounted devices.
+ *
+ * Runs in a process of its own, so that file system work never holds
+ * up the daemon: the daemon only keeps the list of exports, and sends
+ * every change over a socket. A new exporter is sent the whole list.
+ * Every exported device appears as /<name>/ on the server, the
+ * server root lists all of them.
+ * File bodies are sent with sendfile(2) straight from the page cache.
+ * The listening socket only exists while something is exported.
+ *
+ * There is no authentication: the server listens on the loopback
+ * interface unless told otherwise, and only lets in the peers the
+ * samba shares' "hosts allow" would.
+ */
+
+#define HTTP_PORT 8080
+#define HTTP_MAX_CLIENTS 64
+#define HTTP_REQUEST_MAX 8192
+#define HTTP_IDLE_TIMEOUT 30000     /* ms */
+#define HTTP_RESPAWN_DELAY 1000     /* ms */
+
+static const char *HTTP_ADDRESS = "127.0.0.1";
+
+/* From the daemon to the exporter */
+enum { HTTP_EXPORT_ADD, HTTP_EXPORT_REMOVE };
+
+struct http_msg {
+    int type;
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];    /* HTTP_EXPORT_ADD */
+};
+
+/* In the daemon, path as mounted; in the exporter, canonical. */
+struct export {
+    char *name;
+    char *path;
+    struct export *next;
+};
+
+/* Growable output buffer */
+struct buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+enum conn_state {
+    CONN_READING,           /* waiting for request headers */
+    CONN_SENDING,           /* response headers/body */
+    CONN_LINGERING          /* response sent, draining the request body */
+};
+
+struct conn {
+    int fd;
+    int timer;
+    enum conn_state state;
+    char req[HTTP_REQUEST_MAX + 1];
+    size_t req_len;
+    const char *range;      /* "Range" header, points into req */
+    struct buf out;
+    size_t out_sent;
+    struct export *export;
+    int file_fd;            /* body sent with sendfile(), -1 if none */
+    off_t file_off;
+    off_t file_left;
+    struct conn *next;
+};
+
+static struct export *exports = NULL;
+static struct conn *conns = NULL;
+static int nconns = 0;
+static int listen_fd = -1;
+
+/* The daemon's end of the exporter's socket, -1 if down. */
+static pid_t exporter_pid = -1;
+static int exporter_fd = -1;
+
+static int export_send(int type, const char *name, const char *path);
+static int exporter_spawn(void);
+static void exporter_event(int fd, short revents, void *data);
+static void exporter_respawn(void *data);
+static void exporter_main(int fd);
+static void control_event(int fd, short revents, void *data);
+static struct export *export_new(const char *name, char *path);
+static void export_free(struct export *export);
+static int export_add(const char *name, const char *path);
+static void export_remove(const char *name);
+static int http_start(void);
+static void http_stop(void);
+static int host_allowed(const struct sockaddr_in *peer);
+static void accept_event(int fd, short revents, void *data);
+static void conn_event(int fd, short revents, void *data);
+static void conn_timeout(void *data);
+static void conn_touch(struct conn *conn);
+static void conn_close(struct conn *conn);
+static int conn_send(struct conn *conn);
+static void conn_linger(struct conn *conn);
+static void handle_request(struct conn *conn);
+static int buf_printf(struct buf *buf, const char *format, ...);
+static void buf_escape(struct buf *buf, const char *str, int url);
+static int url_decode(char *str);
+static void http_date(char *date, size_t len, time_t t);
+static void respond(struct conn *conn, int status, const char *reason,
+                    const char *type, const char *extra, struct buf *body,
+                    int head_only);
+static void respond_error(struct conn *conn, int status, const char *reason);
+static int parse_range(const char *range, off_t size,
+                       off_t *start, off_t *end);
+static int name_filter(const struct dirent *ent);
+static void list_directory(struct conn *conn, const char *href,
+                           const char *path, int head_only);
+static void list_exports(struct conn *conn, int head_only);
+static void propfind_entry(struct buf *body, const char *href,
+                           const struct stat *st);
+static void propfind(struct conn *conn, const char *href,
+                     const char *path, const struct stat *st, int depth);
+static void send_file(struct conn *conn, const char *path,
+                      const struct stat *st, int head_only);
+static struct export *find_export(const char *name, size_t len);
+static char *resolve_path(struct export *export, const char *rest);
+
+/*
+ * Start the exporter process. To be called before any thread is
+ * started; it is started again whenever it exits.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int http_init(void)
+{
+    if (exporter_spawn() == 0) return 0;
+
+    event_add_timer(HTTP_RESPAWN_DELAY, exporter_respawn, NULL);
+    return -1;
+}
+
+/*
+ * Make the mount point at path available as /<name>/.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int http_export_add(const char *name, const char *path)
+{
+    struct export *export;
+    char *copy;
+
+    if (strlen(name) > NAME_MAX || strlen(path) >= PATH_MAX) {
+        log_fn("Unable to export %s over HTTP: name too long.", path);
+        return -1;
+    }
+
+    copy = strdup(path);
+    export = copy ? export_new(name, copy) : NULL;
+    if (export == NULL) {
+        log_fn("strdup(): Memory error.");
+        free(copy);
+        return -1;
+    }
+
+    export->next = exports;
+    exports = export;
+
+    /* Or with the whole list, once the exporter is back. */
+    if (exporter_fd != -1) export_send(HTTP_EXPORT_ADD, name, path);
+    return 0;
+}
+
+/* Stop exporting /<name>/ and drop its connections. */
+void http_export_remove(const char *name)
+{
+    struct export **ep;
+
+    for (ep = &exports; *ep != NULL; ep = &(*ep)->next) {
+        struct export *export = *ep;
+
+        if (strcmp(export->name, name) != 0) continue;
+
+        *ep = export->next;
+        export_free(export);
+        break;
+    }
+
+    if (exporter_fd != -1) export_send(HTTP_EXPORT_REMOVE, name, NULL);
+}
+
+/*
+ * Tell the exporter about an export.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int export_send(int type, const char *name, const char *path)
+{
+    struct http_msg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    snprintf(msg.name, sizeof(msg.name), "%s", name);
+    if (path) snprintf(msg.path, sizeof(msg.path), "%s", path);
+
+    if (send(exporter_fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+        log_fn("Unable to reach the HTTP exporter: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Fork the exporter process and send it the exports.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int exporter_spawn(void)
+{
+    struct export *export;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        log_fn("socketpair(): %s", strerror(errno));
+        return -1;
+    }
+
+    switch (exporter_pid = fork()) {
+        case -1:
+            log_fn("fork(): %s", strerror(errno));
+            close(sv[0]);
+            close(sv[1]);
+            return -1;
+        case 0:
+            close(sv[0]);
+            exporter_main(sv[1]);
+            /* NOT REACHED */
+        default:
+            break;
+    }
+
+    close(sv[1]);
+    exporter_fd = sv[0];
+
+    if (event_add_fd(exporter_fd, POLLIN, exporter_event, NULL) == -1) {
+        close(exporter_fd);
+        exporter_fd = -1;
+        kill(exporter_pid, SIGTERM);
+        return -1;
+    }
+
+    for (export = exports; export != NULL; export = export->next)
+        export_send(HTTP_EXPORT_ADD, export->name, export->path);
+
+    return 0;
+}
+
+/* The exporter's socket: it only ever closes, when the exporter exits. */
+static void exporter_event(int fd, short revents, void *data)
+{
+    log_fn("HTTP exporter %ld exited.", (long) exporter_pid);
+
+    event_del_fd(exporter_fd);
+    close(exporter_fd);
+    exporter_fd = -1;
+
+    event_add_timer(HTTP_RESPAWN_DELAY, exporter_respawn, NULL);
+}
+
+static void exporter_respawn(void *data)
+{
+    if (exporter_spawn() == -1)
+        event_add_timer(HTTP_RESPAWN_DELAY, exporter_respawn, NULL);
+}
+
+/* Exporter process: serve the exports until the daemon goes away. */
+static void exporter_main(int fd)
+{
+    struct export *export;
+
+    /* The daemon's handlers, descriptors and events are not ours. */
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGSEGV, SIG_DFL);
+    /* A peer gone while sendfile() writes to it. */
+    signal(SIGPIPE, SIG_IGN);
+    close_fds_except(fd, -1);
+    event_reset();
+
+    /* Only the exporter's own list from now on. */
+    while ((export = exports) != NULL) {
+        exports = export->next;
+        export_free(export);
+    }
+
+    if (event_add_fd(fd, POLLIN, control_event, NULL) == -1)
+        exit(EXIT_FAILURE);
+
+    while (event_dispatch() == 0) continue;
+    exit(EXIT_FAILURE);
+}
+
+/* A change from the daemon. */
+static void control_event(int fd, short revents, void *data)
+{
+    struct http_msg msg;
+    ssize_t n = recv(fd, &msg, sizeof(msg), 0);
+
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) return;
+
+    /* The daemon is gone. */
+    if (n <= 0) exit(EXIT_SUCCESS);
+    if (n != sizeof(msg)) return;
+
+    msg.name[sizeof(msg.name) - 1] = '\0';
+    msg.path[sizeof(msg.path) - 1] = '\0';
+
+    if (msg.type == HTTP_EXPORT_ADD) export_add(msg.name, msg.path);
+    else if (msg.type == HTTP_EXPORT_REMOVE) export_remove(msg.name);
+}
+
+/* An export of name at path, which it takes over; NULL on error. */
+static struct export *export_new(const char *name, char *path)
+{
+    struct export *export = calloc(1, sizeof(struct export));
+
+    if (export == NULL || (export->name = strdup(name)) == NULL) {
+        free(export);
+        return NULL;
+    }
+
+    export->path = path;
+    return export;
+}
+
+static void export_free(struct export *export)
+{
+    free(export->name);
+    free(export->path);
+    free(export);
+}
+
+/*
+ * In the exporter: serve the mount point at path as /<name>/.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int export_add(const char *name, const char *path)
+{
+    struct export *export = NULL;
+    char *canonical = realpath(path, NULL);
+
+    if (canonical == NULL) {
+        log_fn("realpath(): %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    export = export_new(name, canonical);
+    if (export == NULL) {
+        log_fn("calloc(): Memory error.");
+        free(canonical);
+        return -1;
+    }
+
+    if (listen_fd == -1 && http_start() == -1) {
+        export_free(export);
+        return -1;
+    }
+
+    export->next = exports;
+    exports = export;
+
+    log_fn("Exporting %s over HTTP as /%s/.", path, name);
+    return 0;
+}
+
+/* In the exporter: stop serving /<name>/ and drop its connections. */
+static void export_remove(const char *name)
+{
+    struct export **ep;
+    struct conn *conn, *next;
+
+    for (ep = &exports; *ep != NULL; ep = &(*ep)->next) {
+        struct export *export = *ep;
+
+        if (strcmp(export->name, name) != 0) continue;
+
+        /* Don't keep files open on the device. */
+        for (conn = conns; conn != NULL; conn = next) {
+            next = conn->next;
+            if (conn->export == export) conn_close(conn);
+        }
+
+        *ep = export->next;
+        log_fn("Stopped HTTP export of %s (/%s/).", export->path, name);
+        export_free(export);
+        break;
+    }
+
+    if (exports == NULL) http_stop();
+}
+
+/* Open the listening socket. */
+static int http_start(void)
+{
+    int fd = -1;
+    int on = 1;
+    long port = get_sield_attr_int("http port");
+    char *address = get_sield_attr_no_log("http address");
+    struct sockaddr_in addr;
+
+    if (port <= 0 || port > 65535) port = HTTP_PORT;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, address ? address : HTTP_ADDRESS,
+                  &addr.sin_addr) != 1) {
+        log_fn("Invalid \"http address\" %s.", address);
+        if (address) free(address);
+        return -1;
+    }
+    if (address) free(address);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_fn("socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || listen(fd, SOMAXCONN) == -1) {
+        log_fn("Unable to listen on HTTP port %ld: %s", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (event_add_fd(fd, POLLIN, accept_event, NULL) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    listen_fd = fd;
+    log_fn("HTTP exporter listening on port %ld.", port);
+    return 0;
+}
+
+/* Close the listening socket and all the connections. */
+static void http_stop(void)
+{
+    while (conns != NULL) conn_close(conns);
+
+    if (listen_fd == -1) return;
+
+    event_del_fd(listen_fd);
+    close(listen_fd);
+    listen_fd = -1;
+    log_fn("HTTP exporter stopped.");
+}
+
+/*
+ * Is the peer let in by "hosts allow"? Like samba, the loopback
+ * address always is, and so is everyone without the setting. Entries
+ * are addresses, prefixes ("192.168.1."), networks ("10.0.0.0/8") or
+ * ALL; other forms (host names, EXCEPT) match nothing.
+ *
+ * Return 1 if allowed, 0 otherwise.
+ */
+static int host_allowed(const struct sockaddr_in *peer)
+{
+    char address[INET_ADDRSTRLEN];
+    char *hosts = NULL, *entry = NULL, *save = NULL;
+    int allowed = 0;
+
+    if (ntohl(peer->sin_addr.s_addr) == INADDR_LOOPBACK) return 1;
+
+    hosts = get_sield_attr_no_log("hosts allow");
+    if (hosts == NULL) return 1;
+
+    inet_ntop(AF_INET, &peer->sin_addr, address, sizeof(address));
+
+    for (entry = strtok_r(hosts, " \t,", &save); entry != NULL && !allowed;
+         entry = strtok_r(NULL, " \t,", &save)) {
+        char *slash = strchr(entry, '/');
+        size_t len = strlen(entry);
+
+        if (strcasecmp(entry, "ALL") == 0 || strcmp(entry, address) == 0) {
+            allowed = 1;
+        } else if (entry[len - 1] == '.') {
+            allowed = strncmp(entry, address, len) == 0;
+        } else if (slash != NULL) {
+            struct in_addr net;
+            char *end = NULL;
+            long bits = strtol(slash + 1, &end, 10);
+
+            *slash = '\0';
+            if (*end == '\0' && bits >= 0 && bits <= 32
+                && inet_pton(AF_INET, entry, &net) == 1) {
+                uint32_t mask = bits == 0 ? 0 : ~0U << (32 - bits);
+                allowed = ((ntohl(peer->sin_addr.s_addr) ^ ntohl(net.s_addr))
+                           & mask) == 0;
+            }
+        }
+    }
+
+    free(hosts);
+    return allowed;
+}
+
+static void accept_event(int fd, short revents, void *data)
+{
+    while (1) {
+        struct conn *conn = NULL;
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        int client = accept4(fd, (struct sockaddr *) &peer, &len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                log_fn("accept4(): %s", strerror(errno));
+            return;
+        }
+
+        if (!host_allowed(&peer)) {
+            char address[INET_ADDRSTRLEN];
+
+            inet_ntop(AF_INET, &peer.sin_addr, address, sizeof(address));
+            log_fn("HTTP connection from %s refused by \"hosts allow\".",
+                   address);
+            close(client);
+            continue;
+        }
+
+        if (nconns >= HTTP_MAX_CLIENTS
+            || (conn = calloc(1, sizeof(struct conn))) == NULL) {
+            close(client);
+            continue;
+        }
+
+        conn->fd = client;
+        conn->file_fd = -1;
+        conn->state = CONN_READING;
+
+        if (event_add_fd(client, POLLIN, conn_event, conn) == -1) {
+            close(client);
+            free(conn);
+            continue;
+        }
+
+        conn->next = conns;
+        conns = conn;
+        nconns++;
+        conn_touch(conn);
+    }
+}
+
+/* Restart the idle timer. */
+static void conn_touch(struct conn *conn)
+{
+    event_del_timer(conn->timer);
+    conn->timer = event_add_timer(HTTP_IDLE_TIMEOUT, conn_timeout, conn);
+}
+
+static void conn_timeout(void *data)
+{
+    struct conn *conn = (struct conn *) data;
+
+    conn->timer = 0;
+    conn_close(conn);
+}
+
+static void conn_close(struct conn *conn)
+{
+    struct conn **cp;
+
+    for (cp = &conns; *cp != NULL; cp = &(*cp)->next) {
+        if (*cp == conn) {
+            *cp = conn->next;
+            break;
+        }
+    }
+
+    event_del_timer(conn->timer);
+    event_del_fd(conn->fd);
+    close(conn->fd);
+    if (conn->file_fd != -1) close(conn->file_fd);
+    free(conn->out.data);
+    free(conn);
+    nconns--;
+}
+
+static void conn_event(int fd, short revents, void *data)
+{
+    struct conn *conn = (struct conn *) data;
+    ssize_t n;
+
+    conn_touch(conn);
+
+    switch (conn->state) {
+    case CONN_READING:
+        n = recv(fd, conn->req + conn->req_len,
+                 HTTP_REQUEST_MAX - conn->req_len, 0);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+        if (n <= 0) {
+            conn_close(conn);
+            return;
+        }
+
+        conn->req_len += n;
+        conn->req[conn->req_len] = '\0';
+
+        if (strstr(conn->req, "\r\n\r\n") != NULL) {
+            handle_request(conn);
+        } else if (conn->req_len == HTTP_REQUEST_MAX) {
+            respond_error(conn, 431, "Request Header Fields Too Large");
+        } else {
+            return;
+        }
+
+        conn->state = CONN_SENDING;
+        event_set_fd_events(fd, POLLOUT);
+        /* Fall through, the socket is most likely writable already. */
+
+    case CONN_SENDING:
+        if (conn_send(conn) == -1) conn_close(conn);
+        break;
+
+    case CONN_LINGERING:
+        {
+            char discard[4096];
+
+            n = recv(fd, discard, sizeof(discard), 0);
+            if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+            if (n <= 0) conn_close(conn);
+        }
+        break;
+    }
+}
+
+/*
+ * Write as much of the response as the socket takes.
+ *
+ * Return 0 if the connection should be kept, -1 to close it.
+ */
+static int conn_send(struct conn *conn)
+{
+    while (conn->out_sent < conn->out.len) {
+        ssize_t n = send(conn->fd, conn->out.data + conn->out_sent,
+                         conn->out.len - conn->out_sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            return -1;
+        }
+        conn->out_sent += n;
+    }
+
+    /* Zero-copy body */
+    while (conn->file_fd != -1 && conn->file_left > 0) {
+        ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->file_off,
+                             conn->file_left);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            return -1;
+        }
+
+        /* File shrunk underneath us. */
+        if (n == 0) return -1;
+
+        conn->file_left -= n;
+    }
+
+    conn_linger(conn);
+    return 0;
+}
+
+/*
+ * Response is out. Half-close and drain whatever the client still
+ * sends (eg. a PROPFIND body), closing with unread data would reset
+ * the connection and could discard the response.
+ */
+static void conn_linger(struct conn *conn)
+{
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+
+    shutdown(conn->fd, SHUT_WR);
+    conn->state = CONN_LINGERING;
+    event_set_fd_events(conn->fd, POLLIN);
+}
+
+static int buf_printf(struct buf *buf, const char *format, ...)
+{
+    va_list arg;
+    int n;
+
+    while (1) {
+        va_start(arg, format);
+        n = vsnprintf(buf->data ? buf->data + buf->len : NULL,
+                      buf->cap - buf->len, format, arg);
+        va_end(arg);
+
+        if (n < 0) return -1;
+        if (buf->len + n < buf->cap) break;
+
+        {
+            size_t cap = buf->cap ? buf->cap * 2 : 1024;
+            char *data = NULL;
+
+            while (cap <= buf->len + n) cap *= 2;
+            data = realloc(buf->data, cap);
+            if (data == NULL) {
+                log_fn("realloc(): Memory error.");
+                return -1;
+            }
+            buf->data = data;
+            buf->cap = cap;
+        }
+    }
+
+    buf->len += n;
+    return 0;
+}
+
+/* Append str, escaped for HTML/XML text (or a URL path if url != 0). */
+static void buf_escape(struct buf *buf, const char *str, int url)
+{
+    const unsigned char *s;
+
+    for (s = (const unsigned char *) str; *s != '\0'; s++) {
+        if (url) {
+            if (isalnum(*s) || strchr("/-_.~", *s) != NULL)
+                buf_printf(buf, "%c", *s);
+            else
+                buf_printf(buf, "%%%02X", *s);
+        } else if (*s == '<') {
+            buf_printf(buf, "&lt;");
+        } else if (*s == '>') {
+            buf_printf(buf, "&gt;");
+        } else if (*s == '&') {
+            buf_printf(buf, "&amp;");
+        } else if (*s == '"') {
+            buf_printf(buf, "&quot;");
+        } else {
+            buf_printf(buf, "%c", *s);
+        }
+    }
+}
+
+/*
+ * Decode %XX escapes in place.
+ *
+ * Return 0 on success, -1 on a malformed or NUL escape.
+ */
+static int url_decode(char *str)
+{
+    char *in = str, *out = str;
+
+    while (*in != '\0') {
+        if (*in == '%') {
+            char hex[3] = {0};
+            long c;
+
+            if (!isxdigit((unsigned char) in[1])
+                || !isxdigit((unsigned char) in[2]))
+                return -1;
+
+            hex[0] = in[1];
+            hex[1] = in[2];
+            c = strtol(hex, NULL, 16);
+            if (c == 0) return -1;
+
+            *out++ = (char) c;
+            in += 3;
+        } else {
+            *out++ = *in++;
+        }
+    }
+
+    *out = '\0';
+    return 0;
+}
+
+static void http_date(char *date, size_t len, time_t t)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(date, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Queue status line, headers and an optional in-memory body. */
+static void respond(struct conn *conn, int status, const char *reason,
+                    const char *type, const char *extra, struct buf *body,
+                    int head_only)
+{
+    char date[64];
+
+    http_date(date, sizeof(date), time(NULL));
+
+    conn->out.len = 0;
+    buf_printf(&conn->out,
+               "HTTP/1.1 %d %s\r\n"
+               "Date: %s\r\n"
+               "Server: sield\r\n"
+               "Connection: close\r\n"
+               "X-Content-Type-Options: nosniff\r\n"
+               "%s",
+               status, reason, date, extra ? extra : "");
+
+    if (body != NULL) {
+        buf_printf(&conn->out, "Content-Type: %s\r\n"
+                   "Content-Length: %zu\r\n\r\n", type, body->len);
+        if (!head_only && body->len > 0)
+            buf_printf(&conn->out, "%.*s", (int) body->len, body->data);
+    } else {
+        buf_printf(&conn->out, "\r\n");
+    }
+}
+
+static void respond_error(struct conn *conn, int status, const char *reason)
+{
+    struct buf body = {NULL, 0, 0};
+
+    buf_printf(&body, "%d %s\n", status, reason);
+    respond(conn, status, reason, "text/plain", NULL, &body, 0);
+    free(body.data);
+}
+
+/*
+ * Parse a single "bytes=" range against a file of given size.
+ *
+ * Return 1 if a range is to be served, 0 to serve the whole file,
+ * -1 if the range is unsatisfiable.
+ */
+static int parse_range(const char *range, off_t size,
+                       off_t *start, off_t *end)
+{
+    long long first = -1, last = -1;
+    const char *p;
+
+    if (range == NULL || strncmp(range, "bytes=", 6) != 0) return 0;
+    p = range + 6;
+
+    /* Multiple ranges aren't supported; the whole file is fine. */
+    if (strchr(p, ',') != NULL) return 0;
+
+    if (*p == '-') {
+        /* Suffix: last N bytes */
+        if (sscanf(p + 1, "%lld", &last) != 1 || last <= 0) return -1;
+        if (size == 0) return -1;
+        *start = (last >= size) ? 0 : size - last;
+        *end = size - 1;
+        return 1;
+    }
+
+    if (sscanf(p, "%lld-%lld", &first, &last) < 1) return 0;
+    if (first < 0 || first >= size) return -1;
+
+    if (last == -1 || last >= size) last = size - 1;
+    if (last < first) return 0;
+
+    *start = first;
+    *end = last;
+    return 1;
+}
+
+/* Skip "." and ".." */
+static int name_filter(const struct dirent *ent)
+{
+    if (strcmp(ent->d_name, ".") == 0) return 0;
+    if (strcmp(ent->d_name, "..") == 0) return 0;
+    return 1;
+}
+
+static void list_directory(struct conn *conn, const char *href,
+                           const char *path, int head_only)
+{
+    int i, n;
+    struct dirent **entries = NULL;
+    struct buf body = {NULL, 0, 0};
+
+    n = scandir(path, &entries, name_filter, alphasort);
+    if (n == -1) {
+        respond_error(conn, 403, "Forbidden");
+        return;
+    }
+
+    buf_printf(&body, "<!DOCTYPE html>\n<html><head><title>");
+    buf_escape(&body, href, 0);
+    buf_printf(&body, "</title></head><body>\n<h1>");
+    buf_escape(&body, href, 0);
+    buf_printf(&body, "</h1>\n<ul>\n<li><a href=\"../\">../</a></li>\n");
+
+    for (i = 0; i < n; i++) {
+        int is_dir = (entries[i]->d_type == DT_DIR);
+
+        buf_printf(&body, "<li><a href=\"");
+        buf_escape(&body, entries[i]->d_name, 1);
+        buf_printf(&body, "%s\">", is_dir ? "/" : "");
+        buf_escape(&body, entries[i]->d_name, 0);
+        buf_printf(&body, "%s</a></li>\n", is_dir ? "/" : "");
+        free(entries[i]);
+    }
+    free(entries);
+
+    buf_printf(&body, "</ul>\n</body></html>\n");
+    respond(conn, 200, "OK", "text/html; charset=utf-8", NULL,
+            &body, head_only);
+    free(body.data);
+}
+
+/* Server root: one directory per exported device. */
+static void list_exports(struct conn *conn, int head_only)
+{
+    struct export *export;
+    struct buf body = {NULL, 0, 0};
+
+    buf_printf(&body, "<!DOCTYPE html>\n<html><head><title>sield</title>"
+               "</head><body>\n<h1>Devices</h1>\n<ul>\n");
+
+    for (export = exports; export != NULL; export = export->next) {
+        buf_printf(&body, "<li><a href=\"");
+        buf_escape(&body, export->name, 1);
+        buf_printf(&body, "/\">");
+        buf_escape(&body, export->name, 0);
+        buf_printf(&body, "/</a></li>\n");
+    }
+
+    buf_printf(&body, "</ul>\n</body></html>\n");
+    respond(conn, 200, "OK", "text/html; charset=utf-8", NULL,
+            &body, head_only);
+    free(body.data);
+}
+
+static void propfind_entry(struct buf *body, const char *href,
+                           const struct stat *st)
+{
+    char date[64];
+
+    http_date(date, sizeof(date), st->st_mtime);
+
+    buf_printf(body, "<D:response><D:href>");
+    buf_escape(body, href, 1);
+    buf_printf(body, "</D:href><D:propstat><D:prop>");
+
+    if (S_ISDIR(st->st_mode))
+        buf_printf(body, "<D:resourcetype><D:collection/></D:resourcetype>");
+    else
+        buf_printf(body, "<D:resourcetype/>"
+                   "<D:getcontentlength>%lld</D:getcontentlength>",
+                   (long long) st->st_size);
+
+    buf_printf(body, "<D:getlastmodified>%s</D:getlastmodified>"
+               "</D:prop><D:status>HTTP/1.1 200 OK</D:status>"
+               "</D:propstat></D:response>\n", date);
+}
+
+/* WebDAV PROPFIND, Depth 0 or 1. */
+static void propfind(struct conn *conn, const char *href,
+                     const char *path, const struct stat *st, int depth)
+{
+    struct buf body = {NULL, 0, 0};
+    /* Children are under "<href>/", with or without the slash asked. */
+    const char *sep = S_ISDIR(st->st_mode) && href[strlen(href) - 1] != '/'
+                      ? "/" : "";
+
+    buf_printf(&body, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+               "<D:multistatus xmlns:D=\"DAV:\">\n");
+
+    propfind_entry(&body, href, st);
+
+    if (depth > 0 && S_ISDIR(st->st_mode)) {
+        int i, n;
+        struct dirent **entries = NULL;
+
+        n = scandir(path, &entries, name_filter, alphasort);
+        for (i = 0; i < n; i++) {
+            char *child_path = NULL;
+            char *child_href = NULL;
+            struct stat child_st;
+
+            if (asprintf(&child_path, "%s/%s",
+                         path, entries[i]->d_name) != -1
+                && lstat(child_path, &child_st) == 0
+                && asprintf(&child_href, "%s%s%s%s", href, sep,
+                            entries[i]->d_name,
+                            S_ISDIR(child_st.st_mode) ? "/" : "") != -1) {
+                propfind_entry(&body, child_href, &child_st);
+                free(child_href);
+            }
+
+            free(child_path);
+            free(entries[i]);
+        }
+        if (n > 0) free(entries);
+    }
+
+    buf_printf(&body, "</D:multistatus>\n");
+    respond(conn, 207, "Multi-Status", "application/xml; charset=utf-8",
+            NULL, &body, 0);
+    free(body.data);
+}
+
+/* Serve a regular file, or a range of it. */
+static void send_file(struct conn *conn, const char *path,
+                      const struct stat *st, int head_only)
+{
+    char date[64];
+    char extra[256];
+    struct buf headers = {NULL, 0, 0};
+    off_t start = 0, end = st->st_size - 1;
+    int ranged = parse_range(conn->range, st->st_size, &start, &end);
+
+    if (ranged == -1) {
+        snprintf(extra, sizeof(extra), "Content-Range: bytes */%lld\r\n",
+                 (long long) st->st_size);
+        respond(conn, 416, "Range Not Satisfiable", NULL, extra, NULL, 0);
+        return;
+    }
+
+    if (!head_only) {
+        struct stat fd_st;
+
+        /*
+         * O_NONBLOCK: if the file was swapped for a FIFO since it
+         * was looked at, don't hang the daemon opening it.
+         */
+        conn->file_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (conn->file_fd == -1
+            || fstat(conn->file_fd, &fd_st) == -1
+            || !S_ISREG(fd_st.st_mode) || fd_st.st_size != st->st_size) {
+            if (conn->file_fd != -1) close(conn->file_fd);
+            conn->file_fd = -1;
+            respond_error(conn, 403, "Forbidden");
+            return;
+        }
+    }
+
+    http_date(date, sizeof(date), st->st_mtime);
+
+    buf_printf(&headers,
+               "Content-Type: application/octet-stream\r\n"
+               "Content-Length: %lld\r\n"
+               "Accept-Ranges: bytes\r\n"
+               "Last-Modified: %s\r\n",
+               (long long) (st->st_size ? end - start + 1 : 0), date);
+    if (ranged)
+        buf_printf(&headers, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                   (long long) start, (long long) end,
+                   (long long) st->st_size);
+
+    respond(conn, ranged ? 206 : 200, ranged ? "Partial Content" : "OK",
+            NULL, headers.data, NULL, 0);
+    free(headers.data);
+
+    conn->file_off = start;
+    conn->file_left = st->st_size ? end - start + 1 : 0;
+}
+
+static struct export *find_export(const char *name, size_t len)
+{
+    struct export *export;
+
+    for (export = exports; export != NULL; export = export->next)
+        if (strlen(export->name) == len && strncmp(export->name, name, len) == 0)
+            return export;
+
+    return NULL;
+}
+
+/*
+ * Map a request path below an export to a file system path.
+ * Symbolic links on the device must not lead outside of it.
+ *
+ * Return the canonical path, or NULL if it doesn't exist or
+ * escapes the export.
+ */
+static char *resolve_path(struct export *export, const char *rest)
+{
+    char *path = NULL;
+    char *resolved = NULL;
+    size_t len = strlen(export->path);
+
+    if (asprintf(&path, "%s/%s", export->path, rest) == -1) return NULL;
+
+    resolved = realpath(path, NULL);
+    free(path);
+    if (resolved == NULL) return NULL;
+
+    if (strncmp(resolved, export->path, len) != 0
+        || (resolved[len] != '\0' && resolved[len] != '/')) {
+        free(resolved);
+        return NULL;
+    }
+
+    return resolved;
+}
+
+/* Parse the request headers and queue the response. */
+static void handle_request(struct conn *conn)
+{
+    int head_only, is_propfind, depth = 1;
+    char *save = NULL, *line_save = NULL;
+    char *line, *method, *target, *version, *rest, *slash, *path;
+    char *end = strstr(conn->req, "\r\n\r\n");
+    struct export *export;
+    struct stat st;
+
+    end[2] = '\0';
+
+    line = strtok_r(conn->req, "\r\n", &save);
+    method = line ? strtok_r(line, " ", &line_save) : NULL;
+    target = method ? strtok_r(NULL, " ", &line_save) : NULL;
+    version = target ? strtok_r(NULL, " ", &line_save) : NULL;
+
+    if (version == NULL || strncmp(version, "HTTP/1.", 7) != 0) {
+        respond_error(conn, 400, "Bad Request");
+        return;
+    }
+
+    while ((line = strtok_r(NULL, "\r\n", &save)) != NULL) {
+        char *value = strchr(line, ':');
+        if (value == NULL) continue;
+
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t') value++;
+
+        if (strcasecmp(line, "Range") == 0) conn->range = value;
+        if (strcasecmp(line, "Depth") == 0 && strcmp(value, "0") == 0)
+            depth = 0;
+    }
+
+    if (strcmp(method, "OPTIONS") == 0) {
+        respond(conn, 200, "OK", NULL,
+                "Allow: GET, HEAD, OPTIONS, PROPFIND\r\n"
+                "DAV: 1\r\n"
+                "Content-Length: 0\r\n", NULL, 0);
+        return;
+    }
+
+    head_only = (strcmp(method, "HEAD") == 0);
+    is_propfind = (strcmp(method, "PROPFIND") == 0);
+
+    if (!head_only && !is_propfind && strcmp(method, "GET") != 0) {
+        respond(conn, 405, "Method Not Allowed", NULL,
+                "Allow: GET, HEAD, OPTIONS, PROPFIND\r\n"
+                "Content-Length: 0\r\n", NULL, 0);
+        return;
+    }
+
+    /* Drop query string, decode and refuse to climb up. */
+    target[strcspn(target, "?#")] = '\0';
+    if (target[0] != '/' || url_decode(target) == -1
+        || strstr(target, "/../") != NULL
+        || (strlen(target) >= 3
+            && strcmp(target + strlen(target) - 3, "/..") == 0)) {
+        respond_error(conn, 400, "Bad Request");
+        return;
+    }
+
+    if (strcmp(target, "/") == 0) {
+        if (is_propfind) {
+            struct stat root_st;
+            struct buf body = {NULL, 0, 0};
+
+            buf_printf(&body, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                       "<D:multistatus xmlns:D=\"DAV:\">\n");
+            memset(&root_st, 0, sizeof(root_st));
+            root_st.st_mode = S_IFDIR;
+            root_st.st_mtime = time(NULL);
+            propfind_entry(&body, "/", &root_st);
+
+            for (export = exports; depth > 0 && export != NULL;
+                 export = export->next) {
+                char *href = NULL;
+
+                if (stat(export->path, &st) == 0
+                    && asprintf(&href, "/%s/", export->name) != -1) {
+                    propfind_entry(&body, href, &st);
+                    free(href);
+                }
+            }
+
+            buf_printf(&body, "</D:multistatus>\n");
+            respond(conn, 207, "Multi-Status",
+                    "application/xml; charset=utf-8", NULL, &body, 0);
+            free(body.data);
+        } else {
+            list_exports(conn, head_only);
+        }
+        return;
+    }
+
+    /* "/<export>/<rest>" */
+    slash = strchr(target + 1, '/');
+    export = find_export(target + 1, slash ? (size_t)(slash - target - 1)
+                                           : strlen(target + 1));
+    if (export == NULL) {
+        respond_error(conn, 404, "Not Found");
+        return;
+    }
+    rest = slash ? slash + 1 : "";
+
+    path = resolve_path(export, rest);
+    if (path == NULL || stat(path, &st) == -1) {
+        if (path) free(path);
+        respond_error(conn, 404, "Not Found");
+        return;
+    }
+
+    conn->export = export;
+
+    if (S_ISDIR(st.st_mode) && target[strlen(target) - 1] != '/'
+        && !is_propfind) {
+        /* Relative links in the listing need the trailing slash. */
+        struct buf location = {NULL, 0, 0};
+
+        buf_printf(&location, "Location: ");
+        buf_escape(&location, target, 1);
+        buf_printf(&location, "/\r\nContent-Length: 0\r\n");
+        respond(conn, 301, "Moved Permanently", NULL, location.data, NULL, 0);
+        free(location.data);
+    } else if (is_propfind) {
+        propfind(conn, target, path, &st, depth);
+    } else if (S_ISDIR(st.st_mode)) {
+        list_directory(conn, target, path, head_only);
+    } else if (S_ISREG(st.st_mode)) {
+        send_file(conn, path, &st, head_only);
+    } else {
+        respond_error(conn, 403, "Forbidden");
+    }
+
+    free(path);
+}
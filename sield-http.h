@@ -0,0 +1,11 @@
+#ifndef _SIELD_HTTP_H_
+#define _SIELD_HTTP_H_
+
+/*
+ * Built-in read-only HTTP/WebDAV export of mounted devices.
+ */
+int http_init(void);
+int http_export_add(const char *name, const char *path);
+void http_export_remove(const char *name);
+
+#endif
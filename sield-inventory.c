@@ -0,0 +1,347 @@
+#define _GNU_SOURCE         /* asprintf() */
+#include <errno.h>          /* errno */
+#include <fcntl.h>          /* open() */
+#include <stdio.h>          /* snprintf(), rename() */
+#include <stdlib.h>         /* free() */
+#include <string.h>         /* strcmp(), strncpy() */
+#include <sys/mman.h>       /* mmap() */
+#include <sys/stat.h>       /* fstat(), mkdir() */
+#include <time.h>           /* time() */
+#include <unistd.h>         /* ftruncate(), fsync() */
+
+#include "sield-inventory.h"
+#include "sield-journal.h"  /* enum journal_verdict */
+#include "sield-log.h"      /* log_fn() */
+
+/*
+ * The inventory is a hash table in a file, mapped into memory: a
+ * header followed by a power of 2 slots, with linear probing on the
+ * hash of the device's identity. Lookups and updates touch one or two
+ * slots and make no system call; the kernel writes dirty pages back.
+ *
+ * Only the daemon writes it. Once half full, it is rebuilt twice as
+ * big in a new file, which is renamed over the old one: readers
+ * (sieldctl) never see a half-built table.
+ *
+ * Records are never removed.
+ */
+static const char *INVENTORY_DIR = "/var/lib/sield";
+static const char *INVENTORY_FILE = "/var/lib/sield/inventory";
+
+#define INVENTORY_MAGIC "SIELDIV1"
+#define INITIAL_SLOTS 256
+
+struct inventory_header {
+    char magic[8];
+    uint32_t slots;                 /* A power of 2 */
+    uint32_t records;
+    uint32_t record_size;           /* sizeof(struct inventory_record) */
+    char reserved[44];
+};
+
+static struct inventory_header *header = NULL;
+static size_t map_size = 0;
+static int map_writable = 0;
+
+static uint64_t hash_id(const char *id);
+static struct inventory_record *slot(uint64_t hash, const char *id);
+static size_t file_size(uint32_t slots);
+static int map_file(void);
+static int create_file(uint32_t slots);
+
+/* FNV-1a; never 0, which marks free slots. */
+static uint64_t hash_id(const char *id)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*id != '\0') {
+        hash ^= (unsigned char) *id++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash ? hash : 1;
+}
+
+/* The record for id, else the free slot where it would go. */
+static struct inventory_record *slot(uint64_t hash, const char *id)
+{
+    struct inventory_record *records =
+        (struct inventory_record *) (header + 1);
+    uint32_t mask = header->slots - 1;
+    uint32_t i = hash & mask;
+
+    while (records[i].hash != 0) {
+        if (records[i].hash == hash && strcmp(records[i].id, id) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+
+    return &records[i];
+}
+
+static size_t file_size(uint32_t slots)
+{
+    return sizeof(struct inventory_header)
+           + (size_t) slots * sizeof(struct inventory_record);
+}
+
+/*
+ * Map INVENTORY_FILE, replacing the current mapping.
+ *
+ * Return 0 on success, -1 with errno set on error (EINVAL: not an
+ * inventory, or of another version).
+ */
+static int map_file(void)
+{
+    struct stat st;
+    struct inventory_header *h = NULL;
+    int fd = open(INVENTORY_FILE, (map_writable ? O_RDWR : O_RDONLY)
+                                  | O_CLOEXEC);
+
+    if (fd == -1) return -1;
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if ((size_t) st.st_size < sizeof(struct inventory_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    h = mmap(NULL, st.st_size,
+             PROT_READ | (map_writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) return -1;
+
+    if (memcmp(h->magic, INVENTORY_MAGIC, sizeof(h->magic)) != 0
+        || h->record_size != sizeof(struct inventory_record)
+        || h->slots == 0 || (h->slots & (h->slots - 1)) != 0
+        || file_size(h->slots) != (size_t) st.st_size) {
+        munmap(h, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (header) munmap(header, map_size);
+    header = h;
+    map_size = st.st_size;
+    return 0;
+}
+
+/*
+ * Write a new inventory with the given number of slots, holding the
+ * records of the current one if any, and map it.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int create_file(uint32_t slots)
+{
+    char *tmp = NULL;
+    struct inventory_header *h = NULL;
+    struct inventory_header *old = header;
+    size_t size = file_size(slots);
+    int fd = -1;
+
+    if (asprintf(&tmp, "%s.tmp", INVENTORY_FILE) == -1) {
+        log_fn("asprintf(): Memory error.");
+        return -1;
+    }
+
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        log_fn("open(): %s: %s", tmp, strerror(errno));
+        free(tmp);
+        return -1;
+    }
+
+    if (ftruncate(fd, size) == -1
+        || (h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0)) == MAP_FAILED) {
+        log_fn("Unable to create %s: %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    memcpy(h->magic, INVENTORY_MAGIC, sizeof(h->magic));
+    h->slots = slots;
+    h->record_size = sizeof(struct inventory_record);
+
+    /* Rehash into the new table. */
+    if (old) {
+        struct inventory_record *records =
+            (struct inventory_record *) (old + 1);
+        uint32_t i;
+
+        header = h;
+        for (i = 0; i < old->slots; i++) {
+            if (records[i].hash == 0) continue;
+            *slot(records[i].hash, records[i].id) = records[i];
+            h->records++;
+        }
+        header = old;
+    }
+
+    munmap(h, size);
+
+    if (fsync(fd) == -1 || rename(tmp, INVENTORY_FILE) == -1) {
+        log_fn("Unable to write %s: %s", INVENTORY_FILE, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    close(fd);
+    free(tmp);
+
+    return map_file();
+}
+
+/*
+ * Map the inventory; the daemon (writable) creates it if needed.
+ *
+ * Return 0 on success, -1 on error. Without an inventory, nothing is
+ * found or recorded.
+ */
+int inventory_open(int writable)
+{
+    map_writable = writable;
+
+    if (map_file() == 0) return 0;
+    if (!writable) return -1;
+
+    if (errno == EINVAL)
+        log_fn("%s is not a usable inventory, starting a new one.",
+               INVENTORY_FILE);
+    else if (errno != ENOENT)
+        log_fn("%s: %s", INVENTORY_FILE, strerror(errno));
+
+    if (mkdir(INVENTORY_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)
+        == -1 && errno != EEXIST) {
+        log_fn("mkdir(): %s: %s", INVENTORY_DIR, strerror(errno));
+        return -1;
+    }
+
+    return create_file(INITIAL_SLOTS);
+}
+
+/*
+ * Identity of a device: USB vendor and product id, serial number and
+ * file system UUID ("" when unknown).
+ *
+ * Return 0 on success, -1 if it doesn't fit in size.
+ */
+int inventory_id(struct udev_device *device, struct udev_device *parent,
+                 char *id, size_t size)
+{
+    const char *vendor = udev_device_get_sysattr_value(parent, "idVendor");
+    const char *product = udev_device_get_sysattr_value(parent, "idProduct");
+    const char *serial = udev_device_get_sysattr_value(parent, "serial");
+    const char *uuid = udev_device_get_property_value(device, "ID_FS_UUID");
+    int n = snprintf(id, size, "%s:%s:%s:%s",
+                     vendor ? vendor : "", product ? product : "",
+                     serial ? serial : "", uuid ? uuid : "");
+
+    if (n < 0 || (size_t) n >= size) return -1;
+    return 0;
+}
+
+/*
+ * Return the record of a device, NULL if it was never seen.
+ * Valid until the next inventory_seen().
+ */
+const struct inventory_record *inventory_find(const char *id)
+{
+    const struct inventory_record *record = NULL;
+
+    if (header == NULL) return NULL;
+
+    record = slot(hash_id(id), id);
+    return record->hash != 0 ? record : NULL;
+}
+
+/*
+ * A device was plugged in: count it, adding it if it's new.
+ *
+ * Return its record, valid until the next inventory_seen(); NULL on
+ * error.
+ */
+const struct inventory_record *inventory_seen(const char *id,
+                                              const char *description)
+{
+    struct inventory_record *record = NULL;
+    uint64_t hash = hash_id(id);
+    time_t now = time(NULL);
+
+    if (header == NULL || !map_writable) return NULL;
+
+    record = slot(hash, id);
+
+    if (record->hash == 0) {
+        /* Keep at least half of the slots free. */
+        if ((header->records + 1) * 2 > header->slots) {
+            if (create_file(header->slots * 2) == -1) return NULL;
+            record = slot(hash, id);
+        }
+
+        memset(record, 0, sizeof(*record));
+        strncpy(record->id, id, sizeof(record->id) - 1);
+        record->first_seen = now;
+        record->hash = hash;
+        header->records++;
+    }
+
+    if (description)
+        strncpy(record->description, description,
+                sizeof(record->description) - 1);
+    record->last_seen = now;
+    record->inserts++;
+
+    return record;
+}
+
+/* Outcome of a device's scan. */
+void inventory_scanned(const char *id, int verdict, long ms,
+                       unsigned long long bytes)
+{
+    struct inventory_record *record = NULL;
+
+    if (header == NULL || !map_writable) return;
+
+    record = slot(hash_id(id), id);
+    if (record->hash == 0) return;
+
+    record->verdict = verdict;
+    record->scan_ms = ms;
+    record->scan_bytes = bytes;
+}
+
+/* Name of a record's verdict. */
+const char *inventory_verdict(int verdict)
+{
+    switch (verdict) {
+        case VERDICT_CLEAN: return "clean";
+        case VERDICT_ERRORS: return "errors";
+        case VERDICT_INFECTED: return "infected";
+        case VERDICT_ON_ACCESS: return "on access";
+        default: return "not scanned";
+    }
+}
+
+/* Call fn for every device seen, in no particular order. */
+void inventory_foreach(inventory_fn fn, void *data)
+{
+    const struct inventory_record *records;
+    uint32_t i;
+
+    if (header == NULL) return;
+
+    records = (const struct inventory_record *) (header + 1);
+    for (i = 0; i < header->slots; i++)
+        if (records[i].hash != 0) fn(&records[i], data);
+}
@@ -0,0 +1,42 @@
+#ifndef _SIELD_INVENTORY_H_
+#define _SIELD_INVENTORY_H_
+
+#include <libudev.h>
+#include <stddef.h>         /* size_t */
+#include <stdint.h>         /* uint64_t */
+
+/*
+ * Every device ever seen, kept on disk: identity, when it was seen,
+ * and the outcome of its last scan.
+ */
+#define INVENTORY_ID_MAX 160
+#define INVENTORY_DESCRIPTION_MAX 80
+
+/* Layout on disk; fixed size, 0 => unknown. */
+struct inventory_record {
+    uint64_t hash;                  /* 0 => free slot */
+    int64_t first_seen;             /* time(2) */
+    int64_t last_seen;
+    int64_t scan_ms;                /* Last scan */
+    uint64_t scan_bytes;
+    uint32_t inserts;
+    int32_t verdict;                /* enum journal_verdict */
+    char id[INVENTORY_ID_MAX];      /* inventory_id() */
+    char description[INVENTORY_DESCRIPTION_MAX];
+};
+
+typedef void (*inventory_fn)(const struct inventory_record *record,
+                             void *data);
+
+int inventory_open(int writable);
+int inventory_id(struct udev_device *device, struct udev_device *parent,
+                 char *id, size_t size);
+const struct inventory_record *inventory_find(const char *id);
+const struct inventory_record *inventory_seen(const char *id,
+                                              const char *description);
+void inventory_scanned(const char *id, int verdict, long ms,
+                       unsigned long long bytes);
+void inventory_foreach(inventory_fn fn, void *data);
+const char *inventory_verdict(int verdict);
+
+#endif
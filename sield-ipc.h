@@ -2,13 +2,67 @@
 #define _SIELD_IPC_H_
 
 static const char *PROGRAM_NAME = "sld";
-static const char *FIFO_DIR = "/tmp/sld/";
+static const char *const AUTH_SOCKET = "/var/run/sield-auth.sock";
 
-/* Structure to send through string length information to the daemon. */
-struct auth_len {
-    int user_len;   /* username length */
-    int tty_len;    /* ttyname length */
-    int pwd_len;    /* password length */
+#define AUTH_TEXT_MAX 256
+
+/*
+ * Authentication protocol over the SOCK_SEQPACKET socket AUTH_SOCKET.
+ * Every packet is exactly one struct auth_msg.
+ *
+ * sld                          daemon
+ * AUTH_LIST            =>
+ *                      <=      AUTH_DEVICE (one per pending device)
+ *                      <=      AUTH_END
+ * AUTH_TRY (id, pwd)   =>
+ *                      <=      AUTH_RESULT (status)
+ *
+ * or, for all devices whose description matches an fnmatch(3) pattern:
+ *
+ * AUTH_TRY_MATCH       =>
+ * (match, pwd)
+ *                      <=      AUTH_DEVICE (one per authorized device)
+ *                      <=      AUTH_RESULT (status, id: devices authorized)
+ *
+ * Failed attempts slow down further tries from the same user; the
+ * result may take a while to arrive.
+ *
+ * A desktop approval agent (sield-agent) registers instead:
+ *
+ * sield-agent                  daemon
+ * AUTH_WATCH           =>
+ *                      <=      AUTH_DEVICE..., AUTH_END
+ *                              (now, and whenever the list changes)
+ * AUTH_TRY (id, pwd)   =>
+ *                      <=      AUTH_RESULT (status)
+ *
+ * The daemon identifies the client by its SO_PEERCRED credentials.
+ */
+enum auth_msg_type {
+    AUTH_LIST = 1,
+    AUTH_DEVICE,        /* id, text: device description */
+    AUTH_END,
+    AUTH_TRY,           /* id, tty, text: password */
+    AUTH_RESULT,        /* id, status */
+    AUTH_WATCH,         /* send the list whenever it changes */
+    AUTH_TRY_MATCH      /* match, tty, text: password */
+};
+
+enum auth_status {
+    AUTH_ACCEPTED = 1,
+    AUTH_REJECTED,      /* wrong password, try again */
+    AUTH_DENIED,        /* no password attempts left */
+    AUTH_NO_DEVICE,     /* no such pending device */
+    AUTH_BUSY           /* too many checks in progress, try again */
+};
+
+struct auth_msg {
+    int type;
+    int id;
+    int status;
+    char tty[32];
+    char text[AUTH_TEXT_MAX];
+    char match[AUTH_TEXT_MAX];
 };
 
 #endif
@@ -0,0 +1,939 @@
+#define _GNU_SOURCE         /* strdup() */
+#include <errno.h>          /* errno */
+#include <poll.h>           /* POLLIN */
+#include <signal.h>         /* signal(), kill() */
+#include <stdlib.h>         /* exit(), strtoull() */
+#include <string.h>         /* strerror() */
+#include <sys/socket.h>     /* socketpair() */
+#include <unistd.h>         /* fork() */
+
+#include "sield-config.h"   /* get_sield_attr_bool() */
+#include "sield-daemon.h"   /* close_fds_except() */
+#include "sield-event.h"    /* event_add_fd() */
+#include "sield-grace.h"    /* grace_key() */
+#include "sield-http.h"     /* http_export_add() */
+#include "sield-inventory.h" /* inventory_scanned() */
+#include "sield-job.h"
+#include "sield-journal.h"  /* journal_record() */
+#include "sield-log.h"      /* log_fn() */
+#include "sield-mount.h"    /* mount_index_load() */
+#include "sield-onaccess.h" /* onaccess_fd(), onaccess_watch() */
+#include "sield-probe.h"    /* PROBE3() */
+#include "sield-share.h"    /* samba_schedule_reload() */
+
+/*
+ * Devices are handled by a fixed pool of worker processes ("workers"
+ * in the config), forked once at startup. Authorized devices (jobs)
+ * are queued and handed to idle workers, so a burst of insertions
+ * never runs more scans and mounts at once than there are workers.
+ *
+ * Every step is recorded in the state journal, so that after a
+ * restart mounted devices are taken over as they are and interrupted
+ * ones are handled again, without a password and without scanning
+ * them twice; see job_resume().
+ *
+ * A device which is unplugged is dropped from the queue, or its
+ * worker is killed along with the scanner and its mounts detached.
+ *
+ * The smallest device goes first: a scan takes roughly as long as the
+ * device is big, so a stick shouldn't wait behind a 2 TB drive. A job
+ * queued for longer than "scan aging" seconds goes before any other,
+ * so that big devices aren't starved by a stream of small ones.
+ *
+ * A worker only scans, mounts and shares the device. The daemon then
+ * keeps track of it until it is unmounted.
+ */
+#define WORKERS 2
+#define WORKERS_MAX 16
+#define WORKER_RESPAWN_DELAY 1000   /* ms */
+#define SCAN_AGING 120              /* s */
+#define SECTOR_SIZE 512             /* unit of the "size" sysfs attribute */
+
+enum job_state {
+    STATE_QUEUED,           /* Waiting for a worker */
+    STATE_RUNNING,          /* Being handled by a worker */
+    STATE_MOUNTED           /* Handled, watched until unmounted */
+};
+
+struct job {
+    int state;
+    char *syspath;
+    char *devnode;
+    char *key;                  /* grace_key(), NULL => none */
+    char *inventory_id;         /* NULL => none */
+    int verdict;                /* enum journal_verdict */
+    unsigned long long size;    /* bytes, 0 => unknown */
+    unsigned long long to_scan; /* bytes in use, 0 => not scanning */
+    unsigned long long scanned; /* bytes read by the scan so far */
+    long queued_at;             /* ms */
+    const char *step;           /* What it's doing, for job_foreach() */
+    long since;                 /* ms, when step started */
+    char *mount_pt;
+    int http_exported;
+    int shared;
+    struct job *next;
+};
+
+struct worker {
+    pid_t pid;
+    int fd;                 /* -1 => not running */
+    struct job *job;        /* NULL => idle */
+    int killed;             /* Job cancelled, wait for it to exit */
+};
+
+/* In order of arrival. */
+static struct job *jobs = NULL;
+
+static struct worker *workers = NULL;
+static int nworkers = 0;
+static job_fn worker_fn = NULL;
+
+/* Don't hand out jobs, see job_pause(). */
+static int paused = 0;
+
+/* Daemon: /proc/mounts, polled for unmounts. */
+static int mounts_fd = -1;
+
+/* Worker process' end of the socket pair. */
+static int job_fd = -1;
+
+/* Worker process: JOB_RUN's queued, see job_queued(). */
+static long queued_ms = 0;
+
+static const char *job_name(struct job *job);
+static void job_mounted(struct job *job, const char *path);
+static void job_unmounted(struct job *job);
+static void job_free(struct job *job);
+static void job_finished(struct job *job);
+static void job_journal(struct job *job, int stage);
+static void job_step(struct job *job, const char *step);
+static struct job *find_job(const char *devnode);
+static struct job *job_new(struct udev_device *device, int verdict);
+static void job_forget(const struct journal_entry *entry);
+static unsigned long long job_size(struct udev_device *device);
+static struct job *next_job(void);
+static void dispatch(void);
+static int send_msg(int fd, int type, int status, long ms,
+                    unsigned long long bytes, const char *path);
+static void worker_event(int fd, short revents, void *data);
+static void worker_respawn(void *data);
+static int worker_spawn(struct worker *worker);
+static void worker_stopped(struct worker *worker);
+static void worker_kill(struct worker *worker);
+static void worker_main(int fd);
+static void mounts_event(int fd, short revents, void *data);
+
+/* Short name of the job's device, "/dev/sdb1" => "sdb1" */
+static const char *job_name(struct job *job)
+{
+    const char *name = strrchr(job->devnode, '/');
+    return (name == NULL) ? job->devnode : name + 1;
+}
+
+/* Worker mounted the device for use. */
+static void job_mounted(struct job *job, const char *path)
+{
+    if (job->mount_pt) free(job->mount_pt);
+    job->mount_pt = strdup(path);
+
+    /* Serving its files would hold up the exporter for their scans. */
+    if (get_sield_attr_bool("http export") == 1
+        && job->verdict != VERDICT_ON_ACCESS
+        && http_export_add(job_name(job), path) == 0)
+        job->http_exported = 1;
+
+    job_step(job, "mounted");
+    job_journal(job, JOURNAL_MOUNTED);
+}
+
+/* Device is no longer mounted. */
+static void job_unmounted(struct job *job)
+{
+    if (job->http_exported) {
+        http_export_remove(job_name(job));
+        job->http_exported = 0;
+    }
+
+    /* Remove only this device's share. */
+    if (job->shared && samba_unshare(job->devnode) == 0) {
+        log_fn("Removed samba share for %s.", job->devnode);
+        samba_schedule_reload();
+    }
+    job->shared = 0;
+
+    if (job->mount_pt) free(job->mount_pt);
+    job->mount_pt = NULL;
+}
+
+static void job_free(struct job *job)
+{
+    struct job **jp;
+
+    for (jp = &jobs; *jp != NULL; jp = &(*jp)->next) {
+        if (*jp == job) {
+            *jp = job->next;
+            break;
+        }
+    }
+
+    if (job->devnode) journal_record(JOURNAL_RELEASED, VERDICT_NONE, 0,
+                                     job->devnode, NULL, NULL);
+
+    if (job->mount_pt) free(job->mount_pt);
+    if (job->key) free(job->key);
+    if (job->inventory_id) free(job->inventory_id);
+    free(job->syspath);
+    free(job->devnode);
+    free(job);
+}
+
+static void job_step(struct job *job, const char *step)
+{
+    job->step = step;
+    job->since = event_now_ms();
+}
+
+static struct job *find_job(const char *devnode)
+{
+    struct job *job;
+
+    for (job = jobs; job != NULL; job = job->next)
+        if (strcmp(job->devnode, devnode) == 0) return job;
+
+    return NULL;
+}
+
+static void job_journal(struct job *job, int stage)
+{
+    journal_record(stage, job->verdict, job->shared, job->devnode,
+                   job->key, job->mount_pt);
+}
+
+/* The worker is done with the job. */
+static void job_finished(struct job *job)
+{
+    PROBE3(job_done, job->devnode, job->mount_pt != NULL,
+           event_now_ms() - job->queued_at);
+
+    if (job->mount_pt == NULL) {
+        job_free(job);
+        return;
+    }
+
+    /* It may have been unmounted already. */
+    job->state = STATE_MOUNTED;
+    mounts_event(mounts_fd, 0, NULL);
+}
+
+static int send_msg(int fd, int type, int status, long ms,
+                    unsigned long long bytes, const char *path)
+{
+    struct job_msg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    msg.status = status;
+    msg.ms = ms;
+    msg.bytes = bytes;
+    if (path) strncpy(msg.path, path, sizeof(msg.path) - 1);
+
+    if (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+        log_fn("send(): %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Estimate the work for a device: its size in bytes, as the kernel
+ * reports it in 512 byte sectors. 0 if unknown.
+ */
+static unsigned long long job_size(struct udev_device *device)
+{
+    const char *sectors = udev_device_get_sysattr_value(device, "size");
+
+    if (sectors == NULL) return 0;
+
+    return strtoull(sectors, NULL, 10) * SECTOR_SIZE;
+}
+
+/*
+ * The queued job to run next: the oldest one which waited too long,
+ * else the smallest one. Unknown sizes count as the largest.
+ *
+ * Return NULL if nothing is queued.
+ */
+static struct job *next_job(void)
+{
+    struct job *job = NULL;
+    struct job *best = NULL;
+    long aging = get_sield_attr_int("scan aging");
+    long now = event_now_ms();
+
+    if (aging <= 0) aging = SCAN_AGING;
+
+    for (job = jobs; job != NULL; job = job->next) {
+        if (job->state != STATE_QUEUED) continue;
+
+        /* In order of arrival, the first is the oldest. */
+        if (now - job->queued_at >= aging * 1000) return job;
+
+        if (best == NULL
+            || (job->size != 0 && (best->size == 0 || job->size < best->size)))
+            best = job;
+    }
+
+    return best;
+}
+
+/* Hand queued jobs to idle workers. */
+static void dispatch(void)
+{
+    int i;
+
+    if (paused) return;
+
+    for (i = 0; i < nworkers; i++) {
+        struct worker *worker = &workers[i];
+        struct job *job = NULL;
+
+        if (worker->fd == -1 || worker->job != NULL) continue;
+
+        job = next_job();
+        if (job == NULL) return;
+
+        if (send_msg(worker->fd, JOB_RUN, job->verdict,
+                     event_now_ms() - job->queued_at, 0, job->syspath) == -1) {
+            worker_stopped(worker);
+            continue;
+        }
+
+        job->state = STATE_RUNNING;
+        worker->job = job;
+        job_step(job, "starting");
+        PROBE3(job_started, job->devnode, job->size,
+               event_now_ms() - job->queued_at);
+        job_journal(job, JOURNAL_SCANNING);
+    }
+}
+
+/* A worker sent a message or exited. */
+static void worker_event(int fd, short revents, void *data)
+{
+    struct worker *worker = (struct worker *) data;
+    struct job *job = worker->job;
+    struct job_msg msg;
+    ssize_t n;
+
+    n = recv(fd, &msg, sizeof(msg), MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+
+    if (n <= 0) {
+        if (!worker->killed)
+            log_fn("Worker %ld exited.", (long) worker->pid);
+        worker_stopped(worker);
+        dispatch();
+        return;
+    }
+
+    /* Whatever it was doing is moot. */
+    if (worker->killed) return;
+
+    if (n != sizeof(msg) || job == NULL) {
+        log_fn("Unexpected message from worker %ld.", (long) worker->pid);
+        return;
+    }
+
+    msg.path[sizeof(msg.path) - 1] = '\0';
+
+    switch (msg.type) {
+        case JOB_SHARE_CHANGED:
+            job->shared = 1;
+            samba_schedule_reload();
+            job_journal(job, JOURNAL_MOUNTED);
+            break;
+        case JOB_SCANNING:
+            job->to_scan = msg.bytes;
+            job->scanned = 0;
+            job_step(job, "scanning");
+            break;
+        case JOB_PROGRESS:
+            job->scanned = msg.bytes;
+            break;
+        case JOB_SCANNED:
+            job->to_scan = 0;
+            job->verdict = msg.status;
+            job_step(job, job->verdict == VERDICT_INFECTED
+                          ? "infected" : "mounting");
+            job_journal(job, JOURNAL_SCANNED);
+            if (job->inventory_id)
+                inventory_scanned(job->inventory_id, msg.status,
+                                  msg.ms, msg.bytes);
+            break;
+        case JOB_MOUNTED:
+            job_mounted(job, msg.path);
+            break;
+        case JOB_DONE:
+            worker->job = NULL;
+            job_finished(job);
+            dispatch();
+            break;
+        default:
+            log_fn("Unknown message %d from worker %ld.",
+                   msg.type, (long) worker->pid);
+            break;
+    }
+}
+
+/* Forget a worker which went away; start a new one shortly. */
+static void worker_stopped(struct worker *worker)
+{
+    if (worker->job) {
+        /* Whatever it got done with the device stands. */
+        job_finished(worker->job);
+        worker->job = NULL;
+    }
+
+    event_del_fd(worker->fd);
+    close(worker->fd);
+    worker->fd = -1;
+
+    /* Don't spin if workers die right away. */
+    event_add_timer(worker->killed ? 0 : WORKER_RESPAWN_DELAY,
+                    worker_respawn, worker);
+    worker->killed = 0;
+}
+
+/* Stop a worker's job: kill it along with anything it started. */
+static void worker_kill(struct worker *worker)
+{
+    if (kill(-worker->pid, SIGKILL) == -1)
+        log_fn("kill(): %ld: %s", (long) worker->pid, strerror(errno));
+
+    worker->job = NULL;
+    worker->killed = 1;
+}
+
+static void worker_respawn(void *data)
+{
+    struct worker *worker = (struct worker *) data;
+
+    if (worker_spawn(worker) == -1)
+        event_add_timer(WORKER_RESPAWN_DELAY, worker_respawn, worker);
+    else
+        dispatch();
+}
+
+/*
+ * Fork a worker process.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int worker_spawn(struct worker *worker)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        log_fn("socketpair(): %s", strerror(errno));
+        return -1;
+    }
+
+    switch (worker->pid = fork()) {
+        case -1:
+            log_fn("fork(): %s", strerror(errno));
+            close(sv[0]);
+            close(sv[1]);
+            return -1;
+        case 0:
+            close(sv[0]);
+            worker_main(sv[1]);
+            /* NOT REACHED */
+        default:
+            break;
+    }
+
+    /* Own process group, to kill scanners with it. Both sides set it. */
+    setpgid(worker->pid, worker->pid);
+
+    close(sv[1]);
+    worker->fd = sv[0];
+    worker->job = NULL;
+
+    if (event_add_fd(worker->fd, POLLIN, worker_event, worker) == -1) {
+        close(worker->fd);
+        worker->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Worker process: handle the devices sent by the daemon, one by one. */
+static void worker_main(int fd)
+{
+    struct udev *udev = NULL;
+    struct job_msg msg;
+
+    setpgid(0, 0);
+
+    /* The daemon's handlers and descriptors are not ours. */
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGSEGV, SIG_DFL);
+    close_fds_except(fd, onaccess_fd());
+
+    job_fd = fd;
+
+    /* Kept for all the devices to come. */
+    udev = udev_new();
+    if (udev == NULL) {
+        log_fn("[udev] udev object could not be created.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Until the daemon goes away. */
+    while (recv(fd, &msg, sizeof(msg), 0) == sizeof(msg)) {
+        struct udev_device *device = NULL;
+        struct udev_device *parent = NULL;
+
+        if (msg.type != JOB_RUN) continue;
+        msg.path[sizeof(msg.path) - 1] = '\0';
+        queued_ms = msg.ms;
+
+        device = udev_device_new_from_syspath(udev, msg.path);
+        if (device) {
+            parent = udev_device_get_parent_with_subsystem_devtype(
+                        device, "usb", "usb_device");
+            if (parent) worker_fn(device, parent, msg.status);
+            udev_device_unref(device);
+        } else {
+            log_fn("%s is gone.", msg.path);
+        }
+
+        if (send_msg(fd, JOB_DONE, 0, 0, 0, NULL) == -1) break;
+    }
+
+    udev_unref(udev);
+    exit(EXIT_SUCCESS);
+}
+
+/* Something was (un)mounted; check the mounted devices. */
+static void mounts_event(int fd, short revents, void *data)
+{
+    struct job *job = jobs;
+    struct mount_index *mounts = NULL;
+
+    while (job != NULL) {
+        struct job *next = job->next;
+
+        if (job->state == STATE_MOUNTED) {
+            /* Read once, only if anything is mounted. */
+            if (mounts == NULL && (mounts = mount_index_load()) == NULL)
+                return;
+
+            if (mount_index_find(mounts, job->devnode) == NULL) {
+                log_fn("%s was unmounted.", job->devnode);
+                job_unmounted(job);
+                job_free(job);
+            }
+        }
+
+        job = next;
+    }
+
+    mount_index_free(mounts);
+}
+
+/*
+ * Start the worker processes, which run fn for each device.
+ *
+ * Return 0 on success, -1 if none could be started.
+ */
+int job_pool_init(job_fn fn)
+{
+    int i, started = 0;
+    long wanted = get_sield_attr_int("workers");
+
+    if (wanted <= 0) wanted = WORKERS;
+    if (wanted > WORKERS_MAX) wanted = WORKERS_MAX;
+
+    workers = calloc(wanted, sizeof(struct worker));
+    if (workers == NULL) {
+        log_fn("calloc(): Memory error.");
+        return -1;
+    }
+
+    worker_fn = fn;
+    nworkers = wanted;
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].fd = -1;
+        if (worker_spawn(&workers[i]) == 0) started++;
+        else event_add_timer(WORKER_RESPAWN_DELAY, worker_respawn,
+                             &workers[i]);
+    }
+
+    if (started == 0) return -1;
+
+    mounts_fd = watch_mounts();
+    if (mounts_fd != -1)
+        event_add_fd(mounts_fd, POLLPRI, mounts_event, NULL);
+
+    log_fn("Started %d worker(s).", started);
+    return 0;
+}
+
+/* Queue a device; verdict is that of an earlier scan, if any. */
+static struct job *job_new(struct udev_device *device, int verdict)
+{
+    struct job **jp;
+    struct udev_device *parent = NULL;
+    struct job *job = calloc(1, sizeof(struct job));
+    char key[GRACE_KEY_MAX];
+    char id[INVENTORY_ID_MAX];
+    int queued = 0;
+
+    if (job == NULL) {
+        log_fn("calloc(): Memory error.");
+        return NULL;
+    }
+
+    parent = udev_device_get_parent_with_subsystem_devtype(
+                device, "usb", "usb_device");
+    if (parent && grace_key(parent, key, sizeof(key)) == 0)
+        job->key = strdup(key);
+    if (parent && inventory_id(device, parent, id, sizeof(id)) == 0)
+        job->inventory_id = strdup(id);
+
+    job->state = STATE_QUEUED;
+    job_step(job, "queued");
+    job->verdict = verdict;
+    job->size = job_size(device);
+    job->queued_at = event_now_ms();
+    job->syspath = strdup(udev_device_get_syspath(device));
+    job->devnode = strdup(udev_device_get_devnode(device));
+    if (job->syspath == NULL || job->devnode == NULL) {
+        log_fn("strdup(): Memory error.");
+        job_free(job);
+        return NULL;
+    }
+
+    for (jp = &jobs; *jp != NULL; jp = &(*jp)->next)
+        if ((*jp)->state == STATE_QUEUED) queued++;
+    *jp = job;
+
+    PROBE3(job_queued, job->devnode, job->size, queued);
+    job_journal(job, JOURNAL_AUTHORIZED);
+    dispatch();
+
+    if (job->state == STATE_QUEUED)
+        log_fn("Queued %s (%llu MB), %d other device(s) waiting.",
+               job->devnode, job->size >> 20, queued);
+
+    return job;
+}
+
+/*
+ * Queue an authorized device for the next idle worker.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int job_start(struct udev_device *device)
+{
+    return (job_new(device, VERDICT_NONE) == NULL) ? -1 : 0;
+}
+
+/* Release what a journal entry left behind: its share, the entry. */
+static void job_forget(const struct journal_entry *entry)
+{
+    if (entry->shared && samba_unshare(entry->devnode) == 0) {
+        log_fn("Removed samba share for %s.", entry->devnode);
+        samba_schedule_reload();
+    }
+
+    journal_record(JOURNAL_RELEASED, VERDICT_NONE, 0,
+                   entry->devnode, NULL, NULL);
+}
+
+/*
+ * At startup, pick up a device the journal knows about; mountpoint is
+ * where it is mounted now, NULL if it isn't.
+ *
+ * - Mounted where it was: taken over as it is (its mount marked again
+ *   if its files are scanned on access).
+ * - Mounted and since unmounted: forgotten, and handled like a new one.
+ * - Authorized, not mounted yet: queued again; scanned again only if
+ *   the verdict wasn't known.
+ *
+ * Return 1 if the device was taken care of, 0 if it is to be handled
+ * like a new one.
+ */
+int job_resume(struct udev_device *device, struct udev_device *parent,
+               const char *mountpoint)
+{
+    const char *devnode = udev_device_get_devnode(device);
+    const struct journal_entry *entry = journal_find(devnode);
+    struct job *job = NULL;
+    char key[GRACE_KEY_MAX];
+
+    if (entry == NULL) return 0;
+
+    /* Without a serial number, it could be any other device. */
+    if (entry->key == NULL || grace_key(parent, key, sizeof(key)) == -1
+        || strcmp(entry->key, key) != 0) {
+        job_forget(entry);
+        return 0;
+    }
+
+    if (entry->stage == JOURNAL_MOUNTED) {
+        if (mountpoint == NULL || entry->mountpoint == NULL
+            || strcmp(mountpoint, entry->mountpoint) != 0) {
+            log_fn("%s was unmounted while we were away.", devnode);
+            job_forget(entry);
+            return 0;
+        }
+
+        /* Its marks went away with our fanotify group. */
+        if (entry->verdict == VERDICT_ON_ACCESS
+            && onaccess_watch(mountpoint) == -1) {
+            log_fn("%s can't be scanned on access any more, detached it.",
+                   devnode);
+            detach_device(devnode);
+            job_forget(entry);
+            return 1;
+        }
+
+        job = calloc(1, sizeof(struct job));
+        if (job == NULL
+            || (job->syspath = strdup(udev_device_get_syspath(device))) == NULL
+            || (job->devnode = strdup(devnode)) == NULL
+            || (job->key = strdup(key)) == NULL) {
+            log_fn("Memory error.");
+            if (job) job_free(job);
+            return 1;
+        }
+
+        job->state = STATE_MOUNTED;
+        job->verdict = entry->verdict;
+        job->shared = entry->shared;
+        job->next = jobs;
+        jobs = job;
+
+        job_mounted(job, mountpoint);
+        log_fn("Took over %s mounted at %s.", devnode, mountpoint);
+        return 1;
+    }
+
+    /* Interrupted; whatever it had mounted is stale. */
+    if (mountpoint) detach_device(devnode);
+
+    log_fn("Resuming %s, authorized before the restart.", devnode);
+    job_new(device, entry->stage == JOURNAL_SCANNED
+                    ? entry->verdict : VERDICT_NONE);
+
+    return 1;
+}
+
+/*
+ * At startup, after job_resume() was given every device present:
+ * clean up after the devices which went away while we were down.
+ */
+void job_release_stale(void)
+{
+    const struct journal_entry *entry = journal_entries();
+
+    while (entry != NULL) {
+        const struct journal_entry *next = entry->next;
+        if (find_job(entry->devnode) == NULL) {
+            log_fn("%s was removed while we were away.", entry->devnode);
+            detach_device(entry->devnode);
+            job_forget(entry);
+        }
+
+        entry = next;
+    }
+}
+
+/*
+ * Send a message to the daemon from a worker process.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int job_notify(int type, int status, const char *path)
+{
+    if (job_fd == -1) return -1;
+
+    return send_msg(job_fd, type, status, 0, 0, path);
+}
+
+/* Scanning now; bytes: in use on the device. */
+int job_notify_scanning(unsigned long long bytes)
+{
+    if (job_fd == -1) return -1;
+
+    return send_msg(job_fd, JOB_SCANNING, 0, 0, bytes, NULL);
+}
+
+/* Bytes read by the scan so far; acct_progress_start() callback. */
+int job_notify_progress(unsigned long long bytes)
+{
+    if (job_fd == -1) return -1;
+
+    return send_msg(job_fd, JOB_PROGRESS, 0, 0, bytes, NULL);
+}
+
+/* Send the scan's verdict, time taken (ms) and bytes read. */
+int job_notify_scanned(int verdict, long ms, unsigned long long bytes)
+{
+    if (job_fd == -1) return -1;
+
+    return send_msg(job_fd, JOB_SCANNED, verdict, ms, bytes, NULL);
+}
+
+/* Worker process: ms the current device waited for a worker. */
+long job_queued(void)
+{
+    return queued_ms;
+}
+
+/*
+ * A device was unplugged: drop it from the queue, or stop its worker,
+ * detach its mounts and remove its http export and samba share.
+ */
+void job_cancel(const char *devnode)
+{
+    int i;
+    struct job *job = find_job(devnode);
+
+    if (job == NULL) return;
+
+    switch (job->state) {
+        case STATE_QUEUED:
+            log_fn("%s was removed while queued.", devnode);
+            break;
+        case STATE_RUNNING:
+            for (i = 0; i < nworkers; i++)
+                if (workers[i].job == job) worker_kill(&workers[i]);
+
+            log_fn("%s was removed, stopped its worker.", devnode);
+
+            /* It may have shared the device without telling us yet. */
+            job->shared = get_sield_attr_bool("share") == 1;
+            break;
+        default:
+            log_fn("%s was removed while mounted.", devnode);
+            break;
+    }
+
+    if (job->state != STATE_QUEUED) {
+        detach_device(devnode);
+        job_unmounted(job);
+    }
+
+    job_free(job);
+    dispatch();
+}
+
+/*
+ * Unmount a device cleanly and stop handling it, for "sieldctl eject".
+ *
+ * Return 0 on success, -1 with errno set on error (ENOENT: no such
+ * device, EBUSY: still in use).
+ */
+int job_eject(const char *devnode)
+{
+    struct job *job = find_job(devnode);
+
+    if (job == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Flushed, unlike an unplug. */
+    if (job->state == STATE_MOUNTED && unmount_device(devnode) == -1)
+        return -1;
+
+    log_fn("Ejecting %s.", devnode);
+    job_cancel(devnode);
+    return 0;
+}
+
+/*
+ * Unmount a mounted device and queue it to be scanned and mounted
+ * again, for "sieldctl rescan".
+ *
+ * Return 0 on success, -1 with errno set on error (ENOENT: no such
+ * device, EBUSY: in use or being handled).
+ */
+int job_rescan(const char *devnode)
+{
+    struct job *job = find_job(devnode);
+
+    if (job == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Will be scanned anyway. */
+    if (job->state == STATE_QUEUED) return 0;
+
+    if (job->state == STATE_RUNNING) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (unmount_device(devnode) == -1) return -1;
+
+    log_fn("Rescanning %s.", devnode);
+    job_unmounted(job);
+
+    job->state = STATE_QUEUED;
+    job->verdict = VERDICT_NONE;
+    job->queued_at = event_now_ms();
+    job_step(job, "queued");
+    job_journal(job, JOURNAL_AUTHORIZED);
+
+    dispatch();
+    return 0;
+}
+
+/* Stop handing out jobs (pause = 1) or start again (pause = 0). */
+void job_pause(int pause)
+{
+    if (paused == pause) return;
+
+    paused = pause;
+    log_fn("Device handling %s.", paused ? "paused" : "resumed");
+
+    if (!paused) dispatch();
+}
+
+int job_paused(void)
+{
+    return paused;
+}
+
+/* Call fn for each device, in order of arrival. */
+void job_foreach(job_status_fn fn, void *data)
+{
+    struct job *job;
+    struct job_status status;
+    long now = event_now_ms();
+
+    for (job = jobs; job != NULL; job = job->next) {
+        status.devnode = job->devnode;
+        status.step = job->step;
+        status.elapsed = now - job->since;
+        status.size = job->size;
+        status.mountpoint = job->mount_pt;
+
+        /* File system metadata is read too: 99% until it's done. */
+        status.progress = -1;
+        if (job->to_scan != 0) {
+            unsigned long long percent = job->scanned * 100 / job->to_scan;
+            status.progress = percent > 99 ? 99 : (int) percent;
+        }
+        fn(&status, data);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef _SIELD_JOB_H_
+#define _SIELD_JOB_H_
+
+#include <libudev.h>
+#include <limits.h>         /* PATH_MAX */
+
+/*
+ * Messages between the daemon and its worker processes.
+ * The daemon sends JOB_RUN; a worker answers with any number of
+ * JOB_SCANNING/JOB_PROGRESS/JOB_SCANNED/JOB_MOUNTED/JOB_SHARE_CHANGED,
+ * then JOB_DONE.
+ */
+enum job_msg_type {
+    JOB_SHARE_CHANGED = 1,      /* samba share fragment added */
+    JOB_MOUNTED,                /* path: mount point */
+    JOB_RUN,                    /* path: syspath of the device,
+                                   status: verdict of an earlier scan,
+                                   ms: time it waited for a worker */
+    JOB_SCANNING,               /* mounted for the scan, scanning;
+                                   bytes: in use on the device */
+    JOB_SCANNED,                /* status: verdict, ms: time taken,
+                                   bytes: read from the device */
+    JOB_DONE,
+    JOB_PROGRESS,               /* bytes: read from the device so far */
+};
+
+struct job_msg {
+    int type;
+    int status;                 /* enum journal_verdict */
+    long ms;
+    unsigned long long bytes;
+    char path[PATH_MAX];
+};
+
+/* verdict: VERDICT_NONE unless the device was scanned already. */
+typedef void (*job_fn)(struct udev_device *device,
+                       struct udev_device *parent, int verdict);
+
+/* What a device is up to, for the control socket. */
+struct job_status {
+    const char *devnode;
+    const char *step;           /* "queued", "scanning", "mounted"... */
+    long elapsed;               /* ms in this step */
+    unsigned long long size;    /* bytes, 0 => unknown */
+    int progress;               /* percent scanned, -1 => not scanning */
+    const char *mountpoint;     /* NULL => not mounted */
+};
+
+typedef void (*job_status_fn)(const struct job_status *status, void *data);
+
+/* Daemon side */
+int job_pool_init(job_fn fn);
+int job_start(struct udev_device *device);
+void job_cancel(const char *devnode);
+int job_resume(struct udev_device *device, struct udev_device *parent,
+               const char *mountpoint);
+void job_release_stale(void);
+int job_eject(const char *devnode);
+int job_rescan(const char *devnode);
+void job_pause(int pause);
+int job_paused(void);
+void job_foreach(job_status_fn fn, void *data);
+
+/* Worker side */
+int job_notify(int type, int status, const char *path);
+int job_notify_scanning(unsigned long long bytes);
+int job_notify_progress(unsigned long long bytes);
+int job_notify_scanned(int verdict, long ms, unsigned long long bytes);
+long job_queued(void);
+
+#endif
@@ -0,0 +1,439 @@
+#define _GNU_SOURCE             /* getline(), strdup() */
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* open() */
+#include <stdio.h>              /* fopen(), rename() */
+#include <stdlib.h>             /* free() */
+#include <string.h>             /* strcmp() */
+#include <unistd.h>             /* write(), fdatasync() */
+
+#include "sield-event.h"        /* event_add_timer() */
+#include "sield-journal.h"
+#include "sield-log.h"          /* log_fn() */
+
+/*
+ * State journal.
+ *
+ * Every change of a device's state is appended to JOURNAL_FILE as one
+ * line. Appends are batched: they are written and synced together
+ * JOURNAL_FLUSH_DELAY ms after the first one, so a burst of devices
+ * costs one fdatasync(2). The latest state of each device is kept in
+ * memory too; at startup and once JOURNAL_COMPACT_SIZE bytes were
+ * appended, the file is rewritten with just that.
+ *
+ * The journal lives in /var/run, so it doesn't outlive a reboot, and
+ * neither do the mounts it describes.
+ *
+ * Line format, strings escaped like /proc/mounts, "-" for none:
+ *   <stage> <verdict> <shared> <devnode> <key> <mountpoint>
+ */
+
+static const char *JOURNAL_FILE = "/var/run/sield.journal";
+static const char *JOURNAL_TMP = "/var/run/sield.journal.tmp";
+static const char *JOURNAL_DIR = "/var/run";
+
+#define JOURNAL_FLUSH_DELAY 50          /* ms */
+#define JOURNAL_COMPACT_SIZE 65536      /* bytes */
+
+static const char *STAGES[] = {
+    "authorized", "scanning", "scanned", "mounted", "released"
+};
+static const char *VERDICTS[] = {
+    "none", "clean", "errors", "infected", "on-access"
+};
+
+#define N_STAGES (sizeof(STAGES) / sizeof(STAGES[0]))
+#define N_VERDICTS (sizeof(VERDICTS) / sizeof(VERDICTS[0]))
+
+struct buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+static struct journal_entry *entries = NULL;
+static int journal_fd = -1;
+static struct buffer pending = {NULL, 0, 0};
+static long appended = 0;           /* Since the last compaction */
+static int flush_timer = 0;
+
+static int buffer_add(struct buffer *buf, const char *data, size_t len);
+static int buffer_add_field(struct buffer *buf, const char *field);
+static int format_entry(struct buffer *buf, const struct journal_entry *e);
+static char *unescape_field(const char *field);
+static int lookup(const char **names, size_t n, const char *name);
+static void update_entry(int stage, int verdict, int shared,
+                         const char *devnode, const char *key,
+                         const char *mountpoint);
+static void free_entry(struct journal_entry *entry);
+static void replay(void);
+static int compact(void);
+static void flush_event(void *data);
+
+static int buffer_add(struct buffer *buf, const char *data, size_t len)
+{
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 1024;
+        char *p = NULL;
+
+        while (buf->len + len > capacity) capacity *= 2;
+
+        p = realloc(buf->data, capacity);
+        if (p == NULL) {
+            log_fn("realloc(): Memory error.");
+            return -1;
+        }
+        buf->data = p;
+        buf->capacity = capacity;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+/* Append " field", with blanks and backslashes octal escaped. */
+static int buffer_add_field(struct buffer *buf, const char *field)
+{
+    if (buffer_add(buf, " ", 1) == -1) return -1;
+
+    if (field == NULL) return buffer_add(buf, "-", 1);
+
+    /* Not to be taken for "none". */
+    if (strcmp(field, "-") == 0) return buffer_add(buf, "\\055", 4);
+
+    for (; *field != '\0'; field++) {
+        unsigned char c = *field;
+        char octal[5];
+
+        if (c > ' ' && c != '\\') {
+            if (buffer_add(buf, field, 1) == -1) return -1;
+            continue;
+        }
+
+        snprintf(octal, sizeof(octal), "\\%03o", c);
+        if (buffer_add(buf, octal, 4) == -1) return -1;
+    }
+
+    return 0;
+}
+
+static int format_entry(struct buffer *buf, const struct journal_entry *e)
+{
+    char head[64];
+    int n = snprintf(head, sizeof(head), "%s %s %d", STAGES[e->stage],
+                     VERDICTS[e->verdict], e->shared);
+
+    if (buffer_add(buf, head, n) == -1
+        || buffer_add_field(buf, e->devnode) == -1
+        || buffer_add_field(buf, e->key) == -1
+        || buffer_add_field(buf, e->mountpoint) == -1
+        || buffer_add(buf, "\n", 1) == -1)
+        return -1;
+
+    return 0;
+}
+
+/* Undo buffer_add_field(). NULL for "-". */
+static char *unescape_field(const char *field)
+{
+    char *copy = NULL, *out = NULL;
+
+    if (strcmp(field, "-") == 0) return NULL;
+
+    copy = out = strdup(field);
+    if (copy == NULL) return NULL;
+
+    while (*field != '\0') {
+        if (field[0] == '\\'
+            && field[1] >= '0' && field[1] <= '3'
+            && field[2] >= '0' && field[2] <= '7'
+            && field[3] >= '0' && field[3] <= '7') {
+            *out++ = (field[1] - '0') * 64 + (field[2] - '0') * 8
+                     + (field[3] - '0');
+            field += 4;
+        } else {
+            *out++ = *field++;
+        }
+    }
+
+    *out = '\0';
+    return copy;
+}
+
+static int lookup(const char **names, size_t n, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        if (strcmp(names[i], name) == 0) return i;
+
+    return -1;
+}
+
+static void free_entry(struct journal_entry *entry)
+{
+    struct journal_entry **ep;
+
+    for (ep = &entries; *ep != NULL; ep = &(*ep)->next) {
+        if (*ep == entry) {
+            *ep = entry->next;
+            break;
+        }
+    }
+
+    free(entry->devnode);
+    if (entry->key) free(entry->key);
+    if (entry->mountpoint) free(entry->mountpoint);
+    free(entry);
+}
+
+/* Set the in-memory state of a device; released ones are dropped. */
+static void update_entry(int stage, int verdict, int shared,
+                         const char *devnode, const char *key,
+                         const char *mountpoint)
+{
+    struct journal_entry *old = (struct journal_entry *)
+                                journal_find(devnode);
+    struct journal_entry *entry = NULL;
+
+    if (stage != JOURNAL_RELEASED) {
+        /* Copy before freeing, the strings may be the old entry's. */
+        entry = calloc(1, sizeof(struct journal_entry));
+        if (entry == NULL) {
+            log_fn("calloc(): Memory error.");
+            return;
+        }
+
+        entry->stage = stage;
+        entry->verdict = verdict;
+        entry->shared = shared;
+        entry->devnode = strdup(devnode);
+        entry->key = key ? strdup(key) : NULL;
+        entry->mountpoint = mountpoint ? strdup(mountpoint) : NULL;
+
+        if (entry->devnode == NULL) {
+            log_fn("strdup(): Memory error.");
+            free(entry);
+            return;
+        }
+    }
+
+    if (old) free_entry(old);
+
+    if (entry) {
+        entry->next = entries;
+        entries = entry;
+    }
+}
+
+/* Load the state left by the previous run. */
+static void replay(void)
+{
+    size_t len = 0;
+    char *line = NULL;
+    int n = 0;
+    FILE *fp = fopen(JOURNAL_FILE, "re");
+
+    if (fp == NULL) {
+        if (errno != ENOENT)
+            log_fn("fopen(): %s: %s", JOURNAL_FILE, strerror(errno));
+        return;
+    }
+
+    while (getline(&line, &len, fp) != -1) {
+        char stage[16], verdict[16];
+        char *devnode = NULL, *key = NULL, *mountpoint = NULL;
+        char *dev = NULL, *k = NULL, *mtpt = NULL;
+        int shared = 0, s, v;
+
+        /* Torn by a crash while it was written. */
+        if (line[strlen(line) - 1] != '\n') break;
+
+        if (sscanf(line, "%15s %15s %d %ms %ms %ms", stage, verdict,
+                   &shared, &dev, &k, &mtpt) == 6
+            && (s = lookup(STAGES, N_STAGES, stage)) != -1
+            && (v = lookup(VERDICTS, N_VERDICTS, verdict)) != -1
+            && (devnode = unescape_field(dev)) != NULL) {
+            key = unescape_field(k);
+            mountpoint = unescape_field(mtpt);
+            update_entry(s, v, shared, devnode, key, mountpoint);
+            n++;
+        }
+
+        if (dev) free(dev);
+        if (k) free(k);
+        if (mtpt) free(mtpt);
+        if (devnode) free(devnode);
+        if (key) free(key);
+        if (mountpoint) free(mountpoint);
+    }
+
+    if (line) free(line);
+    fclose(fp);
+
+    log_fn("Replayed %d journal record(s).", n);
+}
+
+/*
+ * Replace the journal with the current state, atomically.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int compact(void)
+{
+    struct buffer buf = {NULL, 0, 0};
+    struct journal_entry *entry = NULL;
+    size_t done = 0;
+    int fd, dir_fd;
+
+    for (entry = entries; entry != NULL; entry = entry->next) {
+        if (format_entry(&buf, entry) == -1) {
+            free(buf.data);
+            return -1;
+        }
+    }
+
+    fd = open(JOURNAL_TMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        log_fn("open(): %s: %s", JOURNAL_TMP, strerror(errno));
+        free(buf.data);
+        return -1;
+    }
+
+    while (done < buf.len) {
+        ssize_t n = write(fd, buf.data + done, buf.len - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            log_fn("write(): %s: %s", JOURNAL_TMP, strerror(errno));
+            break;
+        }
+        done += n;
+    }
+
+    free(buf.data);
+
+    if (done < buf.len || fdatasync(fd) == -1
+        || rename(JOURNAL_TMP, JOURNAL_FILE) == -1) {
+        log_fn("Could not rewrite %s: %s", JOURNAL_FILE, strerror(errno));
+        close(fd);
+        unlink(JOURNAL_TMP);
+        return -1;
+    }
+
+    close(fd);
+
+    /* Make the rename itself durable. */
+    dir_fd = open(JOURNAL_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    /* Append to the new file from now on. */
+    if (journal_fd != -1) close(journal_fd);
+    journal_fd = open(JOURNAL_FILE, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (journal_fd == -1) {
+        log_fn("open(): %s: %s", JOURNAL_FILE, strerror(errno));
+        return -1;
+    }
+
+    appended = 0;
+    return 0;
+}
+
+static void flush_event(void *data)
+{
+    /* The timer is released already. */
+    flush_timer = 0;
+    journal_flush();
+}
+
+/*
+ * Load the journal of the previous run and start a new one.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int journal_init(void)
+{
+    replay();
+    return compact();
+}
+
+/*
+ * Record a device's new state; written out shortly, along with any
+ * other changes made until then.
+ */
+void journal_record(int stage, int verdict, int shared, const char *devnode,
+                    const char *key, const char *mountpoint)
+{
+    struct journal_entry entry;
+
+    /* Before the update, the strings may be the current entry's. */
+    if (journal_fd != -1) {
+        memset(&entry, 0, sizeof(entry));
+        entry.stage = stage;
+        entry.verdict = verdict;
+        entry.shared = shared;
+        entry.devnode = (char *) devnode;
+        entry.key = (char *) key;
+        entry.mountpoint = (char *) mountpoint;
+
+        if (format_entry(&pending, &entry) == 0 && flush_timer == 0)
+            flush_timer = event_add_timer(JOURNAL_FLUSH_DELAY,
+                                          flush_event, NULL);
+    }
+
+    update_entry(stage, verdict, shared, devnode, key, mountpoint);
+}
+
+/* Latest state of a device, NULL if nothing is known. */
+const struct journal_entry *journal_find(const char *devnode)
+{
+    struct journal_entry *entry;
+
+    for (entry = entries; entry != NULL; entry = entry->next)
+        if (strcmp(entry->devnode, devnode) == 0) return entry;
+
+    return NULL;
+}
+
+/* All the devices not released. */
+const struct journal_entry *journal_entries(void)
+{
+    return entries;
+}
+
+/* Write out and sync the recorded changes now. */
+void journal_flush(void)
+{
+    size_t done = 0;
+
+    if (flush_timer) {
+        event_del_timer(flush_timer);
+        flush_timer = 0;
+    }
+
+    if (journal_fd == -1 || pending.len == 0) return;
+
+    /* The memory state has it all, rewrite instead of growing. */
+    if (appended + pending.len > JOURNAL_COMPACT_SIZE && compact() == 0) {
+        pending.len = 0;
+        return;
+    }
+
+    while (done < pending.len) {
+        ssize_t n = write(journal_fd, pending.data + done, pending.len - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            log_fn("write(): %s: %s", JOURNAL_FILE, strerror(errno));
+            break;
+        }
+        done += n;
+    }
+
+    if (fdatasync(journal_fd) == -1)
+        log_fn("fdatasync(): %s: %s", JOURNAL_FILE, strerror(errno));
+
+    appended += done;
+    pending.len = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef _SIELD_JOURNAL_H_
+#define _SIELD_JOURNAL_H_
+
+/*
+ * What the daemon did with each device, kept on disk so that a
+ * restart after a crash can pick up where it left off.
+ */
+enum journal_stage {
+    JOURNAL_AUTHORIZED,         /* Queued for a worker */
+    JOURNAL_SCANNING,           /* Being scanned and mounted */
+    JOURNAL_SCANNED,            /* verdict is known */
+    JOURNAL_MOUNTED,            /* At mountpoint, maybe shared */
+    JOURNAL_RELEASED            /* Forgotten */
+};
+
+enum journal_verdict {
+    VERDICT_NONE,               /* Not scanned (yet) */
+    VERDICT_CLEAN,
+    VERDICT_ERRORS,             /* Scan failed, mounted read-only */
+    VERDICT_INFECTED,           /* Not mounted */
+    VERDICT_ON_ACCESS           /* Files scanned as they are opened */
+};
+
+struct journal_entry {
+    int stage;
+    int verdict;
+    int shared;
+    char *devnode;
+    char *key;                  /* grace_key(), NULL => none */
+    char *mountpoint;           /* NULL => not mounted */
+    struct journal_entry *next;
+};
+
+int journal_init(void);
+void journal_record(int stage, int verdict, int shared, const char *devnode,
+                    const char *key, const char *mountpoint);
+const struct journal_entry *journal_find(const char *devnode);
+const struct journal_entry *journal_entries(void);
+void journal_flush(void);
+
+#endif
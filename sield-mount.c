@@ -1,20 +1,38 @@
 #define _GNU_SOURCE     /* asprintf(), getline(), strdup() */
 #include <errno.h>		/* errno */
+#include <fcntl.h>      /* open() */
 #include <libudev.h>
-#include <poll.h>
 #include <stdio.h>      /* fopen(), asprintf() */
-#include <stdlib.h>     /* free() */
+#include <stdlib.h>     /* free(), qsort() */
 #include <string.h>     /* strcmp(), strdup() */
-#include <sys/mount.h>		/* mount() */
+#include <sys/file.h>     /* flock() */
+#include <sys/mount.h>		/* mount(), umount() */
 #include <sys/stat.h>		/* mkdir() */
+#include <unistd.h>     /* rmdir() */
 
 #include "sield-config.h"
+#include "sield-event.h"     /* event_now_ms() */
 #include "sield-log.h"
 #include "sield-mount.h"
+#include "sield-probe.h"     /* PROBE3() */
 
 static const char *PROC_MOUNTS = "/proc/mounts";
 
+/* Where mount_device_staged() mounts first; only root gets in. */
+static const char *STAGING_DIR = "/var/run/sield-staging";
+
+/* mount_device_private() directories, made by mkdtemp(). */
+static const char *PRIVATE_TEMPLATE = "/var/run/sield-scan.XXXXXX";
+
+/* Held by a worker from choosing a mount point to mounting there. */
+static const char *MOUNT_LOCK = "/var/run/sield-mount.lock";
+
 static char *get_mount_point_attr(struct udev_device *device);
+static int is_mount_point(const char *path);
+static char *claim_mount_point(struct udev_device *device, int *lock_fd);
+static void release_mount_point(int lock_fd);
+static void unescape_mount_field(char *field);
+static int compare_mount_entries(const void *a, const void *b);
 
 static char *get_mount_point_attr(struct udev_device *device)
 {
@@ -39,6 +57,75 @@ static char *get_mount_point_attr(struct udev_device *device)
 	return target;
 }
 
+/* Is something mounted at path? */
+static int is_mount_point(const char *path)
+{
+    struct stat st, parent_st;
+    char *parent = NULL;
+    int rt = 0;
+
+    if (asprintf(&parent, "%s/..", path) == -1) return 0;
+
+    if (stat(path, &st) == 0 && stat(parent, &parent_st) == 0)
+        rt = st.st_dev != parent_st.st_dev;
+
+    free(parent);
+    return rt;
+}
+
+/*
+ * Choose the device's mount point, and create it if needed: the
+ * configured one, or "<mount point>-<sysname>" if another device is
+ * mounted there already. Devices are handled by several workers at
+ * once, so the choice is made under MOUNT_LOCK, to be released with
+ * release_mount_point() once mounted.
+ *
+ * Return the mount point, NULL on error.
+ */
+static char *claim_mount_point(struct udev_device *device, int *lock_fd)
+{
+    char *target = get_mount_point_attr(device);
+    char *own = NULL;
+
+    *lock_fd = open(MOUNT_LOCK, O_RDWR | O_CREAT | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR);
+    if (*lock_fd == -1 || flock(*lock_fd, LOCK_EX) == -1)
+        log_fn("Unable to lock %s: %s", MOUNT_LOCK, strerror(errno));
+
+    /* Readable and writable by the owner. */
+    if (target && mkdir(target, S_IRUSR | S_IWUSR) == -1 && errno != EEXIST) {
+        log_fn("Cannot create the directory: \"%s\". %s",
+               target, strerror(errno));
+        free(target);
+        target = NULL;
+    }
+
+    if (target == NULL || !is_mount_point(target)) return target;
+
+    if (asprintf(&own, "%s-%s", target,
+                 udev_device_get_sysname(device)) == -1) {
+        log_fn("asprintf(): Memory error.");
+        own = NULL;
+    } else if (mkdir(own, S_IRUSR | S_IWUSR) == -1 && errno != EEXIST) {
+        log_fn("Cannot create the directory: \"%s\". %s",
+               own, strerror(errno));
+        free(own);
+        own = NULL;
+    } else if (is_mount_point(own)) {
+        log_fn("%s and %s are both in use.", target, own);
+        free(own);
+        own = NULL;
+    }
+
+    free(target);
+    return own;
+}
+
+static void release_mount_point(int lock_fd)
+{
+    if (lock_fd != -1) close(lock_fd);
+}
+
 /*
  * Mount the given udev_device at configured mount point.
  *
@@ -53,18 +140,12 @@ char *mount_device(struct udev_device *device, int ro)
 	/* Get the filesystem type */
 	const char *fs_type = udev_device_get_property_value(device, "ID_FS_TYPE");
 
-	/* Mount point */
-	char *target = get_mount_point_attr(device);
-
-	/*
-	 * Create the mountpoint if it does not already exist.
-	 *
-	 * Readable and writable by the owner.
-	 */
-	if (mkdir(target, S_IRUSR | S_IWUSR) == -1 && errno != EEXIST) {
-		log_fn("Cannot create the directory: \"%s\". %s",
-			target, strerror(errno));
-		free(target);
+	/* Mount point, not shared with another device */
+	int lock_fd;
+	char *target = claim_mount_point(device, &lock_fd);
+
+	if (target == NULL) {
+		release_mount_point(lock_fd);
 		return NULL;
 	}
 
@@ -74,7 +155,15 @@ char *mount_device(struct udev_device *device, int ro)
 	if (ro == 0) mountflags = 0;
 
 	/* MOUNT */
-	if (mount(devnode, target, fs_type, mountflags, NULL) == -1) {
+	long started = event_now_ms();
+	int rt = mount(devnode, target, fs_type, mountflags, NULL);
+
+	PROBE5(mount, devnode, target, ro, rt == -1 ? errno : 0,
+	       event_now_ms() - started);
+
+	release_mount_point(lock_fd);
+
+	if (rt == -1) {
 		log_fn("Unable to mount %s: %s", devnode, strerror(errno));
 		free(target);
 		return NULL;
@@ -84,81 +173,344 @@ char *mount_device(struct udev_device *device, int ro)
 }
 
 /*
- * Given a device node file name,
- * return its mount point from the PROC_MOUNTS file.
+ * Mount the device read-only in a directory of its own, which only
+ * root can reach: for the scan, which must see this device only.
+ * Unmount it, then rmdir() it.
  *
- * Return NULL if not mounted.
+ * Return the mount point on success, else NULL.
+ */
+char *mount_device_private(struct udev_device *device)
+{
+    const char *devnode = udev_device_get_devnode(device);
+    const char *fs_type = udev_device_get_property_value(device, "ID_FS_TYPE");
+    char *target = strdup(PRIVATE_TEMPLATE);
+    long started;
+    int rt;
+
+    if (target == NULL) {
+        log_fn("strdup(): Memory error.");
+        return NULL;
+    }
+
+    if (mkdtemp(target) == NULL) {
+        log_fn("mkdtemp(): %s: %s", target, strerror(errno));
+        free(target);
+        return NULL;
+    }
+
+    started = event_now_ms();
+    rt = mount(devnode, target, fs_type, MS_RDONLY, NULL);
+
+    PROBE5(mount, devnode, target, 1, rt == -1 ? errno : 0,
+           event_now_ms() - started);
+
+    if (rt == -1) {
+        log_fn("Unable to mount %s: %s", devnode, strerror(errno));
+        rmdir(target);
+        free(target);
+        return NULL;
+    }
+
+    return target;
+}
+
+/*
+ * Mount a private tmpfs at STAGING_DIR for mount_device_staged():
+ * mounts can't be moved off a shared one.
+ *
+ * Return 0 on success, -1 on error.
  */
-char *get_mountpoint(const char *devnode)
+int mount_staging_init(void)
 {
-    size_t len = 0;
-    char *mountpoint = NULL;
+    if (mkdir(STAGING_DIR, S_IRWXU) == -1 && errno != EEXIST) {
+        log_fn("mkdir(): %s: %s", STAGING_DIR, strerror(errno));
+        return -1;
+    }
+
+    /* Left over from a previous run. */
+    umount2(STAGING_DIR, MNT_DETACH);
+
+    if (mount("sield-staging", STAGING_DIR, "tmpfs",
+              MS_NOSUID | MS_NODEV | MS_NOEXEC, "mode=0700") == -1
+        || mount(NULL, STAGING_DIR, NULL, MS_PRIVATE, NULL) == -1) {
+        log_fn("Unable to mount %s: %s", STAGING_DIR, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Like mount_device(), but the device is mounted in STAGING_DIR first
+ * and prepare(path) is called there, before anyone else can open a
+ * file on it; the mount is then moved to the mount point.
+ *
+ * Return the mount point on success, else NULL.
+ */
+char *mount_device_staged(struct udev_device *device, int ro,
+                          mount_prepare_fn prepare)
+{
+    const char *devnode = udev_device_get_devnode(device);
+    const char *fs_type = udev_device_get_property_value(device, "ID_FS_TYPE");
+    char *target = NULL;
+    char *stage = NULL;
+    long started;
+    int rt, lock_fd = -1;
+
+    if (asprintf(&stage, "%s/XXXXXX", STAGING_DIR) == -1) {
+        log_fn("asprintf(): Memory error.");
+        return NULL;
+    }
+
+    if (mkdtemp(stage) == NULL) {
+        log_fn("mkdtemp(): %s: %s", stage, strerror(errno));
+        free(stage);
+        return NULL;
+    }
+
+    started = event_now_ms();
+    rt = mount(devnode, stage, fs_type, ro ? MS_RDONLY : 0, NULL);
+
+    PROBE5(mount, devnode, stage, ro, rt == -1 ? errno : 0,
+           event_now_ms() - started);
+
+    if (rt == -1) {
+        log_fn("Unable to mount %s: %s", devnode, strerror(errno));
+    } else if (prepare(stage) == -1) {
+        umount2(stage, MNT_DETACH);
+        rt = -1;
+    } else if ((target = claim_mount_point(device, &lock_fd)) == NULL
+               || mount(stage, target, NULL, MS_MOVE, NULL) == -1) {
+        if (target)
+            log_fn("Unable to move %s to %s: %s",
+                   devnode, target, strerror(errno));
+        umount2(stage, MNT_DETACH);
+        rt = -1;
+    }
+
+    release_mount_point(lock_fd);
+    rmdir(stage);
+    free(stage);
+
+    if (rt == -1) {
+        free(target);
+        return NULL;
+    }
+
+    return target;
+}
+
+/* Undo the octal escapes of /proc/mounts ("\040" for a space). */
+static void unescape_mount_field(char *field)
+{
+    char *in = field, *out = field;
+
+    while (*in != '\0') {
+        if (in[0] == '\\'
+            && in[1] >= '0' && in[1] <= '3'
+            && in[2] >= '0' && in[2] <= '7'
+            && in[3] >= '0' && in[3] <= '7') {
+            *out++ = (in[1] - '0') * 64 + (in[2] - '0') * 8 + (in[3] - '0');
+            in += 4;
+        } else {
+            *out++ = *in++;
+        }
+    }
+
+    *out = '\0';
+}
+
+static int compare_mount_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct mount_entry *) a)->devnode,
+                  ((const struct mount_entry *) b)->devnode);
+}
+
+/*
+ * Read PROC_MOUNTS once into an index of mounted device nodes, for
+ * looking up any number of devices with mount_index_find().
+ *
+ * Return the index, NULL on error.
+ */
+struct mount_index *mount_index_load(void)
+{
+    size_t len = 0, capacity = 0;
     char *line = NULL;
     FILE *fp = NULL;
+    struct mount_index *index = calloc(1, sizeof(struct mount_index));
 
-    fp = fopen(PROC_MOUNTS, "r");
+    if (index == NULL) {
+        log_fn("calloc(): Memory error.");
+        return NULL;
+    }
+
+    fp = fopen(PROC_MOUNTS, "re");
     if (fp == NULL) {
         log_fn("fopen(): %s: %s", PROC_MOUNTS, strerror(errno));
+        free(index);
         return NULL;
     }
 
-    while (getline(&line, &len, fp) != -1
-            && mountpoint == NULL) {
+    while (getline(&line, &len, fp) != -1) {
         char *dev = NULL;
         char *mtpt = NULL;
 
         /* %m modifier for dynamic string allocation. */
-        sscanf(line, "%ms %ms", &dev, &mtpt);
+        if (sscanf(line, "%ms %ms", &dev, &mtpt) != 2 || dev[0] != '/') {
+            if (dev) free(dev);
+            if (mtpt) free(mtpt);
+            continue;
+        }
 
-        /* Is this the device we are looking for? */
-        if (strcmp(dev, devnode) == 0 && mtpt != NULL)
-            mountpoint = strdup(mtpt);
+        if (index->n == capacity) {
+            size_t wanted = capacity ? capacity * 2 : 32;
+            struct mount_entry *e = realloc(index->entries,
+                                            wanted * sizeof(*e));
+            if (e == NULL) {
+                log_fn("realloc(): Memory error.");
+                free(dev);
+                free(mtpt);
+                break;
+            }
+            index->entries = e;
+            capacity = wanted;
+        }
 
-        if (dev) free(dev);
-        if (mtpt) free(mtpt);
+        unescape_mount_field(dev);
+        unescape_mount_field(mtpt);
+        index->entries[index->n].devnode = dev;
+        index->entries[index->n].mountpoint = mtpt;
+        index->n++;
     }
 
     if (line) free(line);
     fclose(fp);
 
-    return mountpoint;
+    /* Sorted for the binary search in mount_index_find(). */
+    if (index->n > 0)
+        qsort(index->entries, index->n, sizeof(struct mount_entry),
+              compare_mount_entries);
+
+    return index;
 }
 
 /*
- * Wait until given device node file is unmounted.
+ * Mount point of the given device node file, in the index.
  *
- * Return 1 when given device is unmounted, else return 0.
+ * Return NULL if not mounted.
  */
-int has_unmounted(const char *devnode)
+const char *mount_index_find(const struct mount_index *index,
+                             const char *devnode)
 {
-    struct pollfd fds[1];
-    FILE *fp = NULL;
+    size_t lo = 0, hi = index->n;
 
-    fp = fopen(PROC_MOUNTS, "r");
-    if (fp == NULL) {
-        log_fn("fopen(): %s: %s", PROC_MOUNTS, strerror(errno));
-        return 0;
+    /* Leftmost match, for devices mounted more than once. */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(index->entries[mid].devnode, devnode) < 0) lo = mid + 1;
+        else hi = mid;
     }
 
-    fds[0].fd = fileno(fp);
-    fds[0].events = POLLPRI;
+    if (lo < index->n && strcmp(index->entries[lo].devnode, devnode) == 0)
+        return index->entries[lo].mountpoint;
 
-    while (1) {
-        int change;
-        char *mountpoint = NULL;
+    return NULL;
+}
 
-        /* BLOCK till device is unmounted. */
-        change = poll(fds, 1, -1);
-        if (change == -1) {
-            log_fn("poll(): %s", strerror(errno));
-            return 0;
+/*
+ * Lazily unmount every mount of the given device node file; the
+ * device may be gone already, so nothing is flushed to it.
+ *
+ * Return the number of mounts detached.
+ */
+int detach_device(const char *devnode)
+{
+    size_t i;
+    int detached = 0;
+    struct mount_index *index = mount_index_load();
+
+    if (index == NULL) return 0;
+
+    for (i = 0; i < index->n; i++) {
+        const char *mtpt = index->entries[i].mountpoint;
+
+        if (strcmp(index->entries[i].devnode, devnode) != 0) continue;
+
+        if (umount2(mtpt, MNT_DETACH) == -1) {
+            log_fn("umount2(): %s: %s", mtpt, strerror(errno));
+            continue;
         }
 
-        mountpoint = get_mountpoint(devnode);
-        if (mountpoint == NULL) {
-            free(mountpoint);
-            fclose(fp);
-            return 1;
+        PROBE3(unmount, devnode, mtpt, 1);
+        log_fn("Detached %s from %s.", devnode, mtpt);
+        detached++;
+    }
+
+    mount_index_free(index);
+    return detached;
+}
+
+/*
+ * Unmount every mount of the given device node file, flushing it.
+ *
+ * Return 0 on success, -1 with errno set if one of them is busy or
+ * can't be unmounted.
+ */
+int unmount_device(const char *devnode)
+{
+    size_t i;
+    int rt = 0, saved_errno = 0;
+    struct mount_index *index = mount_index_load();
+
+    if (index == NULL) return -1;
+
+    for (i = 0; i < index->n; i++) {
+        const char *mtpt = index->entries[i].mountpoint;
+
+        if (strcmp(index->entries[i].devnode, devnode) != 0) continue;
+
+        if (umount(mtpt) == -1) {
+            saved_errno = errno;
+            log_fn("umount(): %s: %s", mtpt, strerror(errno));
+            rt = -1;
+            continue;
         }
+
+        PROBE3(unmount, devnode, mtpt, 0);
+        log_fn("Unmounted %s from %s.", devnode, mtpt);
+    }
+
+    mount_index_free(index);
+    errno = saved_errno;
+    return rt;
+}
+
+void mount_index_free(struct mount_index *index)
+{
+    size_t i;
+
+    if (index == NULL) return;
+
+    for (i = 0; i < index->n; i++) {
+        free(index->entries[i].devnode);
+        free(index->entries[i].mountpoint);
     }
+
+    free(index->entries);
+    free(index);
+}
+
+/*
+ * Open the mount table for poll(2): POLLPRI is reported whenever
+ * anything is mounted or unmounted.
+ *
+ * Return the file descriptor, -1 on error.
+ */
+int watch_mounts(void)
+{
+    int fd = open(PROC_MOUNTS, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) log_fn("open(): %s: %s", PROC_MOUNTS, strerror(errno));
+    return fd;
 }
@@ -2,9 +2,33 @@
 #define _SIELD_MOUNT_H_
 
 #include <libudev.h>
+#include <stddef.h>     /* size_t */
+
+struct mount_entry {
+    char *devnode;
+    char *mountpoint;
+};
+
+/* Snapshot of the mount table, sorted by device node. */
+struct mount_index {
+    struct mount_entry *entries;
+    size_t n;
+};
+
+/* Called on a staged mount, 0 on success or -1 to give it up. */
+typedef int (*mount_prepare_fn)(const char *path);
 
 char *mount_device(struct udev_device *device, int ro);
-char *get_mountpoint(const char *devpath);
-int has_unmounted(const char *devpath);
+char *mount_device_private(struct udev_device *device);
+int mount_staging_init(void);
+char *mount_device_staged(struct udev_device *device, int ro,
+                          mount_prepare_fn prepare);
+struct mount_index *mount_index_load(void);
+const char *mount_index_find(const struct mount_index *index,
+                             const char *devnode);
+void mount_index_free(struct mount_index *index);
+int detach_device(const char *devnode);
+int unmount_device(const char *devnode);
+int watch_mounts(void);
 
 #endif
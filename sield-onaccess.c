@@ -0,0 +1,354 @@
+#define _GNU_SOURCE             /* O_LARGEFILE */
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* AT_FDCWD, O_RDONLY */
+#include <limits.h>             /* PATH_MAX */
+#include <poll.h>               /* poll() */
+#include <signal.h>             /* sigtimedwait(), kill() */
+#include <stdio.h>              /* snprintf() */
+#include <stdlib.h>             /* exit(), free() */
+#include <string.h>             /* strerror(), strdup() */
+#include <sys/fanotify.h>       /* fanotify_init(), fanotify_mark() */
+#include <sys/socket.h>         /* socketpair() */
+#include <sys/wait.h>           /* waitpid() */
+#include <unistd.h>             /* fork(), execl() */
+
+#include "sield-config.h"       /* get_sield_attr() */
+#include "sield-daemon.h"       /* close_fds_except() */
+#include "sield-event.h"        /* event_add_fd() */
+#include "sield-log.h"          /* log_fn() */
+#include "sield-mount.h"        /* mount_staging_init() */
+#include "sield-onaccess.h"
+#include "sield-probe.h"        /* PROBE3() */
+
+/*
+ * Instead of a full scan before a device is mounted ("scan on access"),
+ * its mount is marked in a fanotify group: opening a file on it waits
+ * until the file is scanned, and fails with EPERM if it is infected.
+ * Files found clean get an ignore mark and are not scanned again until
+ * they are modified. A file that can't be scanned is denied too.
+ *
+ * The group is created by the daemon before its workers are forked;
+ * workers mark what they mount before it shows at its mount point.
+ * Events are answered by processes of their own, so that a slow scan
+ * never holds up the daemon. The scanner reads the file on its
+ * standard input, from the descriptor the event came with: opening
+ * it would wait for us.
+ *
+ * A scanner is run for every file opened, so it must be a client of a
+ * scanning daemon (clamdscan): one that loads its signatures itself
+ * would take seconds per file.
+ */
+static const char *AVPATH = "/usr/bin/clamdscan";
+
+#define ONACCESS_SCANNERS 4
+#define ONACCESS_RESPAWN_DELAY 1000     /* ms */
+#define SCAN_TIMEOUT 60                 /* s; the file is denied then */
+
+struct scanner {
+    pid_t pid;
+    int fd;                     /* Our end of its socket, -1 if down */
+};
+
+static struct scanner scanners[ONACCESS_SCANNERS];
+static int group_fd = -1;
+
+static int mark(unsigned int flags, int dirfd, const char *path);
+static int scan_file(int fd);
+static void handle_event(const struct fanotify_event_metadata *event);
+static void scanner_main(int fd);
+static int scanner_spawn(struct scanner *scanner);
+static void scanner_event(int fd, short revents, void *data);
+static void scanner_respawn(void *data);
+
+/*
+ * Add a mark for opens and, where the kernel has them, execs.
+ *
+ * Return 0 on success, -1 with errno set on error.
+ */
+static int mark(unsigned int flags, int dirfd, const char *path)
+{
+    if (fanotify_mark(group_fd, flags, FAN_OPEN_PERM | FAN_OPEN_EXEC_PERM,
+                      dirfd, path) == 0)
+        return 0;
+
+    /* Before Linux 5.0; execve() opens the file all the same. */
+    if (errno != EINVAL) return -1;
+    return fanotify_mark(group_fd, flags, FAN_OPEN_PERM, dirfd, path);
+}
+
+/*
+ * Scan the file open on fd.
+ *
+ * Return like is_infected(): 0 if clean, 1 if infected, 2 on error.
+ */
+static int scan_file(int fd)
+{
+    char *avpath = get_sield_attr("on access av path");
+    struct timespec timeout = {SCAN_TIMEOUT, 0};
+    sigset_t set;
+    int status;
+    pid_t pid;
+
+    if (avpath == NULL) avpath = strdup(AVPATH);
+    if (avpath == NULL) {
+        log_fn("strdup(): Memory error.");
+        return 2;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        log_fn("fork(): %s", strerror(errno));
+        free(avpath);
+        return 2;
+    }
+
+    if (pid == 0) {
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+
+        if (dup2(fd, STDIN_FILENO) == -1) _exit(2);
+        execl(avpath, avpath, "--no-summary", "-", (char *) NULL);
+        _exit(2);
+    }
+
+    free(avpath);
+
+    /* SIGCHLD is blocked, see scanner_main(). */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if (sigtimedwait(&set, NULL, &timeout) == -1 && errno == EAGAIN) {
+            log_fn("Scanner took over %d s, stopped it.", SCAN_TIMEOUT);
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            return 2;
+        }
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) > 1) return 2;
+    return WEXITSTATUS(status);
+}
+
+/* Answer a permission event, which always gets an answer. */
+static void handle_event(const struct fanotify_event_metadata *event)
+{
+    struct fanotify_response response;
+    char link[32], path[PATH_MAX] = "?";
+    long started = event_now_ms();
+    ssize_t len;
+    int result;
+
+    if (event->fd < 0) return;
+
+    if (!(event->mask & (FAN_OPEN_PERM | FAN_OPEN_EXEC_PERM))) {
+        close(event->fd);
+        return;
+    }
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", event->fd);
+    len = readlink(link, path, sizeof(path) - 1);
+    if (len != -1) path[len] = '\0';
+
+    result = scan_file(event->fd);
+    PROBE3(onaccess_scan, path, result, event_now_ms() - started);
+
+    response.fd = event->fd;
+    response.response = result == 0 ? FAN_ALLOW : FAN_DENY;
+    if (write(group_fd, &response, sizeof(response)) != sizeof(response))
+        log_fn("Unable to answer for %s: %s", path, strerror(errno));
+
+    if (result == 1)
+        log_fn("Denied access to %s (pid %ld): virus found.",
+               path, (long) event->pid);
+    else if (result == 2)
+        log_fn("Denied access to %s (pid %ld): could not scan it.",
+               path, (long) event->pid);
+    /* Not again until it is modified. */
+    else if (mark(FAN_MARK_ADD | FAN_MARK_IGNORED_MASK, event->fd, NULL) == -1)
+        log_fn("fanotify_mark(): %s: %s", path, strerror(errno));
+
+    close(event->fd);
+}
+
+/* Scanner process: answer events until the daemon goes away. */
+static void scanner_main(int fd)
+{
+    struct fanotify_event_metadata buf[64];
+    struct pollfd fds[2];
+    sigset_t set;
+
+    /* The daemon's handlers and descriptors are not ours. */
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGSEGV, SIG_DFL);
+    close_fds_except(fd, group_fd);
+
+    /* Waited for with sigtimedwait(). */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    fds[0].fd = group_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = fd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        const struct fanotify_event_metadata *event = buf;
+        ssize_t len;
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            log_fn("poll(): %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        /* The daemon is gone. */
+        if (fds[1].revents) exit(EXIT_SUCCESS);
+
+        len = read(group_fd, buf, sizeof(buf));
+        if (len == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            log_fn("read(): %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        for (; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+            if (event->vers != FANOTIFY_METADATA_VERSION) {
+                log_fn("Unsupported fanotify version %d.", event->vers);
+                exit(EXIT_FAILURE);
+            }
+            handle_event(event);
+        }
+    }
+}
+
+/*
+ * Fork a scanner process.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int scanner_spawn(struct scanner *scanner)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        log_fn("socketpair(): %s", strerror(errno));
+        return -1;
+    }
+
+    switch (scanner->pid = fork()) {
+        case -1:
+            log_fn("fork(): %s", strerror(errno));
+            close(sv[0]);
+            close(sv[1]);
+            return -1;
+        case 0:
+            close(sv[0]);
+            scanner_main(sv[1]);
+            /* NOT REACHED */
+        default:
+            break;
+    }
+
+    close(sv[1]);
+    scanner->fd = sv[0];
+
+    if (event_add_fd(scanner->fd, POLLIN, scanner_event, scanner) == -1) {
+        close(scanner->fd);
+        scanner->fd = -1;
+        kill(scanner->pid, SIGTERM);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* A scanner's socket: it only ever closes, when the scanner exits. */
+static void scanner_event(int fd, short revents, void *data)
+{
+    struct scanner *scanner = (struct scanner *) data;
+
+    log_fn("On-access scanner %ld exited.", (long) scanner->pid);
+
+    event_del_fd(scanner->fd);
+    close(scanner->fd);
+    scanner->fd = -1;
+
+    /* Opens on marked mounts wait meanwhile; don't spin either. */
+    event_add_timer(ONACCESS_RESPAWN_DELAY, scanner_respawn, scanner);
+}
+
+static void scanner_respawn(void *data)
+{
+    struct scanner *scanner = (struct scanner *) data;
+
+    if (scanner_spawn(scanner) == -1)
+        event_add_timer(ONACCESS_RESPAWN_DELAY, scanner_respawn, scanner);
+}
+
+/*
+ * Create the fanotify group and fork the scanner processes, if "scan
+ * on access" is set. To be called before the workers are forked, so
+ * that they have the group to mark their mounts in.
+ *
+ * Return 0 on success or if not set, -1 on error: devices are then
+ * scanned in full before they are mounted.
+ */
+int onaccess_init(void)
+{
+    int i, started = 0;
+
+    if (get_sield_attr_bool("scan on access") != 1) return 0;
+
+    /* Where workers mount and mark, see mount_device_staged(). */
+    if (mount_staging_init() == -1) return -1;
+
+    group_fd = fanotify_init(FAN_CLASS_CONTENT | FAN_CLOEXEC,
+                             O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (group_fd == -1) {
+        log_fn("fanotify_init(): %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < ONACCESS_SCANNERS; i++) {
+        scanners[i].fd = -1;
+        if (scanner_spawn(&scanners[i]) == 0) started++;
+    }
+
+    if (started == 0) {
+        close(group_fd);
+        group_fd = -1;
+        return -1;
+    }
+
+    log_fn("Started %d on-access scanner(s).", started);
+    return 0;
+}
+
+/* The fanotify group, -1 if files aren't scanned on access. */
+int onaccess_fd(void)
+{
+    return group_fd;
+}
+
+/*
+ * Scan the files of the mount at mountpoint as they are opened.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int onaccess_watch(const char *mountpoint)
+{
+    if (group_fd == -1) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (mark(FAN_MARK_ADD | FAN_MARK_MOUNT, AT_FDCWD, mountpoint) == -1) {
+        log_fn("fanotify_mark(): %s: %s", mountpoint, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
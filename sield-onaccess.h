@@ -0,0 +1,12 @@
+#ifndef _SIELD_ONACCESS_H_
+#define _SIELD_ONACCESS_H_
+
+/*
+ * On-access scanning: files of a marked mount are scanned as they are
+ * opened, with fanotify permission events.
+ */
+int onaccess_init(void);
+int onaccess_fd(void);
+int onaccess_watch(const char *mountpoint);
+
+#endif
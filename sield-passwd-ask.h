@@ -1,7 +0,0 @@
-#ifndef _SIELD_PASSWD_ASK_H_
-#define _SIELD_PASSWD_ASK_H_
-
-int
-ask_passwd(const char *manufacturer, const char *product, const char *devnode);
-
-#endif
@@ -1,19 +1,32 @@
-#define _GNU_SOURCE         /* getline(), strdup(), crypt() */
+#define _GNU_SOURCE         /* getline(), strdup() */
+#include <crypt.h>          /* crypt_r() */
 #include <errno.h>          /* strerror() */
 #include <pwd.h>            /* getpwuid() */
 #include <shadow.h>         /* getspnam() */
 #include <stdio.h>          /* fopen(), getline(), fclose() */
 #include <stdlib.h>         /* free() */
 #include <string.h>         /* strcmp() */
+#include <sys/stat.h>       /* stat() */
 #include <sys/types.h>      /* getpwuid() */
-#include <unistd.h>         /* crypt(), access() */
+#include <unistd.h>         /* access() */
 
 #include "sield-config.h"   /* get_sield_attr() */
 #include "sield-log.h"      /* log_fn() */
 #include "sield-passwd-check.h"
 
+static const char *SHADOW_FILE = "/etc/shadow";
+
+/*
+ * Hash to check passwords against, and the state of the file it was
+ * read from. The hash is only re-read when that file changes.
+ */
+static char *cached_hash = NULL;
+static const char *cached_file = NULL;
+static struct stat cached_st;
+
 static char *get_encrypted_user_passwd(uid_t uid);
 static char *get_sield_passwd(void);
+static int same_file_state(const struct stat *a, const struct stat *b);
 
 /*
  * Check against:
@@ -24,23 +37,37 @@ static char *get_sield_passwd(void);
  */
 int is_passwd_correct(const char *plain_txt_passwd)
 {
-    char *encrypted_passwd_to_check_against = NULL;
-    char *salt = NULL;
-    char *given_passwd_encrypted = NULL;
     int passwd_match = 0;
+    const char *hash = get_passwd_hash();
+    struct crypt_data *data = NULL;
 
-    encrypted_passwd_to_check_against = get_sield_passwd();
+    if (hash == NULL) return 0;
 
-    if (!encrypted_passwd_to_check_against) {
-        log_fn("Application password not set. Trying to use superuser password.");
-        encrypted_passwd_to_check_against = get_encrypted_user_passwd(0);
-    }
-
-    if (!encrypted_passwd_to_check_against) {
-        log_fn("Could not get superuser password.");
+    /* Too large for the stack. */
+    data = calloc(1, sizeof(struct crypt_data));
+    if (data == NULL) {
+        log_fn("calloc(): Memory error.");
         return 0;
     }
 
+    passwd_match = passwd_hash_matches(plain_txt_passwd, hash, data);
+
+    free(data);
+    return passwd_match;
+}
+
+/*
+ * Return 1 if the password hashes to the given hash, else return 0.
+ *
+ * Reentrant: data is the caller's crypt_r(3) scratch area.
+ */
+int passwd_hash_matches(const char *plain_txt_passwd, const char *hash,
+                        struct crypt_data *data)
+{
+    size_t i, len;
+    unsigned char diff = 0;
+    const char *given_passwd_encrypted = NULL;
+
     /*
      * salt is a character string starting with the characters "$id$"
      * followed by a string terminated by "$":
@@ -49,28 +76,73 @@ int is_passwd_correct(const char *plain_txt_passwd)
      *
      * Here actual encrypted password can act as salt.
      */
-    salt = encrypted_passwd_to_check_against;
-    given_passwd_encrypted = crypt(plain_txt_passwd, salt);
+    given_passwd_encrypted = crypt_r(plain_txt_passwd, hash, data);
 
-    passwd_match = !strcmp(encrypted_passwd_to_check_against,
-                           given_passwd_encrypted);
+    /* Failure is NULL or a string starting with '*'. */
+    if (given_passwd_encrypted == NULL || given_passwd_encrypted[0] == '*')
+        return 0;
 
-    if (encrypted_passwd_to_check_against)
-        free(encrypted_passwd_to_check_against);
+    len = strlen(hash);
+    if (strlen(given_passwd_encrypted) != len) return 0;
 
-    /*
-     * DO NOT FREE THE STRING RETURNED FROM crypt(3).
-     * Time wasted: ~5hrs
-     *
-     * Take note of the following golden words from the crypt(3) man page.
-     *
-     *  The return value points to static data whose content is
-     *  overwritten by each call.
-     *
-     * free(given_passwd_encrypted);
-     */
+    /* Don't leak how much of the hash matched through timing. */
+    for (i = 0; i < len; i++)
+        diff |= given_passwd_encrypted[i] ^ hash[i];
 
-    return passwd_match;
+    return diff == 0;
+}
+
+static int same_file_state(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev
+        && a->st_ino == b->st_ino
+        && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+        && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+        && a->st_ctim.tv_sec == b->st_ctim.tv_sec
+        && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/*
+ * Return the hash to check passwords against:
+ * 1. Application password, if defined, else
+ * 2. Superuser password.
+ *
+ * The hash is cached; it's re-read only if PASSWD_FILE (or the
+ * shadow file) changed since. Return NULL if there's none.
+ * The returned string belongs to the cache, don't free() it.
+ */
+const char *get_passwd_hash(void)
+{
+    struct stat st;
+    const char *file = PASSWD_FILE;
+
+    if (stat(PASSWD_FILE, &st) == -1) {
+        file = SHADOW_FILE;
+        if (stat(SHADOW_FILE, &st) == -1) memset(&st, 0, sizeof(st));
+    }
+
+    if (cached_hash != NULL && cached_file == file
+        && same_file_state(&st, &cached_st))
+        return cached_hash;
+
+    if (cached_hash) free(cached_hash);
+    cached_hash = NULL;
+    cached_file = NULL;
+
+    if (file == PASSWD_FILE) {
+        cached_hash = get_sield_passwd();
+    } else {
+        log_fn("Application password not set. Trying to use superuser password.");
+        cached_hash = get_encrypted_user_passwd(0);
+        if (!cached_hash) log_fn("Could not get superuser password.");
+    }
+
+    if (cached_hash == NULL) return NULL;
+
+    cached_file = file;
+    cached_st = st;
+    return cached_hash;
 }
 
 /*
@@ -148,13 +220,15 @@ static char *get_sield_passwd(void)
     if (read == -1) {
         log_fn("%s", strerror(errno));
         log_fn("Unable to read %s.", PASSWD_FILE);
+        if (encrypted_passwd) free(encrypted_passwd);
+        fclose(passwd_fp);
         return NULL;
     }
 
     fclose(passwd_fp);
 
     /* Remove newline. */
-    encrypted_passwd[read-1] = '\0';
+    if (encrypted_passwd[read-1] == '\n') encrypted_passwd[read-1] = '\0';
 
     return encrypted_passwd;
 }
@@ -1,7 +1,13 @@
 #ifndef _SIELD_PASSWD_CHECK_H_
 #define _SIELD_PASSWD_CHECK_H_
 
+#include <crypt.h>          /* struct crypt_data */
+
 static const char *PASSWD_FILE = "/etc/sield/sield.passwd";
 int is_passwd_correct(const char *plain_txt_passwd);
 
+const char *get_passwd_hash(void);
+int passwd_hash_matches(const char *plain_txt_passwd, const char *hash,
+                        struct crypt_data *data);
+
 #endif
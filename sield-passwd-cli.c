@@ -1,227 +1,245 @@
 #define _GNU_SOURCE     /* asprintf() */
 #include <errno.h>      /* errno */
-#include <stdarg.h>     /* va_start() */
-#include <stdio.h>      /* fprintf() */
+#include <fcntl.h>      /* open() */
+#include <poll.h>       /* POLLOUT */
+#include <stdio.h>      /* snprintf() */
 #include <stdlib.h>     /* free() */
 #include <string.h>     /* strerror() */
-#include <sys/types.h>  /* mkfifo() */
-#include <sys/stat.h>   /* mkdir() */
-#include <utmp.h>       /* setutent() */ 
+#include <unistd.h>     /* write() */
 
+#include "sield-auth.h"     /* auth_request() */
 #include "sield-config.h"   /* get_sield_attr_int() */
-#include "sield-ipc.h"      /* IPC struct */
+#include "sield-event.h"    /* event_add_fd() */
+#include "sield-ipc.h"      /* PROGRAM_NAME */
 #include "sield-log.h"      /* log_fn() */
-#include "sield-passwd-check.h"     /* is_passwd_correct() */
 #include "sield-passwd-cli.h"
+#include "sield-session.h"  /* session_list() */
 
-static int write_to_tty(const char *tty, const char *frmt, ...);
-static int notify_tty(const char *tty, const char *manufacturer,
-                      const char *product, const char *devnode);
+/* Time allowed for writing a notification to a tty. */
+#define NOTIFY_TIMEOUT 2000     /* ms */
+
+/*
+ * A notification being written to a tty.
+ *
+ * ttys are opened non-blocking; whatever doesn't fit at once is
+ * written from the event loop. A flow controlled or hung terminal
+ * only delays its own message, and is given up on after
+ * "notify timeout" ms.
+ */
+struct tty_note {
+    int fd;
+    int timer;
+    char user[sizeof(((struct session *) 0)->user)];
+    char line[sizeof(((struct session *) 0)->line)];
+    char *msg;
+    size_t len;
+    size_t off;
+};
+
+static int write_note(struct tty_note *note);
+static void finish_note(struct tty_note *note, const char *failure);
+static void note_event(int fd, short revents, void *data);
+static void note_timeout(void *data);
+static int notify_tty(const struct session *session, const char *msg,
+                      long timeout);
 static int notify_all_ttys(const char *manufacturer, const char *product,
-                           const char *devnode);
-static char *makefifo(const char *manufacturer, const char *product,
-                      const char *devnode);
+                           const char *devnode, int *graphical);
 
-/* Write given message to given tty */
-static int write_to_tty(const char *tty, const char *format, ...)
+/*
+ * Write as much of the notification as the tty takes.
+ *
+ * Return 1 if it's all written, 0 if there's more, -1 on error.
+ */
+static int write_note(struct tty_note *note)
 {
-    FILE *tty_fp = NULL;
-    char *tty_path = NULL;
+    while (note->off < note->len) {
+        ssize_t n = write(note->fd, note->msg + note->off,
+                          note->len - note->off);
+
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            return -1;
+        }
 
-    if (asprintf(&tty_path, "/dev/%s", tty) == -1) {
-        log_fn("asprintf: memory error");
-        return -1;
+        note->off += n;
     }
 
-    tty_fp = fopen(tty_path, "w");
-    if (tty_fp == NULL) {
-        log_fn("fopen: %s: %s", tty_path, strerror(errno));
-        return -1;
-    }
+    return 1;
+}
 
-    va_list arg;
-    va_start(arg, format);
-    vfprintf(tty_fp, format, arg);
-    va_end(arg);
+/* Log the outcome (failure == NULL => notified) and release. */
+static void finish_note(struct tty_note *note, const char *failure)
+{
+    if (failure)
+        log_fn("Could not notify %s (@%s): %s",
+               note->user, note->line, failure);
+    else
+        log_fn("Notified %s (@%s).", note->user, note->line);
+
+    event_del_fd(note->fd);
+    event_del_timer(note->timer);
+    close(note->fd);
+    free(note->msg);
+    free(note);
+}
 
-    free(tty_path);
-    fclose(tty_fp);
-    return 0;
+static void note_event(int fd, short revents, void *data)
+{
+    struct tty_note *note = (struct tty_note *) data;
+    int rt;
+
+    if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        finish_note(note, "terminal hung up");
+        return;
+    }
+
+    rt = write_note(note);
+    if (rt == 1) finish_note(note, NULL);
+    else if (rt == -1) finish_note(note, strerror(errno));
 }
 
-/* Notify user at given tty about device insertion. */
-static int notify_tty(const char *tty, const char *manufacturer,
-                      const char *product, const char *devnode)
+static void note_timeout(void *data)
 {
-    return write_to_tty(tty, "%s %s (%s) inserted. "
-                        "To scan and mount, execute %s\n",
-                        manufacturer, product, devnode, PROGRAM_NAME);
+    struct tty_note *note = (struct tty_note *) data;
+
+    /* Released already. */
+    note->timer = 0;
+    finish_note(note, "timed out");
 }
 
 /*
- * Notify all available ttys about device insertion.
+ * Start writing msg to the tty of the given session.
  *
- * Return the number of ttys notified.
+ * Return 0 if the tty was opened, -1 otherwise.
  */
-static int notify_all_ttys(const char *manufacturer, const char *product,
-                           const char *devnode)
+static int notify_tty(const struct session *session, const char *msg,
+                      long timeout)
 {
-    struct utmp *ut = NULL;
-    int ttys_notified = 0;
+    char tty_path[sizeof("/dev/") + sizeof(session->line)];
+    struct tty_note *note = calloc(1, sizeof(struct tty_note));
+    int rt;
 
-    setutent();
-    /* Don't free ut, it is statically allocated. */
-    while ((ut = getutent()) != NULL) {
-        /* Skip invalid entries. */
-        if (ut->ut_type != USER_PROCESS) continue;
-
-        if (notify_tty(ut->ut_line, manufacturer, product, devnode) == -1) {
-            log_fn("Could not notify %s (@%s) about device %s (%s %s).",
-                    ut->ut_user, ut->ut_line, devnode, manufacturer, product);
-        } else {
-            log_fn("Notified %s (@%s) about device %s (%s %s).",
-                    ut->ut_user, ut->ut_line, devnode, manufacturer, product);
-            ttys_notified++;
-        }
+    if (note == NULL) {
+        log_fn("calloc(): Memory error.");
+        return -1;
     }
-    endutent();
 
-    return ttys_notified;
-}
+    strcpy(note->user, session->user);
+    strcpy(note->line, session->line);
+    snprintf(tty_path, sizeof(tty_path), "/dev/%s", note->line);
 
-/* Return the path of the named pipe constructed. */
-static char *makefifo(const char *manufacturer, const char *product,
-                      const char *devnode)
-{
-    mode_t dir_perm, file_perm;
-    char *fifo_path = NULL;
-
-    /* FIFO_DIR should be readable, and searchable to all users. */
-    dir_perm = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    if (strstr(note->line, "..") != NULL) {
+        log_fn("Ignoring suspicious tty name %s.", note->line);
+        free(note);
+        return -1;
+    }
 
-    /* FIFOs should not be world readable, but world writable. */
-    file_perm = S_IRUSR | S_IWUSR | S_IWGRP | S_IWOTH;
+    /* Never wait for the terminal, nor become its controlling process. */
+    note->fd = open(tty_path, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (note->fd == -1) {
+        log_fn("open(): %s: %s", tty_path, strerror(errno));
+        free(note);
+        return -1;
+    }
 
-    /* Create FIFO_DIR to place the named pipes. */
-    if (mkdir(FIFO_DIR, dir_perm) == -1 && errno != EEXIST) {
-        log_fn("mkdir(): %s: %s", FIFO_DIR, strerror(errno));
-        return NULL;
+    note->msg = strdup(msg);
+    note->len = strlen(msg);
+    if (note->msg == NULL) {
+        log_fn("strdup(): Memory error.");
+        close(note->fd);
+        free(note);
+        return -1;
     }
 
-    /*
-     * FIFO name
-     *
-     * devnode + 5 => File names can't have backslashes
-     */
-    if (asprintf(&fifo_path, "%s%s %s (%s)",
-                 FIFO_DIR, manufacturer, product, devnode + 5) == -1) {
-        log_fn("asprintf: memory error");
-        return NULL;
+    /* Most terminals take it all right away. */
+    rt = write_note(note);
+    if (rt != 0) {
+        finish_note(note, (rt == -1) ? strerror(errno) : NULL);
+        return (rt == -1) ? -1 : 0;
     }
 
-    /* Create the named pipe. */
-    if (mkfifo(fifo_path, file_perm) == -1 && errno != EEXIST) {
-        log_fn("mkfifo(): %s: %s", fifo_path, strerror(errno));
-        free(fifo_path);
-        return NULL;
+    note->timer = event_add_timer(timeout, note_timeout, note);
+    if (note->timer == -1
+        || event_add_fd(note->fd, POLLOUT, note_event, note) == -1) {
+        if (note->timer == -1) note->timer = 0;
+        finish_note(note, "out of memory");
+        return -1;
     }
 
-    return fifo_path;
+    return 0;
 }
 
-int ask_passwd_cli(const char *manufacturer, const char *product,
-                   const char *devnode)
+/*
+ * Notify all available ttys about device insertion.
+ * Slow ttys are written to in the background. *graphical is set to the
+ * number of graphical sessions, which have no tty to write to.
+ *
+ * Return the number of ttys being notified.
+ */
+static int notify_all_ttys(const char *manufacturer, const char *product,
+                           const char *devnode, int *graphical)
 {
-    int i = 0;
+    int i, n;
+    const struct session *sessions = session_list(&n);
+    char *msg = NULL;
+    long timeout = get_sield_attr_int("notify timeout");
     int ttys_notified = 0;
-    int MAX_PWD_ATTEMPTS = 0;
-    int passwd_match = 0;
-    char *tty = NULL;
-    char *username = NULL;
-    char *plain_txt_passwd = NULL;
-    char *fifo_path = NULL;
-    FILE *fp = NULL;
-    struct auth_len lengths;
-    
-    MAX_PWD_ATTEMPTS = get_sield_attr_int("max password tries");
-    if (MAX_PWD_ATTEMPTS == -1) MAX_PWD_ATTEMPTS = 3;
-
-    ttys_notified = notify_all_ttys(manufacturer, product, devnode);
-
-    if (ttys_notified == 0) {
-        log_fn("No users are logged in. Ignoring %s (%s %s).",
-               devnode, manufacturer, product);
-        return 0;
-    }
 
-    log_fn("Wrote to %d tty(s) about device %s (%s %s). Awaiting response.",
-            ttys_notified, devnode, manufacturer, product);
+    if (timeout <= 0) timeout = NOTIFY_TIMEOUT;
 
-    fifo_path = makefifo(manufacturer, product, devnode);
-    if (fifo_path == NULL) return 0;
-
-    for (i = 0; (i < MAX_PWD_ATTEMPTS) && (passwd_match != 1); i++) {
-        /* Open the named pipe for reading. */
-        fp = fopen(fifo_path, "r");
-        if (fp == NULL) {
-            log_fn("fopen: %s: %s", fifo_path, strerror(errno));
-            free(fifo_path);
-            continue;
-        }
+    if (asprintf(&msg, "%s %s (%s) inserted. To scan and mount, execute %s\n",
+                 manufacturer, product, devnode, PROGRAM_NAME) == -1) {
+        log_fn("asprintf: memory error");
+        return 0;
+    }
 
-        /* Lengths */
-        if (fread(&lengths, sizeof(struct auth_len), 1, fp) != 1) {
-            log_fn("Unable to read data (strlens) sent from CLI app.");
+    *graphical = 0;
+    for (i = 0; i < n; i++) {
+        if (sessions[i].graphical) {
+            (*graphical)++;
             continue;
         }
 
-        tty = malloc((lengths.tty_len + 1) * sizeof(char));
-        username = malloc((lengths.user_len + 1) * sizeof(char));
-        plain_txt_passwd = malloc((lengths.pwd_len + 1) * sizeof(char));
-
-        if ((fread(tty, sizeof(char),
-                  lengths.tty_len + 1, fp) != lengths.tty_len + 1)
-            || (fread(username, sizeof(char),
-                     lengths.user_len + 1, fp) != lengths.user_len + 1)
-            || (fread(plain_txt_passwd, sizeof(char),
-                     lengths.pwd_len + 1, fp) != lengths.pwd_len + 1)) {
-
-            log_fn("Unable to read data sent from CLI app.");
-            if (tty) free(tty);
-            if (username) free(username);
-            if (plain_txt_passwd) free(plain_txt_passwd);
-            fclose(fp);
-            continue;
-        }
+        if (notify_tty(&sessions[i], msg, timeout) == 0) ttys_notified++;
+    }
 
-        if (is_passwd_correct(plain_txt_passwd)) {
-            log_fn("%s (@%s) provided correct password.", username, tty);
-            write_to_tty(tty, "Password accepted.\n");
-            passwd_match = 1;
-        } else {
-            log_fn("%s (@%s) entered incorrect password. Attempt #%d",
-                   username, tty, i+1);
-            write_to_tty(tty, "Incorrect password given.\n");
-            passwd_match = 0;
-        }
+    free(msg);
+    return ttys_notified;
+}
 
-        if (tty) free(tty);
-        if (username) free(username);
-        if (plain_txt_passwd) free(plain_txt_passwd);
-        fclose(fp);
+/*
+ * Notify all logged in users about the device and queue it with the
+ * authentication broker, where sld clients and desktop agents can
+ * answer for it.
+ *
+ * done() is called with the verdict.
+ *
+ * Return 0 if the device awaits a password, -1 otherwise.
+ */
+int ask_passwd_cli(const char *manufacturer, const char *product,
+                   const char *devnode, auth_done_fn done, void *data)
+{
+    int graphical = 0;
+    int ttys_notified = notify_all_ttys(manufacturer, product, devnode,
+                                        &graphical);
+    int agents = auth_agents();
+
+    if (ttys_notified == 0 && agents == 0) {
+        if (graphical > 0)
+            log_fn("%d graphical session(s), but no sield-agent running.",
+                   graphical);
+        log_fn("No users are logged in. Ignoring %s (%s %s).",
+               devnode, manufacturer, product);
+        return -1;
     }
 
-    if (passwd_match == 0) {
-        log_fn("Used all password attempts.");
-    }
+    log_fn("Notifying %d tty(s) and %d desktop agent(s) about device "
+           "%s (%s %s). Awaiting response.",
+           ttys_notified, agents, devnode, manufacturer, product);
 
-    /* Delete the associated named pipe. */
-    if (remove(fifo_path) == -1) {
-        log_fn("Unable to delete named pipe %s", fifo_path);
-    }
-    if (remove(FIFO_DIR) == -1) {
-        log_fn("Couldn't delete directory %s", FIFO_DIR);
-    }
-    if (fifo_path) free(fifo_path);
-    return passwd_match;
+    if (auth_request(manufacturer, product, devnode, done, data) == -1)
+        return -1;
+
+    return 0;
 }
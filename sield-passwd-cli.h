@@ -1,8 +1,10 @@
 #ifndef _SIELD_PASSWD_CLI_H_
 #define _SIELD_PASSWD_CLI_H_
 
+#include "sield-auth.h"     /* auth_done_fn */
+
 int
 ask_passwd_cli(const char *manufacturer, const char *product,
-               const char *devnode);
+               const char *devnode, auth_done_fn done, void *data);
 
 #endif
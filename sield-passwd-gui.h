@@ -1,9 +0,0 @@
-#ifndef _SIELD_PASSWD_DIALOG_H_
-#define _SIELD_PASSWD_DIALOG_H_
-
-/*
- * GTK Dialog to ask for password.
- */
-int ask_passwd_gui(const char *manufacturer, const char *product);
-
-#endif
@@ -1,82 +1,263 @@
-#define _GNU_SOURCE     /* crypt() */
+#define _GNU_SOURCE     /* explicit_bzero() */
+#include <crypt.h>      /* crypt_r(), crypt_gensalt_rn() */
+#include <ctype.h>      /* isdigit() */
 #include <errno.h>      /* errno */
+#include <getopt.h>     /* getopt_long() */
 #include <stdio.h>      /* fopen() */
-#include <stdlib.h>     /* rand(), srand(), free() */
+#include <stdlib.h>     /* free(), strtoul(), strtol() */
 #include <string.h>     /* strcmp() */
+#include <sys/random.h> /* getrandom() */
 #include <sys/stat.h>   /* mkdir() */
 #include <sys/types.h>  /* mkdir() */
-#include <time.h>       /* time() */
-#include <unistd.h>     /* crypt() */
+#include <time.h>       /* clock_gettime() */
+#include <unistd.h>     /* chown() */
 
+#include "sield-config.h"       /* get_sield_attr_no_log() */
 #include "sield-log.h"          /* log_fn() */
 #include "sield-passwd-check.h" /* is_passwd_correct() */
 #include "sield-passwd-cli-get.h"   /* get_passwd() */
 
-static char *generate_salt(void);
-static int set_passwd(const char *plain_txt_passwd);
-
 /*
- * Generate salt for SHA-512 for crypt(1).
+ * Supported hashing methods.
+ * cost is the log2 work factor for yescrypt, the rounds for SHA-512.
  */
-static char *generate_salt(void)
+struct hash_method {
+    const char *name;
+    const char *prefix;
+    unsigned long min_cost;
+    unsigned long max_cost;
+    unsigned long default_cost;
+};
+
+static const struct hash_method METHODS[] = {
+    {"yescrypt", "$y$", 1, 11, 5},
+    {"sha512", "$6$", 1000, 999999999, 5000},
+};
+
+/* Verification time --calibrate aims for, in ms. */
+#define CALIBRATE_TARGET 100
+
+#ifdef CRYPT_GENSALT_IMPLEMENTS_AUTO_ENTROPY
+#define SALT_SIZE CRYPT_GENSALT_OUTPUT_SIZE
+#else
+/* "$6$rounds=999999999$", 16 salt characters and "$", with room. */
+#define SALT_SIZE 64
+#endif
+
+static const struct hash_method *find_method(const char *name);
+static char *generate_salt(const struct hash_method *method,
+                           unsigned long cost);
+static double time_hash(const struct hash_method *method, unsigned long cost,
+                        struct crypt_data *data);
+static int calibrate(const struct hash_method *method, long target);
+static int set_passwd(const char *plain_txt_passwd,
+                      const struct hash_method *method, unsigned long cost);
+static void usage(const char *name);
+
+static const struct hash_method *find_method(const char *name)
 {
-    /* As defined in crypt(3). */
-    const char set[] =
-        "abcdefghijklmnopqrstuvwxyz"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "0123456789"
-        "./";
-    const int SALT_LEN = 16;
+    size_t i;
 
-    char *salt = NULL;
-    int idx = 0;
-    int i, size;
+    for (i = 0; i < sizeof(METHODS) / sizeof(METHODS[0]); i++)
+        if (strcmp(METHODS[i].name, name) == 0) return &METHODS[i];
+
+    return NULL;
+}
+
+/*
+ * Generate a setting (prefix, cost and salt) for crypt(3), with salt
+ * from the kernel's random source.
+ *
+ * Return NULL on error.
+ */
+static char *generate_salt(const struct hash_method *method,
+                           unsigned long cost)
+{
+    char *salt = calloc(SALT_SIZE, sizeof(char));
 
-    salt = calloc(SALT_LEN + 5, sizeof(char));
     if (salt == NULL) {
         log_fn("calloc(): Memory error.");
         return NULL;
     }
 
-    /* salt = "$6$random_string$" */
-    salt[idx++] = '$';
-    salt[idx++] = '6';
-    salt[idx++] = '$';
+#ifdef CRYPT_GENSALT_IMPLEMENTS_AUTO_ENTROPY
+    /* libxcrypt reads the random bytes itself. */
+    if (crypt_gensalt_rn(method->prefix, cost, NULL, 0,
+                         salt, SALT_SIZE) == NULL) {
+        log_fn("crypt_gensalt_rn(): %s: %s", method->name, strerror(errno));
+        free(salt);
+        return NULL;
+    }
+#else
+    {
+        /* As defined in crypt(3). */
+        const char set[] =
+            "abcdefghijklmnopqrstuvwxyz"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "0123456789"
+            "./";
+        const int SALT_LEN = 16;
+        unsigned char bytes[16];
+        int i, idx;
+
+        /* Only SHA-512 settings are simple enough to build by hand. */
+        if (strcmp(method->prefix, "$6$") != 0) {
+            log_fn("%s is not supported by this libcrypt.", method->name);
+            free(salt);
+            return NULL;
+        }
+
+        if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+            log_fn("getrandom(): %s", strerror(errno));
+            free(salt);
+            return NULL;
+        }
+
+        /* salt = "$6$rounds=N$random_string$" */
+        idx = snprintf(salt, SALT_SIZE, "$6$rounds=%lu$", cost);
+
+        for (i = 0; i < SALT_LEN; i++)
+            salt[idx++] = set[bytes[i] % (sizeof(set) - 1)];
+
+        salt[idx++] = '$';
+        salt[idx] = '\0';
+    }
+#endif
 
-    size = strlen(set);
+    return salt;
+}
 
-    srand(time(NULL));
+/* Milliseconds crypt_r(3) takes at the given cost (best of 3). */
+static double time_hash(const struct hash_method *method, unsigned long cost,
+                        struct crypt_data *data)
+{
+    double best = -1;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        struct timespec start, end;
+        char *salt = generate_salt(method, cost);
+        double ms;
+
+        if (salt == NULL) return -1;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (crypt_r("sield calibration", salt, data) == NULL) {
+            free(salt);
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free(salt);
 
-    for (i = 0; i < SALT_LEN; i++)
-        salt[idx++] = set[rand() / (RAND_MAX / size + 1)];
+        ms = (end.tv_sec - start.tv_sec) * 1000.0
+             + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+        if (best < 0 || ms < best) best = ms;
+    }
 
-    salt[idx++] = '$';
-    salt[idx] = '\0';
+    return best;
+}
 
-    return salt;
+/*
+ * Find the highest cost whose verification takes at most target ms on
+ * this host, and print the configuration for it.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int calibrate(const struct hash_method *method, long target)
+{
+    struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+    unsigned long cost, best = method->min_cost;
+    double ms;
+
+    if (data == NULL) {
+        log_fn("calloc(): Memory error.");
+        return -1;
+    }
+
+    printf("Calibrating %s for %ld ms per verification.\n",
+           method->name, target);
+
+    if (strcmp(method->name, "sha512") == 0) {
+        /* Time is linear in the rounds, roughly: scale down again until
+           it is within target. */
+        ms = time_hash(method, method->default_cost, data);
+        if (ms <= 0) goto error;
+
+        cost = (unsigned long) (method->default_cost * (target / ms));
+        if (cost < method->min_cost) cost = method->min_cost;
+        if (cost > method->max_cost) cost = method->max_cost;
+
+        while (1) {
+            unsigned long lower;
+
+            ms = time_hash(method, cost, data);
+            if (ms < 0) goto error;
+            printf("cost %lu: %.1f ms\n", cost, ms);
+
+            best = cost;
+            if (ms <= target || cost == method->min_cost) break;
+
+            lower = (unsigned long) (cost * (target / ms));
+            if (lower >= cost) lower = cost - 1;
+            cost = lower < method->min_cost ? method->min_cost : lower;
+        }
+    } else {
+        /* Every step doubles the memory and time. */
+        for (cost = method->min_cost; cost <= method->max_cost; cost++) {
+            ms = time_hash(method, cost, data);
+            if (ms < 0) goto error;
+
+            printf("cost %lu: %.1f ms\n", cost, ms);
+            if (ms > target) break;
+            best = cost;
+        }
+    }
+
+    printf("\nAdd to sield.conf:\n"
+           "hash method = %s\n"
+           "hash cost = %lu\n",
+           method->name, best);
+
+    free(data);
+    return 0;
+
+error:
+    fprintf(stderr, "Unable to hash with %s.\n", method->name);
+    free(data);
+    return -1;
 }
 
 /*
  * Update password.
  *
- * Encrypt using SHA-512 with a 16 byte salt.
+ * Hash with the given method and cost, and a 16 byte random salt.
  *
  * Return 0 on success, else return -1.
  */
-static int set_passwd(const char *plain_txt_passwd)
+static int set_passwd(const char *plain_txt_passwd,
+                      const struct hash_method *method, unsigned long cost)
 {
     const char *CONF_DIR = "/etc/sield/";
     char *salt = NULL;
     char *encrypted_passwd = NULL;
+    struct crypt_data *data = NULL;
     FILE *passwd_fp = NULL;
 
     /* Generate a salt. */
-    salt = generate_salt();
+    salt = generate_salt(method, cost);
     if (salt == NULL) return -1;
 
-    encrypted_passwd = crypt(plain_txt_passwd, salt);
-    if (encrypted_passwd == NULL) {
+    data = calloc(1, sizeof(struct crypt_data));
+    if (data == NULL) {
+        log_fn("calloc(): Memory error.");
+        free(salt);
+        return -1;
+    }
+
+    encrypted_passwd = crypt_r(plain_txt_passwd, salt, data);
+    if (encrypted_passwd == NULL || encrypted_passwd[0] == '*') {
         log_fn("Error encrypting password");
+        free(data);
         free(salt);
         return -1;
     }
@@ -84,6 +265,8 @@ static int set_passwd(const char *plain_txt_passwd)
     /* Make the app directory if not already present */
     if (mkdir(CONF_DIR, S_IRWXU) == -1 && errno != EEXIST) {
         log_fn("mkdir(): %s: %s", CONF_DIR, strerror(errno));
+        explicit_bzero(data, sizeof(*data));
+        free(data);
         free(salt);
         return -1;
     }
@@ -91,19 +274,19 @@ static int set_passwd(const char *plain_txt_passwd)
     passwd_fp = fopen(PASSWD_FILE, "w");
     if (passwd_fp == NULL) {
         log_fn("fopen(): %s: %s", PASSWD_FILE, strerror(errno));
+        explicit_bzero(data, sizeof(*data));
+        free(data);
         free(salt);
         return -1;
     }
 
     fprintf(passwd_fp, "%s\n", encrypted_passwd);
 
+    /* encrypted_passwd points into data. */
+    explicit_bzero(data, sizeof(*data));
+    free(data);
     free(salt);
     fclose(passwd_fp);
-    /*
-     * DON'T FREE RETURN VALUE OF crypt(3).
-     *
-     * free(encrypted_passwd);
-     */
 
     /* Change owner of password file to superuser. */
     if (chown(PASSWD_FILE, 0, 0) == -1) {
@@ -123,12 +306,123 @@ static int set_passwd(const char *plain_txt_passwd)
     return 0;
 }
 
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [--method yescrypt|sha512] [--cost N]\n"
+            "       %s --calibrate [--method yescrypt|sha512] [--target MS]\n"
+            "Change the sield password.\n\n"
+            "  -m, --method METHOD    hashing method (\"hash method\")\n"
+            "  -c, --cost N           yescrypt cost or SHA-512 rounds\n"
+            "                         (\"hash cost\")\n"
+            "  -C, --calibrate        find the cost for which verifying a\n"
+            "                         password takes --target ms (default %d)\n"
+            "                         on this host\n",
+            name, name, CALIBRATE_TARGET);
+}
+
 int main(int argc, char *argv[])
 {
     char *curr_plain_txt_passwd = NULL;
     char *new_plain_txt_passwd_1 = NULL;
     char *new_plain_txt_passwd_2 = NULL;
     size_t passwd_len = 0;
+    const struct hash_method *method = &METHODS[0];
+    char *method_name = get_sield_attr_no_log("hash method");
+    char *cost_str = get_sield_attr_no_log("hash cost");
+    unsigned long cost = 0;
+    long target = CALIBRATE_TARGET;
+    const char *target_str = NULL;
+    int opt, calibrate_only = 0;
+    const struct option options[] = {
+        {"method", required_argument, NULL, 'm'},
+        {"cost", required_argument, NULL, 'c'},
+        {"calibrate", no_argument, NULL, 'C'},
+        {"target", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    /* Options override the configuration. */
+    while ((opt = getopt_long(argc, argv, "m:c:Ct:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (method_name) free(method_name);
+                method_name = strdup(optarg);
+                break;
+            case 'c':
+                if (cost_str) free(cost_str);
+                cost_str = strdup(optarg);
+                break;
+            case 'C':
+                calibrate_only = 1;
+                break;
+            case 't':
+                target_str = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (method_name) {
+        method = find_method(method_name);
+        if (method == NULL) {
+            fprintf(stderr, "Unknown hash method \"%s\".\n", method_name);
+            exit(EXIT_FAILURE);
+        }
+        free(method_name);
+    }
+
+    /* Finds a cost, whatever the configured one. */
+    if (calibrate_only) {
+        if (cost_str) free(cost_str);
+        if (target_str) {
+            char *end = NULL;
+
+            errno = 0;
+            target = strtol(target_str, &end, 10);
+            /* Digits only: no sign, and nothing left over. */
+            if (!isdigit((unsigned char) target_str[0]) || *end != '\0'
+                || errno != 0) {
+                fprintf(stderr, "Invalid target time \"%s\".\n",
+                        target_str);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (target <= 0) {
+            fprintf(stderr, "Invalid target time.\n");
+            exit(EXIT_FAILURE);
+        }
+        exit(calibrate(method, target) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    cost = method->default_cost;
+    if (cost_str) {
+        char *end = NULL;
+
+        errno = 0;
+        cost = strtoul(cost_str, &end, 10);
+        /* Digits only: no sign, and nothing left over. */
+        if (!isdigit((unsigned char) cost_str[0]) || *end != '\0'
+            || errno != 0) {
+            fprintf(stderr, "Invalid %s cost \"%s\".\n",
+                    method->name, cost_str);
+            free(cost_str);
+            exit(EXIT_FAILURE);
+        }
+        free(cost_str);
+    }
+
+    if (cost < method->min_cost || cost > method->max_cost) {
+        fprintf(stderr, "%s cost must be within %lu and %lu.\n",
+                method->name, method->min_cost, method->max_cost);
+        exit(EXIT_FAILURE);
+    }
 
     printf("Changing password for SIELD\n");
     printf("(current) password: ");
@@ -164,7 +458,7 @@ int main(int argc, char *argv[])
     /* Check if new password is the same as the old one. */
     if (strcmp(new_plain_txt_passwd_1, curr_plain_txt_passwd) == 0) {
         printf("\nPassword unchanged.\n");
-    } else if (set_passwd(new_plain_txt_passwd_1) == 0) {
+    } else if (set_passwd(new_plain_txt_passwd_1, method, cost) == 0) {
         printf("\nPassword updated successfully.\n");
         log_fn("Password updated.");
     } else {
@@ -0,0 +1,60 @@
+#ifndef _SIELD_PROBE_H_
+#define _SIELD_PROBE_H_
+
+/*
+ * Static tracepoints (USDT, provider "sield") along a device's way
+ * through the daemon and its workers, eg.
+ *
+ *   bpftrace -e 'usdt:/usr/bin/sield:sield:scan_end
+ *                { printf("%s %d ms\n", str(arg0), arg3); }'
+ *
+ * A probe is a single nop until a tracer attaches to it. Without
+ * <sys/sdt.h> (systemtap-sdt-dev) they are compiled out altogether.
+ *
+ * Times are in milliseconds, sizes in bytes.
+ *
+ * event_received   (action, devnode)
+ * device_accepted  (devnode, how)      how: "trusted", "grace", "password"
+ * device_rejected  (devnode)
+ * auth_prompt      (devnode, id)       waiting for a password
+ * auth_result      (devnode, approved, user, waited)
+ * job_queued       (devnode, size, waiting)    other jobs queued
+ * job_started      (devnode, size, queued)     handed to a worker
+ * job_done         (devnode, mounted, total)   since queued
+ * scan_start       (devnode, bytes)    bytes in use on the device
+ * scan_end         (devnode, result, bytes, took)  result: is_infected()
+ * scan_acct        (devnode, read, reads, cpu, queued)  block layer bytes
+ *                  and reads, scanner CPU (user + system)
+ * mount            (devnode, mountpoint, ro, error, took)  error: errno
+ * unmount          (devnode, mountpoint, lazy)
+ * share_added      (devnode, path)
+ * share_removed    (devnode)
+ * share_applied    (delayed)           smbd asked to reload
+ * onaccess_scan    (path, result, took)    result: as is_infected(), on open
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SIELD_HAVE_SDT
+#endif
+#endif
+
+#ifdef SIELD_HAVE_SDT
+#define PROBE1(name, a) DTRACE_PROBE1(sield, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(sield, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(sield, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(sield, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(sield, name, a, b, c, d, e)
+#else
+/* Arguments aren't evaluated, but count as used. */
+#define PROBE1(name, a) do { (void) sizeof(a); } while (0)
+#define PROBE2(name, a, b) do { PROBE1(name, a); (void) sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) \
+    do { PROBE2(name, a, b); (void) sizeof(c); } while (0)
+#define PROBE4(name, a, b, c, d) \
+    do { PROBE3(name, a, b, c); (void) sizeof(d); } while (0)
+#define PROBE5(name, a, b, c, d, e) \
+    do { PROBE4(name, a, b, c, d); (void) sizeof(e); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+#include <errno.h>              /* errno */
+#include <limits.h>             /* NAME_MAX */
+#include <paths.h>              /* _PATH_UTMP */
+#include <poll.h>               /* POLLIN */
+#include <stdlib.h>             /* realloc() */
+#include <string.h>             /* strncpy() */
+#include <sys/inotify.h>        /* inotify_init1() */
+#include <unistd.h>             /* read() */
+#include <utmp.h>               /* getutent() */
+
+#include "sield-event.h"        /* event_add_fd() */
+#include "sield-log.h"          /* log_fn() */
+#include "sield-session.h"
+
+/*
+ * utmp is only read again after inotify reported a change to it,
+ * instead of on every device. Without inotify it is read every time,
+ * as before.
+ */
+static struct session *sessions = NULL;
+static int nsessions = 0;
+static int capacity = 0;
+static int stale = 1;
+
+static int inotify_fd = -1;
+static int watch = -1;
+
+static int load_sessions(void);
+static int watch_utmp(void);
+static void utmp_event(int fd, short revents, void *data);
+
+/* Read all user sessions from utmp. */
+static int load_sessions(void)
+{
+    struct utmp *ut = NULL;
+
+    nsessions = 0;
+
+    setutent();
+    /* Don't free ut, it is statically allocated. */
+    while ((ut = getutent()) != NULL) {
+        struct session *session = NULL;
+
+        /* Skip invalid entries. */
+        if (ut->ut_type != USER_PROCESS || ut->ut_line[0] == '\0') continue;
+
+        if (nsessions == capacity) {
+            int more = capacity ? capacity * 2 : 16;
+            struct session *s = realloc(sessions, more * sizeof(*s));
+
+            if (s == NULL) {
+                log_fn("realloc(): Memory error.");
+                break;
+            }
+            sessions = s;
+            capacity = more;
+        }
+
+        session = &sessions[nsessions++];
+        memset(session, 0, sizeof(*session));
+        strncpy(session->user, ut->ut_user, sizeof(ut->ut_user));
+        strncpy(session->line, ut->ut_line, sizeof(ut->ut_line));
+
+        /* Display managers record the display (":0") as line or host. */
+        session->graphical = (ut->ut_line[0] == ':' || ut->ut_host[0] == ':');
+    }
+    endutent();
+
+    /* Up to date until inotify says otherwise. */
+    stale = (watch == -1);
+    return nsessions;
+}
+
+/* (Re-)add the inotify watch, utmp may have been replaced. */
+static int watch_utmp(void)
+{
+    watch = inotify_add_watch(inotify_fd, _PATH_UTMP,
+                              IN_MODIFY | IN_CLOSE_WRITE
+                              | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (watch == -1) {
+        log_fn("inotify_add_watch(): %s: %s", _PATH_UTMP, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void utmp_event(int fd, short revents, void *data)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        char *p;
+
+        for (p = buf; p < buf + n;
+             p += sizeof(struct inotify_event)
+                  + ((struct inotify_event *) p)->len) {
+            struct inotify_event *event = (struct inotify_event *) p;
+
+            stale = 1;
+
+            /* The kernel drops the watch along with the file. */
+            if (event->mask & IN_IGNORED) watch = -1;
+            else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                inotify_rm_watch(fd, event->wd);
+                watch = -1;
+            }
+        }
+    }
+
+    if (watch == -1) watch_utmp();
+}
+
+/*
+ * Load the sessions and start watching utmp.
+ *
+ * Return 0 on success, -1 if utmp can't be watched (sessions are then
+ * read from utmp every time).
+ */
+int session_init(void)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        log_fn("inotify_init1(): %s", strerror(errno));
+        load_sessions();
+        return -1;
+    }
+
+    if (watch_utmp() == -1
+        || event_add_fd(inotify_fd, POLLIN, utmp_event, NULL) == -1) {
+        close(inotify_fd);
+        inotify_fd = -1;
+        watch = -1;
+        load_sessions();
+        return -1;
+    }
+
+    load_sessions();
+    return 0;
+}
+
+/* Current sessions; *n is set to their number. */
+const struct session *session_list(int *n)
+{
+    /* utmp was missing when it was last replaced; try again. */
+    if (inotify_fd != -1 && watch == -1) watch_utmp();
+
+    if (stale) load_sessions();
+
+    *n = nsessions;
+    return sessions;
+}
+
+/* Return 1 if the user has any session, else 0. */
+int session_user_active(const char *user)
+{
+    int i, n;
+    const struct session *list = session_list(&n);
+
+    for (i = 0; i < n; i++)
+        if (strcmp(list[i].user, user) == 0) return 1;
+
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _SIELD_SESSION_H_
+#define _SIELD_SESSION_H_
+
+#include <utmp.h>           /* UT_NAMESIZE, UT_LINESIZE */
+
+/*
+ * Registry of login sessions, kept in sync with utmp.
+ */
+struct session {
+    char user[UT_NAMESIZE + 1];
+    char line[UT_LINESIZE + 1];     /* "pts/0", ":0" */
+    int graphical;                  /* X/Wayland display, not a tty */
+};
+
+int session_init(void);
+const struct session *session_list(int *n);
+int session_user_active(const char *user);
+
+#endif
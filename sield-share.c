@@ -1,59 +1,195 @@
 #define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "sield-config.h"
+#include "sield-event.h"
 #include "sield-log.h"
+#include "sield-probe.h"
+#include "sield-share.h"
 
-static const char *SMB_FILE = "/etc/samba/smb.conf";
-static const char *SMB_FILE_BAK = "/etc/samba/smb.conf.bak";
+/*
+ * Every shared device gets its own fragment in SMB_SHARE_DIR.
+ * SMB_INCLUDE_FILE lists all the fragments and is the only file
+ * smb.conf needs to know about:
+ *
+ *  [global]
+ *  include = /etc/samba/sield/shares.conf
+ *
+ * smb.conf itself is never modified.
+ */
+static const char *SMB_CONF_DIR = "/etc/samba/sield/";
+static const char *SMB_SHARE_DIR = "/etc/samba/sield/shares.d/";
+static const char *SMB_INCLUDE_FILE = "/etc/samba/sield/shares.conf";
+static const char *SMB_LOCK_FILE = "/etc/samba/sield/.lock";
+
+static const char *SMBCONTROL = "/usr/bin/smbcontrol";
+static const char *SMBD_PID_FILES[] = {
+    "/var/run/samba/smbd.pid",
+    "/var/run/smbd.pid",
+    NULL
+};
 
-static int backup_smb_file(void);
-static int write_smbconf(const char *path, const char *manufacturer,
-                         const char *product);
-static int restart_daemon(const char *name);
-static int restart_daemon_alt(const char *name);
+#define SMB_RELOAD_DELAY 1000       /* default debounce window (ms) */
+#define SMB_RELOAD_MAX_WINDOWS 5
 
-/* Write custom smb.conf file and restart samba daemon. */
+/* Pending reload */
+static int reload_timer = 0;
+static long reload_first = 0;
+
+static char *fragment_path(const char *devnode);
+static int fragment_filter(const struct dirent *ent);
+static int make_share_dirs(void);
+static FILE *create_tmp(const char *tmp);
+static int write_fragment(const char *fragment, const char *path,
+                          const char *manufacturer, const char *product,
+                          const char *devnode);
+static int rebuild_include_file(void);
+static void reload_timeout(void *data);
+static int sighup_smbd(void);
+
+/*
+ * Write a share fragment for the device.
+ * smbd picks it up on the next samba_reload().
+ *
+ * Return 0 on success, -1 on error.
+ */
 int samba_share(const char *path, const char *manufacturer,
-                const char *product)
+                const char *product, const char *devnode)
 {
-    if ((write_smbconf(path, manufacturer, product) != 0)
-        || (restart_daemon("smbd") != 0)
-        || (restart_daemon("nmbd") != 0)) {
+    char *fragment = NULL;
+
+    if (make_share_dirs() == -1) return -1;
+
+    fragment = fragment_path(devnode);
+    if (fragment == NULL) return -1;
+
+    if (write_fragment(fragment, path, manufacturer, product, devnode) == -1) {
+        free(fragment);
         return -1;
-    } else {
-        return 0;
     }
+
+    free(fragment);
+
+    PROBE2(share_added, devnode, path);
+    return rebuild_include_file();
 }
 
-/* Restore original smb.conf */
-int restore_smb_conf(void)
+/*
+ * Remove the share fragment of given device.
+ * Shares of other devices are left untouched.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int samba_unshare(const char *devnode)
 {
-    if (rename(SMB_FILE_BAK, SMB_FILE) == -1) {
-        log_fn("%s", strerror(errno));
-        log_fn("Unable to restore smb.conf");
+    char *fragment = fragment_path(devnode);
+    if (fragment == NULL) return -1;
+
+    if (remove(fragment) == -1 && errno != ENOENT) {
+        log_fn("remove(): %s: %s", fragment, strerror(errno));
+        free(fragment);
         return -1;
     }
 
-    return 0;
+    free(fragment);
+
+    PROBE1(share_removed, devnode);
+    return rebuild_include_file();
+}
+
+/*
+ * Remove every share fragment written by us.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int samba_unshare_all(void)
+{
+    int i, n;
+    int ret = 0;
+    struct dirent **entries = NULL;
+
+    n = scandir(SMB_SHARE_DIR, &entries, fragment_filter, alphasort);
+    if (n == -1) {
+        /* Nothing was ever shared. */
+        if (errno == ENOENT) return 0;
+
+        log_fn("scandir(): %s: %s", SMB_SHARE_DIR, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        char *fragment = NULL;
+
+        if (asprintf(&fragment, "%s%s",
+                     SMB_SHARE_DIR, entries[i]->d_name) == -1) {
+            log_fn("asprintf(): Memory error");
+            ret = -1;
+        } else {
+            if (remove(fragment) == -1) {
+                log_fn("remove(): %s: %s", fragment, strerror(errno));
+                ret = -1;
+            }
+            free(fragment);
+        }
+
+        free(entries[i]);
+    }
+    free(entries);
+
+    if (n > 0 && rebuild_include_file() != 0) ret = -1;
+    if (n > 0 && samba_reload() != 0) ret = -1;
+
+    return ret;
+}
+
+/* Return the fragment file used for given device node. */
+static char *fragment_path(const char *devnode)
+{
+    char *fragment = NULL;
+    const char *name = strrchr(devnode, '/');
+
+    /* "/dev/sdb1" => "sdb1" */
+    name = (name == NULL) ? devnode : name + 1;
+
+    if (asprintf(&fragment, "%s%s.conf", SMB_SHARE_DIR, name) == -1) {
+        log_fn("asprintf(): Memory error");
+        return NULL;
+    }
+
+    return fragment;
 }
 
-/* Backup smb.conf file */
-static int backup_smb_file(void)
+/* Filter function to select only share fragments. */
+static int fragment_filter(const struct dirent *ent)
 {
-    /*
-     * TODO: smb.conf may also reside at
-     * 1) /usr/local/samba/lib/smb.conf
-     * 2) /usr/samba/lib/smb.conf
-     *
-     * according to samba(8).
-     */
-    if (rename(SMB_FILE, SMB_FILE_BAK) == -1) {
-        log_fn("%s", strerror(errno));
-        log_fn("Unable to backup samba configuration file \"%s\".", SMB_FILE);
+    size_t len = strlen(ent->d_name);
+
+    if (ent->d_name[0] == '.') return 0;
+    if (len < 5 || strcmp(ent->d_name + len - 5, ".conf") != 0) return 0;
+
+    return 1;
+}
+
+/* Create the directories holding the include file and the fragments. */
+static int make_share_dirs(void)
+{
+    mode_t perm = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+
+    if (mkdir(SMB_CONF_DIR, perm) == -1 && errno != EEXIST) {
+        log_fn("mkdir(): %s: %s", SMB_CONF_DIR, strerror(errno));
+        return -1;
+    }
+
+    if (mkdir(SMB_SHARE_DIR, perm) == -1 && errno != EEXIST) {
+        log_fn("mkdir(): %s: %s", SMB_SHARE_DIR, strerror(errno));
         return -1;
     }
 
@@ -61,120 +197,265 @@ static int backup_smb_file(void)
 }
 
 /*
- * Write smb.conf to share given path
- * (after backing up the old smb.conf)
+ * Create a file for root to write and everyone to read, whatever the
+ * umask and whatever was left at tmp: smbd loads what it includes as
+ * root.
+ *
+ * Return the open file, NULL on error.
+ */
+static FILE *create_tmp(const char *tmp)
+{
+    FILE *fp = NULL;
+    int fd;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) return NULL;
+
+    if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == -1
+        || (fp = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    return fp;
+}
+
+/*
+ * Write the share section for given path to the fragment file.
+ * The file is written under a temporary name and renamed into
+ * place, so samba never reads a half-written share.
  *
  * Return 0 on success, -1 on error.
  */
-static int write_smbconf(const char *path, const char *manufacturer,
-                         const char *product)
+static int write_fragment(const char *fragment, const char *path,
+                          const char *manufacturer, const char *product,
+                          const char *devnode)
 {
-    char *workgroup = NULL;
+    char *tmp = NULL;
     char *hosts_allow = NULL;
+    const char *name = strrchr(devnode, '/');
     FILE *smb = NULL;
 
-    /* Backup old smb file. */
-    if (backup_smb_file() == -1) return -1;
+    name = (name == NULL) ? devnode : name + 1;
 
-    smb = fopen(SMB_FILE, "w");
-    if (smb == NULL) {
-        log_fn("Unable to open \"%s\" for writing.", SMB_FILE);
+    if (asprintf(&tmp, "%s.tmp", fragment) == -1) {
+        log_fn("asprintf(): Memory error");
         return -1;
     }
 
-    fprintf(smb, "[global]\n");
-    workgroup = get_sield_attr("workgroup");
-    if (workgroup != NULL) {
-        fprintf(smb, "workgroup = %s\n", workgroup);
-        free(workgroup);
+    smb = create_tmp(tmp);
+    if (smb == NULL) {
+        log_fn("Unable to open \"%s\" for writing.", tmp);
+        free(tmp);
+        return -1;
     }
 
+    /* Device node keeps share names unique for identical devices. */
+    fprintf(smb, "[%s %s (%s)]\n", manufacturer, product, name);
+    fprintf(smb, "path = %s\n", path);
+    fprintf(smb, "browseable = yes\n");
+
     hosts_allow = get_sield_attr("hosts allow");
     if (hosts_allow != NULL) {
-        fprintf(smb, "hosts allow = %s\n", get_sield_attr("hosts allow"));
+        fprintf(smb, "hosts allow = %s\n", hosts_allow);
         free(hosts_allow);
     }
 
-    fprintf(smb, "log file = /var/log/samba/log.%%m\n");
-    fprintf(smb, "server string = USB Share\n");
-
-    /* Local settings */
-    fprintf(smb, "[%s %s]\n", manufacturer, product);
-    fprintf(smb, "path = %s\n", path);
-    fprintf(smb, "browseable = yes\n");
-
     fprintf(smb, "read only = ");
 
     if (get_sield_attr_int("read only") == 0) fprintf(smb, "no\n");
     else fprintf(smb, "yes\n");
 
-    fclose(smb);
+    if (fclose(smb) == EOF || rename(tmp, fragment) == -1) {
+        log_fn("Unable to write share fragment \"%s\": %s",
+               fragment, strerror(errno));
+        remove(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    free(tmp);
     return 0;
 }
 
 /*
- * Restart the given daemon.
+ * Regenerate SMB_INCLUDE_FILE from the fragments present in
+ * SMB_SHARE_DIR.
  *
- * Return 0 on success, else return -1.
+ * Every device is handled by its own process, so the rebuild is
+ * serialized with a lock file to keep concurrent updates from
+ * dropping each other's shares.
+ *
+ * Return 0 on success, -1 on error.
  */
-static int restart_daemon(const char *name)
+static int rebuild_include_file(void)
 {
-    pid_t pid = 0;
-    char *pid_file = NULL;
-    FILE *pid_fp = NULL;
-
-    /*
-     * Try sending a SIGHUP to the running process.
-     * (find $name.pid in /var/run)
-     *
-     * if this fails, run "$name restart".
-     */
-    if (asprintf(&pid_file, "/var/run/%s.pid", name) == -1) {
-        log_fn("asprintf(): Memory error");
+    int i, n;
+    int lock_fd = -1;
+    int ret = -1;
+    char *tmp = NULL;
+    struct dirent **entries = NULL;
+    FILE *fp = NULL;
+
+    if (make_share_dirs() == -1) return -1;
+
+    lock_fd = open(SMB_LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR);
+    if (lock_fd == -1) {
+        log_fn("open(): %s: %s", SMB_LOCK_FILE, strerror(errno));
         return -1;
     }
 
-    pid_fp = fopen(pid_file, "r");
-    if (pid_fp == NULL) {
-        log_fn("Can't open %s for reading.", pid_file);
-        return restart_daemon_alt(name);
+    if (flock(lock_fd, LOCK_EX) == -1) {
+        log_fn("flock(): %s: %s", SMB_LOCK_FILE, strerror(errno));
+        close(lock_fd);
+        return -1;
     }
 
-    free(pid_file);
+    n = scandir(SMB_SHARE_DIR, &entries, fragment_filter, alphasort);
+    if (n == -1) {
+        log_fn("scandir(): %s: %s", SMB_SHARE_DIR, strerror(errno));
+        goto cleanup;
+    }
 
-    if (fscanf(pid_fp, "%d", &pid) != 1) {
-        log_fn("Can't read pid from %s.", pid_file);
-        return restart_daemon_alt(name);
+    if (asprintf(&tmp, "%s.tmp", SMB_INCLUDE_FILE) == -1) {
+        log_fn("asprintf(): Memory error");
+        tmp = NULL;
+        goto cleanup;
     }
 
-    if (kill(pid, SIGHUP) == -1) {
-        log_fn("Couldn't send SIGHUP to PID %d: %s", pid, strerror(errno));
-        return restart_daemon_alt(name);
+    fp = create_tmp(tmp);
+    if (fp == NULL) {
+        log_fn("Unable to open \"%s\" for writing.", tmp);
+        goto cleanup;
+    }
+
+    fprintf(fp, "# Generated by sield. Do not edit.\n");
+    for (i = 0; i < n; i++)
+        fprintf(fp, "include = %s%s\n", SMB_SHARE_DIR, entries[i]->d_name);
+
+    if (fclose(fp) == EOF || rename(tmp, SMB_INCLUDE_FILE) == -1) {
+        log_fn("Unable to write \"%s\": %s", SMB_INCLUDE_FILE, strerror(errno));
+        remove(tmp);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    for (i = 0; i < n; i++) free(entries[i]);
+    if (entries) free(entries);
+    if (tmp) free(tmp);
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+    return ret;
+}
+
+/* Debounce window elapsed. */
+static void reload_timeout(void *data)
+{
+    reload_timer = 0;
+    PROBE1(share_applied, event_now_ms() - reload_first);
+    samba_reload();
+}
+
+/*
+ * Ask smbd to reload its configuration once share changes settle.
+ *
+ * Every request within the debounce window ("share reload delay")
+ * postpones the reload, so a burst of devices results in a single
+ * reload. The reload is never postponed by more than
+ * SMB_RELOAD_MAX_WINDOWS windows since the first pending request.
+ */
+void samba_schedule_reload(void)
+{
+    long now = event_now_ms();
+    long delay = get_sield_attr_int("share reload delay");
+
+    if (delay < 0) delay = SMB_RELOAD_DELAY;
+
+    if (reload_timer == 0) {
+        reload_first = now;
     } else {
-        log_fn("Sent SIGHUP to PID %d (%s).", pid, name);
-        return 0;
+        long latest = reload_first + delay * SMB_RELOAD_MAX_WINDOWS;
+
+        event_del_timer(reload_timer);
+        if (now + delay > latest) delay = (latest > now) ? latest - now : 0;
+    }
+
+    reload_timer = event_add_timer(delay, reload_timeout, NULL);
+
+    /* Couldn't arm the timer, don't lose the update. */
+    if (reload_timer == -1) {
+        reload_timer = 0;
+        samba_reload();
     }
 }
 
 /*
- * Restart any daemon from sh
+ * Send a single config reload message to smbd.
+ *
+ * Existing client sessions and nmbd are left alone; only the share
+ * definitions are re-read.
  *
  * Return 0 on success, -1 on error.
  */
-static int restart_daemon_alt(const char *name)
+int samba_reload(void)
 {
-    int ret = -1;
-    char *cmd = NULL;
-    if (asprintf(&cmd, "%s restart", name) == -1) {
-        log_fn("memory error");
-        return -1;
+    /* Prefer smbcontrol, it reaches every smbd process. */
+    if (access(SMBCONTROL, X_OK) == 0) {
+        switch (fork()) {
+            case -1:
+                log_fn("fork(): %s", strerror(errno));
+                break;
+            case 0:
+                execl(SMBCONTROL, "smbcontrol", "smbd", "reload-config",
+                      (char *) NULL);
+                _exit(127);
+            default:
+                /* Reaped by the SIGCHLD handler. */
+                log_fn("Requested smbd configuration reload.");
+                return 0;
+        }
     }
 
-    ret = system(cmd);
+    return sighup_smbd();
+}
 
-    if (ret != 0) log_fn("Failed to restart %s.", name);
-    else log_fn("Restarted %s.", name);
+/*
+ * Send SIGHUP to smbd (find smbd.pid in the usual places),
+ * which makes it reload smb.conf.
+ *
+ * Return 0 on success, else return -1.
+ */
+static int sighup_smbd(void)
+{
+    const char **pid_file;
 
-    free(cmd);
-    return ret;
+    for (pid_file = SMBD_PID_FILES; *pid_file != NULL; pid_file++) {
+        pid_t pid = 0;
+        FILE *pid_fp = fopen(*pid_file, "r");
+
+        if (pid_fp == NULL) continue;
+
+        if (fscanf(pid_fp, "%d", &pid) != 1) {
+            log_fn("Can't read pid from %s.", *pid_file);
+            fclose(pid_fp);
+            continue;
+        }
+
+        fclose(pid_fp);
+
+        if (kill(pid, SIGHUP) == -1) {
+            log_fn("Couldn't send SIGHUP to PID %d: %s", pid, strerror(errno));
+            return -1;
+        }
+
+        log_fn("Sent SIGHUP to PID %d (smbd).", pid);
+        return 0;
+    }
+
+    log_fn("Can't find a running smbd to reload.");
+    return -1;
 }
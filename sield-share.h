@@ -1,9 +1,12 @@
 #ifndef _SIELD_SHARE_H_
 #define _SIELD_SHARE_H_
 
-int samba_share(const char *path,
-	const char *manufacturer, const char *product);
+int samba_share(const char *path, const char *manufacturer,
+                const char *product, const char *devnode);
+int samba_unshare(const char *devnode);
+int samba_unshare_all(void);
 
-int restore_smb_conf(void);
+void samba_schedule_reload(void);
+int samba_reload(void);
 
 #endif
@@ -0,0 +1,334 @@
+#include <errno.h>          /* errno */
+#include <getopt.h>         /* getopt_long() */
+#include <stdio.h>          /* printf() */
+#include <stdlib.h>         /* exit() */
+#include <string.h>         /* strcmp() */
+#include <sys/socket.h>     /* socket() */
+#include <sys/time.h>       /* struct timeval */
+#include <sys/un.h>         /* struct sockaddr_un */
+#include <time.h>           /* strftime() */
+#include <unistd.h>         /* close() */
+
+#include "sield-ctl-ipc.h"  /* struct ctl_msg */
+#include "sield-inventory.h"    /* inventory_foreach() */
+#include "sield-ipc.h"      /* PROGRAM_NAME */
+#include "sield-log.h"      /* log_fn() */
+
+/* Seconds to wait for the daemon's answers. */
+#define ANSWER_TIMEOUT 5
+
+/* type 0: answered without the daemon. */
+static const struct command {
+    const char *name;
+    int type;
+    int needs_device;
+} COMMANDS[] = {
+    {"status", CTL_STATUS, 0},
+    {"eject", CTL_EJECT, 1},
+    {"rescan", CTL_RESCAN, 1},
+    {"reload", CTL_RELOAD, 0},
+    {"pause", CTL_PAUSE, 0},
+    {"resume", CTL_RESUME, 0},
+    {"inventory", 0, 0},
+};
+
+static int connect_daemon(void);
+static int send_request(int fd, int type, const char *devnode);
+static int receive(int fd, struct ctl_msg *msg);
+static int print_status(int fd);
+static int print_result(int fd);
+static void format_size(unsigned long long size, char *buf, size_t len);
+static void format_time(long long when, char *buf, size_t len);
+static void print_record(const struct inventory_record *record, void *data);
+static int print_inventory(void);
+static void usage(void);
+
+/* Add program name to logging function */
+#define log(format, ...) log_fn("[%s] "format, PROGRAM_NAME, ##__VA_ARGS__)
+
+/* Return a socket connected to the daemon, -1 on error. */
+static int connect_daemon(void)
+{
+    int fd;
+    struct sockaddr_un addr;
+    struct timeval timeout = {ANSWER_TIMEOUT, 0};
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, CTL_SOCKET, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "socket(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* A daemon stuck elsewhere shouldn't hang us. */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout)) == -1) {
+        fprintf(stderr, "setsockopt(): %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "%s: %s\n", CTL_SOCKET, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int send_request(int fd, int type, const char *devnode)
+{
+    struct ctl_msg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    if (devnode) strncpy(msg.devnode, devnode, sizeof(msg.devnode) - 1);
+
+    if (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+        fprintf(stderr, "send(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Receive one answer from the daemon.
+ *
+ * Return 0 on success, -1 on error (reported).
+ */
+static int receive(int fd, struct ctl_msg *msg)
+{
+    ssize_t n = recv(fd, msg, sizeof(*msg), 0);
+
+    if (n == sizeof(*msg)) return 0;
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        fprintf(stderr, "No answer from daemon in %d s.\n", ANSWER_TIMEOUT);
+    else
+        fprintf(stderr, "Unexpected reply from daemon.\n");
+    return -1;
+}
+
+/* 1536 => "1.5K" */
+static void format_size(unsigned long long size, char *buf, size_t len)
+{
+    const char *units = "BKMGTP";
+    double value = size;
+
+    if (size == 0) {
+        snprintf(buf, len, "-");
+        return;
+    }
+
+    while (value >= 1024 && units[1] != '\0') {
+        value /= 1024;
+        units++;
+    }
+
+    snprintf(buf, len, value < 10 ? "%.1f%c" : "%.0f%c", value, *units);
+}
+
+static void format_time(long long when, char *buf, size_t len)
+{
+    time_t t = when;
+
+    if (when == 0 || strftime(buf, len, "%F %H:%M", localtime(&t)) == 0)
+        snprintf(buf, len, "-");
+}
+
+/* inventory_foreach() callback */
+static void print_record(const struct inventory_record *record, void *data)
+{
+    int *n = (int *) data;
+    char first[32], last[32], size[16], took[16] = "-";
+
+    if ((*n)++ == 0)
+        printf("%-16s %-16s %6s %-11s %7s %7s  %s\n",
+               "FIRST SEEN", "LAST SEEN", "TIMES", "LAST SCAN", "TOOK",
+               "READ", "DEVICE");
+
+    format_time(record->first_seen, first, sizeof(first));
+    format_time(record->last_seen, last, sizeof(last));
+    format_size(record->scan_bytes, size, sizeof(size));
+    if (record->scan_ms > 0)
+        snprintf(took, sizeof(took), "%.1fs", record->scan_ms / 1000.0);
+
+    printf("%-16s %-16s %6u %-11s %7s %7s  %.*s [%.*s]\n",
+           first, last, record->inserts,
+           inventory_verdict(record->verdict), took, size,
+           (int) sizeof(record->description), record->description,
+           (int) sizeof(record->id), record->id);
+}
+
+/*
+ * Print every device seen, read from the inventory file.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int print_inventory(void)
+{
+    int n = 0;
+
+    if (inventory_open(0) == -1) {
+        if (errno == ENOENT) {
+            printf("No devices.\n");
+            return 0;
+        }
+        fprintf(stderr, "Unable to read the inventory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    inventory_foreach(print_record, &n);
+    if (n == 0) printf("No devices.\n");
+
+    return 0;
+}
+
+/*
+ * Print the devices the daemon is handling.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int print_status(int fd)
+{
+    struct ctl_msg msg;
+    int n = 0;
+
+    while (receive(fd, &msg) == 0) {
+        char size[16], progress[8] = "";
+
+        if (msg.type == CTL_END) {
+            if (n == 0) printf("No devices.\n");
+            if (msg.status) printf("Paused: devices are not handled.\n");
+            return 0;
+        }
+        if (msg.type != CTL_DEVICE) {
+            fprintf(stderr, "Unexpected reply from daemon.\n");
+            break;
+        }
+
+        msg.state[sizeof(msg.state) - 1] = '\0';
+        msg.devnode[sizeof(msg.devnode) - 1] = '\0';
+        msg.text[sizeof(msg.text) - 1] = '\0';
+
+        if (n++ == 0)
+            printf("%-16s %-10s %8s %7s %4s  %s\n",
+                   "DEVICE", "STATE", "TIME", "SIZE", "SCAN", "");
+
+        format_size(msg.size, size, sizeof(size));
+        if (msg.progress >= 0)
+            snprintf(progress, sizeof(progress), "%d%%", msg.progress);
+        printf("%-16s %-10s %7.1fs %7s %4s  %s\n", msg.devnode, msg.state,
+               msg.elapsed / 1000.0, size, progress, msg.text);
+    }
+
+    return -1;
+}
+
+/*
+ * Print the outcome of a command.
+ *
+ * Return 0 if it succeeded, -1 otherwise.
+ */
+static int print_result(int fd)
+{
+    struct ctl_msg msg;
+
+    if (receive(fd, &msg) == -1) return -1;
+
+    if (msg.type != CTL_RESULT) {
+        fprintf(stderr, "Unexpected reply from daemon.\n");
+        return -1;
+    }
+
+    if (msg.status == CTL_OK) return 0;
+
+    msg.text[sizeof(msg.text) - 1] = '\0';
+    fprintf(stderr, "%s\n", msg.text);
+    return -1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s COMMAND [DEVICE]\n"
+            "Control the sield daemon.\n\n"
+            "  status                 devices being handled, with the time\n"
+            "                         spent in their current state\n"
+            "  eject DEVICE           unmount DEVICE (eg. /dev/sdb1) and\n"
+            "                         forget it\n"
+            "  rescan DEVICE          unmount DEVICE, scan and mount it again\n"
+            "  reload                 reload the trusted devices\n"
+            "  pause                  hold newly authorized devices\n"
+            "  resume                 handle them again\n"
+            "  inventory              every device seen, with its last scan\n",
+            PROGRAM_NAME);
+}
+
+int main(int argc, char *argv[])
+{
+    const struct command *command = NULL;
+    const char *devnode = NULL;
+    size_t i;
+    int fd, opt, rt;
+    const struct option options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    PROGRAM_NAME = "sieldctl";
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        usage();
+        exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (optind >= argc) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < sizeof(COMMANDS) / sizeof(COMMANDS[0]); i++)
+        if (strcmp(argv[optind], COMMANDS[i].name) == 0)
+            command = &COMMANDS[i];
+
+    if (command == NULL
+        || argc - optind != (command->needs_device ? 2 : 1)) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (command->needs_device) {
+        devnode = argv[optind + 1];
+        if (strlen(devnode) >= CTL_TEXT_MAX) {
+            fprintf(stderr, "Device name too long.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (command->type == 0)
+        return print_inventory() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    fd = connect_daemon();
+    if (fd == -1) exit(EXIT_FAILURE);
+
+    /* Status is asked for often, don't fill the log. */
+    if (command->type != CTL_STATUS)
+        log("%s %s", command->name, devnode ? devnode : "");
+
+    if (send_request(fd, command->type, devnode) == -1) {
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (command->type == CTL_STATUS) rt = print_status(fd);
+    else rt = print_result(fd);
+
+    close(fd);
+    return rt == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,23 +1,32 @@
-#define _BSD_SOURCE         /* DT_FIFO, scandir() */
-#define _GNU_SOURCE         /* asprintf() */
-#include <dirent.h>         /* opendir() */
+#define _GNU_SOURCE         /* getline(), explicit_bzero() */
 #include <errno.h>          /* errno */
-#include <fcntl.h>          /* open() */
+#include <fnmatch.h>        /* fnmatch() */
+#include <getopt.h>         /* getopt_long() */
 #include <pwd.h>            /* getpwuid() */
 #include <stdio.h>          /* printf() */
 #include <stdlib.h>         /* NULL */
 #include <string.h>         /* strerror() */
-#include <sys/stat.h>       /* open() */
-#include <sys/types.h>      /* opendir() */
-#include <unistd.h>         /* getuid(), write() */
+#include <sys/socket.h>     /* socket() */
+#include <sys/un.h>         /* struct sockaddr_un */
+#include <unistd.h>         /* getuid() */
 
-#include "sield-ipc.h"      /* sharing information */
+#include "sield-ipc.h"      /* struct auth_msg */
 #include "sield-log.h"      /* log_fn() */
 #include "sield-passwd-cli-get.h"   /* get_passwd() */
 
+/* Pending devices reported by the daemon. */
+struct device {
+    int id;
+    char description[AUTH_TEXT_MAX];
+};
+
 static char *get_username(uid_t uid);
-static int fifo_filter(const struct dirent *ent);
 static int get_choice(int *choice);
+static int connect_daemon(void);
+static int list_devices(int fd, struct device **devices);
+static int try_passwd(int fd, int id, const char *pattern, const char *tty,
+                      const char *passwd);
+static void usage(void);
 
 /* Add program name to logging function */
 #define log(format, ...) log_fn("[%s] "format, PROGRAM_NAME, ##__VA_ARGS__)
@@ -32,7 +41,7 @@ static char *get_username(uid_t uid)
     pwd = getpwuid(uid);
     if (pwd == NULL) {
         log("%s", strerror(errno));
-        log("Could not retrieve username for UID %s");
+        log("Could not retrieve username for UID %ld", (long int)uid);
         return NULL;
     }
 
@@ -41,13 +50,6 @@ static char *get_username(uid_t uid)
     return username;
 }
 
-/* Filter function to select only named pipes. */
-static int fifo_filter(const struct dirent *ent)
-{
-    if (ent->d_type == DT_FIFO) return 1;
-    else return 0;
-}
-
 static int get_choice(int *choice)
 {
     char *line = NULL;
@@ -63,20 +65,166 @@ static int get_choice(int *choice)
     return 0;
 }
 
+/* Return a socket connected to the daemon, -1 on error. */
+static int connect_daemon(void)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, AUTH_SOCKET, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log("socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        log("connect(): %s: %s", AUTH_SOCKET, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Fetch the devices awaiting a password.
+ *
+ * Return the number of devices, -1 on error.
+ */
+static int list_devices(int fd, struct device **devices)
+{
+    int n = 0;
+    struct auth_msg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = AUTH_LIST;
+
+    if (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+        log("send(): %s", strerror(errno));
+        return -1;
+    }
+
+    while (recv(fd, &msg, sizeof(msg), 0) == sizeof(msg)) {
+        struct device *more = NULL;
+
+        if (msg.type == AUTH_END) return n;
+        if (msg.type != AUTH_DEVICE) break;
+
+        more = realloc(*devices, (n + 1) * sizeof(struct device));
+        if (more == NULL) {
+            log("realloc(): Memory error.");
+            return -1;
+        }
+        *devices = more;
+
+        (*devices)[n].id = msg.id;
+        msg.text[sizeof(msg.text) - 1] = '\0';
+        strcpy((*devices)[n].description, msg.text);
+        n++;
+    }
+
+    log("Unexpected reply from daemon.");
+    return -1;
+}
+
+/*
+ * Send a password for the device with given id, or for all devices
+ * matching pattern if it isn't NULL.
+ *
+ * Return the daemon's verdict (enum auth_status), -1 on error.
+ */
+static int try_passwd(int fd, int id, const char *pattern, const char *tty,
+                      const char *passwd)
+{
+    struct auth_msg msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = pattern ? AUTH_TRY_MATCH : AUTH_TRY;
+    msg.id = id;
+    if (pattern) strncpy(msg.match, pattern, sizeof(msg.match) - 1);
+    strncpy(msg.tty, tty, sizeof(msg.tty) - 1);
+    strncpy(msg.text, passwd, sizeof(msg.text) - 1);
+
+    n = send(fd, &msg, sizeof(msg), MSG_NOSIGNAL);
+    explicit_bzero(&msg, sizeof(msg));
+
+    if (n != sizeof(msg)) {
+        log("send(): %s", strerror(errno));
+        return -1;
+    }
+
+    /* Devices authorized by a pattern are listed first. */
+    while (recv(fd, &msg, sizeof(msg), 0) == sizeof(msg)) {
+        if (msg.type == AUTH_RESULT) return msg.status;
+        if (msg.type != AUTH_DEVICE) break;
+
+        msg.text[sizeof(msg.text) - 1] = '\0';
+        printf("Authorized %s\n", msg.text);
+    }
+
+    log("Unexpected reply from daemon.");
+    return -1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [--all | --match PATTERN]\n"
+            "Authorize a USB device waiting for the sield password.\n\n"
+            "  -a, --all              authorize all waiting devices\n"
+            "  -m, --match PATTERN    authorize all waiting devices whose\n"
+            "                         description matches the shell\n"
+            "                         wildcard PATTERN (eg. 'SanDisk*')\n",
+            PROGRAM_NAME);
+}
+
 int main(int argc, char *argv[])
 {
-    int fifos = 0, i = 0, choice = 0;
+    int ndevices = 0, choice = 0, status = AUTH_REJECTED;
     int fd = -1;
     size_t len = 0;
     char *username = NULL;
     char *tty = NULL;
     char *plain_txt_passwd = NULL;
-    char *fifo_path = NULL;
-    struct dirent **entries = NULL;
-    struct auth_len lengths;        /* Structure to send string lengths */
+    const char *pattern = NULL;
+    struct device *devices = NULL;
+    int opt, nmatching = 0;
+    const struct option options[] = {
+        {"all", no_argument, NULL, 'a'},
+        {"match", required_argument, NULL, 'm'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
 
     PROGRAM_NAME = argv[0];
 
+    while ((opt = getopt_long(argc, argv, "am:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                pattern = "*";
+                break;
+            case 'm':
+                pattern = optarg;
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (pattern && strlen(pattern) >= AUTH_TEXT_MAX) {
+        fprintf(stderr, "Pattern too long.\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* Who started this program? */
     username = get_username(getuid());
     if (username == NULL) {
@@ -86,36 +234,47 @@ int main(int argc, char *argv[])
 
     /* From which tty? */
     tty = ttyname(STDIN_FILENO);        /* DO NOT free() */
+    if (tty == NULL) tty = "?";
+    else if (strncmp(tty, "/dev/", 5) == 0) tty += 5;
 
     log("%s executed %s from %s.", username, PROGRAM_NAME, tty);
 
-    /* Check for directory existence */
-    if (access(FIFO_DIR, F_OK) == -1) {
-        log("%s", strerror(errno));
-        log("Could not open %s", FIFO_DIR);
-        fprintf(stderr, "No unattended devices.\n");
+    fd = connect_daemon();
+    if (fd == -1) {
+        fprintf(stderr, "Can't reach the sield daemon.\n");
         goto error;
     }
 
-    fifos = scandir(FIFO_DIR, &entries, fifo_filter, alphasort);
-
-    if (fifos <= 0) {
-        if (fifos == -1) log("%s", strerror(errno));
+    ndevices = list_devices(fd, &devices);
+    if (ndevices <= 0) {
         fprintf(stderr, "No unattended devices.\n");
         goto error;
     }
 
-    /* Print all available devices */
+    /* Print all available (matching) devices */
     printf("Devices:\n");
 
-    for (i = 0; i < fifos; i++) {
-        printf("%d) %s\n", i+1, entries[i]->d_name);
+    for (choice = 0; choice < ndevices; choice++) {
+        if (pattern
+            && fnmatch(pattern, devices[choice].description, 0) != 0)
+            continue;
+
+        printf("%d) %s\n", choice + 1, devices[choice].description);
+        nmatching++;
+    }
+
+    if (nmatching == 0) {
+        fprintf(stderr, "No matching devices.\n");
+        goto error;
     }
 
     /* Ask for choice if more than 1 device exists. */
-    if (fifos > 1) {
+    if (pattern) {
+        /* All of them, with one password. */
+        choice = 0;
+    } else if (ndevices > 1) {
         printf("Enter your choice: ");
-        if (get_choice(&choice) == -1 || (choice <= 0) || (choice > fifos)) {
+        if (get_choice(&choice) == -1 || (choice <= 0) || (choice > ndevices)) {
             log("Invalid choice given.\n");
             fprintf(stderr, "Invalid choice.\n");
             goto error;
@@ -125,76 +284,62 @@ int main(int argc, char *argv[])
         choice = 0;
     }
 
-    if (asprintf(&fifo_path, "%s%s",
-                 FIFO_DIR, entries[choice]->d_name) == -1) {
-        log("asprintf: memory error");
-        fprintf(stderr, "Memory error");
-        goto error;
-    }
-
-    /* Write only, non-blocking open */
-    fd = open(fifo_path, O_WRONLY | O_NONBLOCK);
-    if (fd == -1) {
-        /* Read fifo(7) */
-        if (errno == ENXIO) {
-            log("Another user may be using sld.");
-            fprintf(stderr, "Device currently unavailable. Try again.\n");
+    /* The daemon decides how many attempts are allowed. */
+    while (status == AUTH_REJECTED || status == AUTH_BUSY) {
+        printf("password: ");
+        if (get_passwd(&plain_txt_passwd, &len, stdin) == -1) {
+            log("Unable to get password from user.");
+            fprintf(stderr, "Unable to get password. Quitting...\n");
             goto error;
         }
-        log("fopen(): %s", strerror(errno));
-        log("Unable to open %d for writing.", fifo_path);
-        fprintf(stderr, "Could not open given choice.\n");
-        goto error;
-    }
 
-    /* Ask for password */
-    printf("password: ");
-    if (get_passwd(&plain_txt_passwd, &len, stdin) == -1) {
-        log("Unable to get password from user.");
-        fprintf(stderr, "Unable to get password. Quitting...\n");
-        close(fd);
-        goto error;
-    }
-
-    printf("\n");
+        printf("\n");
 
-    /* Set all string lengths */
-    lengths.tty_len = strlen(tty + 5);
-    lengths.user_len = strlen(username);
-    lengths.pwd_len = strlen(plain_txt_passwd);
+        if (strlen(plain_txt_passwd) >= AUTH_TEXT_MAX) {
+            fprintf(stderr, "Password too long.\n");
+            goto error;
+        }
 
-    /* Send data to daemon */
-    if ((write(fd, &lengths, sizeof(struct auth_len))
-               != sizeof(struct auth_len))
-        /* sizeof(char) is ALWAYS 1 */
-        || (write(fd, tty + 5, lengths.tty_len + 1) != lengths.tty_len + 1)
-        || (write(fd, username, lengths.user_len + 1) != lengths.user_len + 1)
-        || (write(fd, plain_txt_passwd, lengths.pwd_len + 1)
-                  != lengths.pwd_len + 1)) {
+        status = try_passwd(fd, devices[choice].id, pattern, tty,
+                            plain_txt_passwd);
+        explicit_bzero(plain_txt_passwd, len);
 
-        log("Failed to send data to daemon.\n");
-        fprintf(stderr, "Failed to send data to daemon.\n");
-        close(fd);
-        goto error;
+        switch (status) {
+            case AUTH_ACCEPTED:
+                printf("Password accepted.\n");
+                break;
+            case AUTH_REJECTED:
+                printf("Incorrect password given.\n");
+                break;
+            case AUTH_BUSY:
+                printf("Too many password checks in progress. "
+                       "Try again.\n");
+                break;
+            case AUTH_DENIED:
+                fprintf(stderr, "Incorrect password given. "
+                        "No attempts left for %s.\n",
+                        pattern ? "the matching devices" : "this device");
+                goto error;
+            case AUTH_NO_DEVICE:
+                fprintf(stderr, "%s no longer waiting.\n",
+                        pattern ? "Devices are" : "Device is");
+                goto error;
+            default:
+                fprintf(stderr, "Failed to send data to daemon.\n");
+                goto error;
+        }
     }
 
     if (plain_txt_passwd) free(plain_txt_passwd);
     if (username) free(username);
-    if (fifo_path) free(fifo_path);
-    for (i = 0; i < fifos; i++) {
-        if (entries[i]) free(entries[i]);
-    }
-    if (entries) free(entries);
+    if (devices) free(devices);
     close(fd);
 
     exit(EXIT_SUCCESS);
 error:
     if (plain_txt_passwd) free(plain_txt_passwd);
     if (username) free(username);
-    if (fifo_path) free(fifo_path);
-    for (i = 0; i < fifos; i++) {
-        if (entries[i]) free(entries[i]);
-    }
-    if (entries) free(entries);
+    if (devices) free(devices);
+    if (fd != -1) close(fd);
     exit(EXIT_FAILURE);
 }
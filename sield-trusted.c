@@ -0,0 +1,271 @@
+#define _GNU_SOURCE             /* strdup(), getline() */
+#include <errno.h>              /* errno */
+#include <stdio.h>              /* fopen() */
+#include <stdlib.h>             /* free() */
+#include <string.h>             /* strcmp() */
+#include <strings.h>            /* strcasecmp() */
+#include <sys/stat.h>           /* stat() */
+
+#include "sield-config.h"       /* get_sield_attr_no_log() */
+#include "sield-grace.h"        /* grace_key() */
+#include "sield-log.h"          /* log_fn() */
+#include "sield-trusted.h"
+
+/*
+ * Registry of trusted devices ("trusted devices" file).
+ *
+ * Entries are kept in a hash table keyed by
+ * "idVendor:idProduct:serial", the same key as grace_key(). A key may
+ * appear more than once, with different filesystem UUIDs. The file is
+ * re-read whenever it changed since it was last loaded.
+ */
+static const char *TRUSTED_FILE = "/etc/sield/sield.trusted";
+
+struct trusted {
+    char *key;
+    char *uuid;                 /* NULL => any filesystem */
+    int policy;
+    struct trusted *next;       /* Same bucket */
+};
+
+static struct trusted **buckets = NULL;
+static size_t nbuckets = 0;     /* Power of 2 */
+static struct stat loaded_st;
+static int loaded = 0;
+
+static unsigned long hash(const char *str);
+static void free_table(struct trusted **table, size_t size);
+static int parse_policy(char *str, int *policy);
+static int parse_line(char *line, struct trusted **entry);
+static const char *trusted_file(void);
+static int is_changed(const char *file);
+
+/* FNV-1a */
+static unsigned long hash(const char *str)
+{
+    unsigned long h = 2166136261UL;
+
+    while (*str) {
+        h ^= (unsigned char) *str++;
+        h *= 16777619UL;
+    }
+
+    return h;
+}
+
+static void free_table(struct trusted **table, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        struct trusted *entry = table[i];
+
+        while (entry != NULL) {
+            struct trusted *next = entry->next;
+
+            free(entry->key);
+            if (entry->uuid) free(entry->uuid);
+            free(entry);
+            entry = next;
+        }
+    }
+
+    free(table);
+}
+
+/*
+ * "noauth,noscan" => TRUST_NO_AUTH | TRUST_NO_SCAN
+ *
+ * Return 0 on success, -1 on unknown policy.
+ */
+static int parse_policy(char *str, int *policy)
+{
+    char *saveptr = NULL;
+    char *token = NULL;
+
+    *policy = 0;
+
+    for (token = strtok_r(str, ",", &saveptr); token != NULL;
+         token = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(token, "noauth") == 0) *policy |= TRUST_NO_AUTH;
+        else if (strcmp(token, "noscan") == 0) *policy |= TRUST_NO_SCAN;
+        else if (strcmp(token, "readonly") == 0) *policy |= TRUST_READ_ONLY;
+        else return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse one line of the registry.
+ * *entry is set to NULL for blank lines and comments.
+ *
+ * Return 0 on success, -1 on malformed line or memory error.
+ */
+static int parse_line(char *line, struct trusted **entry)
+{
+    char *saveptr = NULL;
+    char *id = strtok_r(line, " \t\n", &saveptr);
+    char *policies = strtok_r(NULL, " \t\n", &saveptr);
+    char *uuid = NULL;
+    char *field = NULL;
+    int policy = 0;
+    int colons = 0;
+
+    *entry = NULL;
+    if (id == NULL || id[0] == '#') return 0;
+
+    if (policies == NULL || strtok_r(NULL, " \t\n", &saveptr) != NULL
+        || parse_policy(policies, &policy) == -1)
+        return -1;
+
+    /* vendor:product:serial[:uuid] */
+    for (field = id; (field = strchr(field, ':')) != NULL; field++) {
+        if (++colons == 3) {
+            *field = '\0';
+            uuid = field + 1;
+            break;
+        }
+    }
+    if (colons < 2) return -1;
+
+    *entry = calloc(1, sizeof(struct trusted));
+    if (*entry == NULL) return -1;
+
+    (*entry)->key = strdup(id);
+    if (uuid && uuid[0] != '\0') (*entry)->uuid = strdup(uuid);
+    (*entry)->policy = policy;
+
+    if ((*entry)->key == NULL || (uuid && uuid[0] && !(*entry)->uuid)) {
+        if ((*entry)->key) free((*entry)->key);
+        free(*entry);
+        *entry = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static const char *trusted_file(void)
+{
+    static char *file = NULL;
+
+    /* The path is only read once. */
+    if (file == NULL) file = get_sield_attr_no_log("trusted devices");
+    return (file == NULL) ? TRUSTED_FILE : file;
+}
+
+/* Has the registry file changed since it was loaded? */
+static int is_changed(const char *file)
+{
+    struct stat st;
+
+    if (stat(file, &st) == -1) return loaded;
+
+    return !loaded
+        || st.st_ino != loaded_st.st_ino
+        || st.st_size != loaded_st.st_size
+        || st.st_mtim.tv_sec != loaded_st.st_mtim.tv_sec
+        || st.st_mtim.tv_nsec != loaded_st.st_mtim.tv_nsec;
+}
+
+/*
+ * (Re)load the registry.
+ * A missing file means no trusted devices.
+ *
+ * Return the number of entries, -1 on error (the old table is kept).
+ */
+int trusted_load(void)
+{
+    const char *file = trusted_file();
+    struct trusted **table = NULL;
+    size_t size = 64, count = 0, lineno = 0;
+    char *line = NULL;
+    size_t len = 0;
+    FILE *fp = NULL;
+    struct stat st;
+
+    fp = fopen(file, "r");
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            log_fn("fopen(): %s: %s", file, strerror(errno));
+            return -1;
+        }
+
+        free_table(buckets, nbuckets);
+        buckets = NULL;
+        nbuckets = 0;
+        loaded = 0;
+        return 0;
+    }
+
+    fstat(fileno(fp), &st);
+
+    /* Roughly one bucket per line. */
+    while (size < (size_t) st.st_size / 32) size <<= 1;
+
+    table = calloc(size, sizeof(struct trusted *));
+    if (table == NULL) {
+        log_fn("calloc(): Memory error.");
+        fclose(fp);
+        return -1;
+    }
+
+    while (getline(&line, &len, fp) != -1) {
+        struct trusted *entry = NULL;
+        size_t i;
+
+        lineno++;
+        if (parse_line(line, &entry) == -1) {
+            log_fn("%s:%ld: Ignoring malformed entry.", file, (long) lineno);
+            continue;
+        }
+        if (entry == NULL) continue;
+
+        i = hash(entry->key) & (size - 1);
+        entry->next = table[i];
+        table[i] = entry;
+        count++;
+    }
+
+    if (line) free(line);
+    fclose(fp);
+
+    free_table(buckets, nbuckets);
+    buckets = table;
+    nbuckets = size;
+    loaded_st = st;
+    loaded = 1;
+
+    log_fn("Loaded %ld trusted device(s) from %s.", (long) count, file);
+    return (int) count;
+}
+
+/*
+ * Look up the device in the registry.
+ *
+ * Return its policy (enum trusted_policy flags), -1 if not trusted.
+ */
+int trusted_policy(struct udev_device *device, struct udev_device *parent)
+{
+    char key[GRACE_KEY_MAX];
+    const char *uuid = NULL;
+    struct trusted *entry = NULL;
+
+    if (is_changed(trusted_file())) trusted_load();
+
+    if (nbuckets == 0 || grace_key(parent, key, sizeof(key)) == -1)
+        return -1;
+
+    uuid = udev_device_get_property_value(device, "ID_FS_UUID");
+
+    for (entry = buckets[hash(key) & (nbuckets - 1)]; entry != NULL;
+         entry = entry->next) {
+        if (strcmp(entry->key, key) != 0) continue;
+        if (entry->uuid == NULL
+            || (uuid != NULL && strcasecmp(entry->uuid, uuid) == 0))
+            return entry->policy;
+    }
+
+    return -1;
+}
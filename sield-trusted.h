@@ -0,0 +1,16 @@
+#ifndef _SIELD_TRUSTED_H_
+#define _SIELD_TRUSTED_H_
+
+#include <libudev.h>
+
+/* Per-device policy from the trusted device registry. */
+enum trusted_policy {
+    TRUST_NO_AUTH = 1 << 0,     /* don't ask for the password */
+    TRUST_NO_SCAN = 1 << 1,     /* don't run "av path" */
+    TRUST_READ_ONLY = 1 << 2    /* always mount read-only */
+};
+
+int trusted_load(void);
+int trusted_policy(struct udev_device *device, struct udev_device *parent);
+
+#endif
@@ -11,10 +11,10 @@ static const char *UDEV_RULE_FILE = "/etc/udev/rules.d/999-sield.rules";
 
 /*
  * Return a udev enumeration context to list
- * devices with given subsystem.
+ * devices with given subsystem and device type.
  */
-struct udev_enumerate *enumerate_devices_with_subsystem(
-        struct udev *udev, const char *subsystem)
+struct udev_enumerate *enumerate_devices_with_subsystem_devtype(
+        struct udev *udev, const char *subsystem, const char *devtype)
 {
     int rt = 0;
     struct udev_enumerate *enumerate = NULL;
@@ -25,15 +25,20 @@ struct udev_enumerate *enumerate_devices_with_subsystem(
         return NULL;
     }
 
+    /* Filtered by udev, not one udev_device per block device here. */
     rt = udev_enumerate_add_match_subsystem(enumerate, subsystem);
+    if (rt == 0) rt = udev_enumerate_add_match_property(
+                        enumerate, "DEVTYPE", devtype);
     if (rt != 0) {
         log_fn("[udev] Failed to setup enumeration filter.");
+        udev_enumerate_unref(enumerate);
         return NULL;
     }
 
     rt = udev_enumerate_scan_devices(enumerate);
     if (rt != 0) {
         log_fn("[udev] Failed to scan enumeration devices.");
+        udev_enumerate_unref(enumerate);
         return NULL;
     }
 
@@ -42,11 +47,14 @@ struct udev_enumerate *enumerate_devices_with_subsystem(
 
 /*
  * Return a listening udev_monitor with given
- * event source, subsystem and device type.
+ * event source, subsystem, device type and tag (NULL for any).
+ *
+ * The filters are compiled into a socket filter, so events of other
+ * devices are dropped by the kernel without waking us up.
  */
 struct udev_monitor *monitor_device_with_subsystem_devtype(
         struct udev *udev, const char *event_source,
-        const char *subsystem, const char *devtype)
+        const char *subsystem, const char *devtype, const char *tag)
 {
     int rt = 0;
     struct udev_monitor *monitor = NULL;
@@ -59,34 +67,24 @@ struct udev_monitor *monitor_device_with_subsystem_devtype(
 
     rt = udev_monitor_filter_add_match_subsystem_devtype(
             monitor, subsystem, devtype);
+    if (rt == 0 && tag != NULL)
+        rt = udev_monitor_filter_add_match_tag(monitor, tag);
     if (rt != 0) {
         log_fn("[udev] Failed to setup monitor filter.");
+        udev_monitor_unref(monitor);
         return NULL;
     }
 
     rt = udev_monitor_enable_receiving(monitor);
     if (rt != 0) {
         log_fn("[udev] Failed to bind udev_monitor to event source.");
+        udev_monitor_unref(monitor);
         return NULL;
     }
 
     return monitor;
 }
 
-/* Return a udev_device with given action, else return NULL */
-struct udev_device *receive_device_with_action(
-        struct udev_monitor *monitor, const char *action)
-{
-    struct udev_device *device = udev_monitor_receive_device(monitor);
-
-    if (device != NULL) {
-        const char *actual_action = udev_device_get_action(device);
-        if (strcmp(actual_action, action) == 0) return device;
-    }
-
-    return NULL;
-}
-
 /* Delete udev rule file. */
 void delete_udev_rule(void)
 {
@@ -99,7 +97,10 @@ void delete_udev_rule(void)
     }
 }
 
-/* Write the udev rule to prevent automount. */
+/*
+ * Write the udev rule to prevent automount, and to tag the USB
+ * storage devices for the monitor's filter.
+ */
 void write_udev_rule(void)
 {
     const char *rule =
@@ -107,11 +108,26 @@ void write_udev_rule(void)
         "SUBSYSTEMS==\"usb\", ENV{UDISKS_PRESENTATION_HIDE}=\"1\","
         "ENV{UDISKS_PRESENTATION_NOPOLICY}=\"1\","
         "ENV{UDISKS_AUTOMOUNT_HINT}=\"never\","
-        "ENV{UDISKS_IGNORE}=\"1\", ENV{UDISKS_AUTO}=\"0\"";
+        "ENV{UDISKS_IGNORE}=\"1\", ENV{UDISKS_AUTO}=\"0\","
+        "TAG+=\"" SIELD_UDEV_TAG "\"";
+    static int checked = 0;
+    char line[512];
     FILE *fp = NULL;
 
     /* Rule file already exists */
-    if (access(UDEV_RULE_FILE, F_OK) == 0) return 0;
+    if (access(UDEV_RULE_FILE, F_OK) == 0) {
+        if (checked) return;
+        checked = 1;
+
+        /* Once, in case it was written by an older version. */
+        fp = fopen(UDEV_RULE_FILE, "r");
+        if (fp != NULL) {
+            int current = fgets(line, sizeof(line), fp) != NULL
+                          && strncmp(line, rule, strlen(rule)) == 0;
+            fclose(fp);
+            if (current) return;
+        }
+    }
 
     fp = fopen(UDEV_RULE_FILE, "w");
     if (fp == NULL) {
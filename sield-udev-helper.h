@@ -3,16 +3,16 @@
 
 #include <libudev.h>
 
+/* Set on USB storage devices by our udev rule. */
+#define SIELD_UDEV_TAG "sield"
+
 /* udev helper functions */
-struct udev_enumerate *enumerate_devices_with_subsystem(
-        struct udev *udev, const char *subsystem);
+struct udev_enumerate *enumerate_devices_with_subsystem_devtype(
+        struct udev *udev, const char *subsystem, const char *devtype);
 
 struct udev_monitor *monitor_device_with_subsystem_devtype(
         struct udev *udev, const char *event_source,
-        const char *subsystem, const char *devtype);
-
-struct udev_device *receive_device_with_action(
-        struct udev_monitor *monitor, const char *action);
+        const char *subsystem, const char *devtype, const char *tag);
 
 void delete_udev_rule(void);
 void write_udev_rule(void);
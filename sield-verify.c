@@ -0,0 +1,209 @@
+#define _GNU_SOURCE             /* pipe2(), explicit_bzero() */
+#include <crypt.h>              /* crypt_r() */
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* O_NONBLOCK */
+#include <poll.h>               /* POLLIN */
+#include <pthread.h>            /* pthread_create() */
+#include <signal.h>             /* pthread_sigmask() */
+#include <stdlib.h>             /* free() */
+#include <string.h>             /* strdup() */
+#include <unistd.h>             /* pipe2() */
+
+#include "sield-config.h"       /* get_sield_attr_int() */
+#include "sield-event.h"        /* event_add_fd() */
+#include "sield-log.h"          /* log_fn() */
+#include "sield-passwd-check.h" /* get_passwd_hash() */
+#include "sield-verify.h"
+
+/*
+ * Password verification off the event loop.
+ *
+ * A hash costs tens of milliseconds of CPU by design, so the checks
+ * run on a small, fixed pool of threads using crypt_r(3). Requests
+ * beyond VERIFY_QUEUE_MAX are refused instead of piling up. Results
+ * are handed back to the event loop through a pipe and the callbacks
+ * run on the main thread.
+ */
+
+#define VERIFY_THREADS 2
+#define VERIFY_THREADS_MAX 16
+#define VERIFY_QUEUE_MAX 32
+
+struct verify_req {
+    char *plain;
+    char *hash;
+    int correct;
+    verify_done_fn done;
+    void *data;
+    struct verify_req *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct verify_req *todo = NULL;     /* FIFO */
+static struct verify_req *todo_tail = NULL;
+static struct verify_req *finished = NULL;
+static int queued = 0;
+
+/* Written by workers to wake up the event loop. */
+static int wake_pipe[2] = {-1, -1};
+static int nthreads = 0;
+
+static void *worker(void *arg);
+static void wake_event(int fd, short revents, void *data);
+static void free_req(struct verify_req *req);
+
+static void free_req(struct verify_req *req)
+{
+    if (req->plain) {
+        explicit_bzero(req->plain, strlen(req->plain));
+        free(req->plain);
+    }
+    if (req->hash) free(req->hash);
+    free(req);
+}
+
+static void *worker(void *arg)
+{
+    /* Large, keep it off the stack. */
+    struct crypt_data *cdata = calloc(1, sizeof(struct crypt_data));
+
+    if (cdata == NULL) {
+        log_fn("calloc(): Memory error.");
+        return NULL;
+    }
+
+    while (1) {
+        struct verify_req *req = NULL;
+        char byte = 0;
+
+        pthread_mutex_lock(&lock);
+        while (todo == NULL) pthread_cond_wait(&cond, &lock);
+        req = todo;
+        todo = req->next;
+        if (todo == NULL) todo_tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        req->correct = passwd_hash_matches(req->plain, req->hash, cdata);
+
+        pthread_mutex_lock(&lock);
+        req->next = finished;
+        finished = req;
+        pthread_mutex_unlock(&lock);
+
+        /* Pipe full means a wake-up is pending anyway. */
+        if (write(wake_pipe[1], &byte, 1) == -1 && errno != EAGAIN)
+            log_fn("write(): %s", strerror(errno));
+    }
+
+    return NULL;
+}
+
+/* Run the callbacks of finished verifications. */
+static void wake_event(int fd, short revents, void *data)
+{
+    char buf[64];
+    struct verify_req *done = NULL;
+
+    while (read(fd, buf, sizeof(buf)) > 0) continue;
+
+    pthread_mutex_lock(&lock);
+    done = finished;
+    finished = NULL;
+    pthread_mutex_unlock(&lock);
+
+    while (done != NULL) {
+        struct verify_req *next = done->next;
+
+        queued--;
+        done->done(done->correct, done->data);
+        free_req(done);
+        done = next;
+    }
+}
+
+/*
+ * Start the worker threads ("verify threads" in the config).
+ *
+ * Return 0 on success, -1 on error.
+ */
+int verify_init(void)
+{
+    int i;
+    long wanted = get_sield_attr_int("verify threads");
+    sigset_t all, old;
+
+    if (wanted <= 0) wanted = VERIFY_THREADS;
+    if (wanted > VERIFY_THREADS_MAX) wanted = VERIFY_THREADS_MAX;
+
+    if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        log_fn("pipe2(): %s", strerror(errno));
+        return -1;
+    }
+
+    if (event_add_fd(wake_pipe[0], POLLIN, wake_event, NULL) == -1)
+        return -1;
+
+    /* Signals are for the main thread. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (i = 0; i < wanted; i++) {
+        pthread_t thread;
+        int rt = pthread_create(&thread, NULL, worker, NULL);
+
+        if (rt != 0) {
+            log_fn("pthread_create(): %s", strerror(rt));
+            break;
+        }
+
+        pthread_detach(thread);
+        nthreads++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (nthreads == 0) return -1;
+
+    log_fn("Started %d password verification thread(s).", nthreads);
+    return 0;
+}
+
+/*
+ * Queue a password check against the stored hash.
+ * done(correct, data) is called from the event loop.
+ *
+ * Return 0 if queued, -1 if the queue is full or on error.
+ */
+int verify_passwd_async(const char *plain, verify_done_fn done, void *data)
+{
+    const char *hash = NULL;
+    struct verify_req *req = NULL;
+
+    if (nthreads == 0 || queued >= VERIFY_QUEUE_MAX) return -1;
+
+    hash = get_passwd_hash();
+    if (hash == NULL) return -1;
+
+    req = calloc(1, sizeof(struct verify_req));
+    if (req == NULL
+        || (req->plain = strdup(plain)) == NULL
+        || (req->hash = strdup(hash)) == NULL) {
+        log_fn("Memory error.");
+        if (req) free_req(req);
+        return -1;
+    }
+
+    req->done = done;
+    req->data = data;
+    queued++;
+
+    pthread_mutex_lock(&lock);
+    if (todo_tail) todo_tail->next = req;
+    else todo = req;
+    todo_tail = req;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
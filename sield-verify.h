@@ -0,0 +1,12 @@
+#ifndef _SIELD_VERIFY_H_
+#define _SIELD_VERIFY_H_
+
+/*
+ * Asynchronous password verification on a bounded thread pool.
+ */
+typedef void (*verify_done_fn)(int correct, void *data);
+
+int verify_init(void);
+int verify_passwd_async(const char *plain, verify_done_fn done, void *data);
+
+#endif
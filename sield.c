@@ -1,30 +1,55 @@
 #include <errno.h>              /* errno */
-#include <fcntl.h>              /* fcntl() */
+#include <getopt.h>             /* getopt_long() */
 #include <libudev.h>            /* udev */
+#include <poll.h>               /* POLLIN */
 #include <signal.h>             /* sigaction() */
+#include <stdio.h>              /* fprintf() */
 #include <stdlib.h>             /* free(), exit() */
-#include <string.h>             /* strcmp() */
-#include <sys/mount.h>          /* umount() */
+#include <string.h>             /* strcmp(), strerror() */
+#include <sys/mount.h>          /* umount(), umount2() */
+#include <sys/statvfs.h>        /* statvfs() */
 #include <sys/wait.h>           /* waitpid() */
+#include <time.h>               /* strftime() */
 #include <unistd.h>             /* getpid() */
 
+#include "sield-acct.h"         /* acct_begin() */
+#include "sield-auth.h"         /* auth_init() */
 #include "sield-av.h"           /* is_infected() */
 #include "sield-config.h"       /* get_sield_attr_int() */
+#include "sield-ctl.h"          /* ctl_init() */
 #include "sield-daemon.h"       /* become_daemon() */
+#include "sield-event.h"        /* event_dispatch() */
+#include "sield-grace.h"        /* grace_lookup() */
+#include "sield-http.h"         /* http_init() */
+#include "sield-inventory.h"    /* inventory_seen() */
+#include "sield-job.h"          /* job_start() */
+#include "sield-journal.h"      /* journal_init() */
 #include "sield-log.h"          /* log_fn() */
 #include "sield-mount.h"        /* mount_device() */
-#include "sield-passwd-ask.h"   /* ask_passwd() */
+#include "sield-onaccess.h"     /* onaccess_watch() */
+#include "sield-passwd-cli.h"   /* ask_passwd_cli() */
 #include "sield-pid.h"          /* rm_pidfile() */
+#include "sield-probe.h"        /* PROBE2() */
+#include "sield-session.h"      /* session_init() */
 #include "sield-share.h"        /* samba_share() */
+#include "sield-trusted.h"      /* trusted_policy() */
 #include "sield-udev-helper.h"  /* monitor_device_with_subsystem_devtype() */
+#include "sield-verify.h"       /* verify_init() */
 
 static void signal_handler(int signum);
+static void remember_device(struct udev_device *device,
+                            struct udev_device *parent);
 static void _handle_device(struct udev_device *device,
-                           struct udev_device *parent);
+                           struct udev_device *parent, int verdict);
 static void handle_device(struct udev_device *device,
                           struct udev_device *parent);
+static void device_authorized(int approved, const char *user, void *data);
 static int handle_plugged_in_devices(
         struct udev *udev, const char *subsystem, const char *devtype);
+static void device_removed(struct udev_device *device);
+static void monitor_event(int fd, short revents, void *data);
+static unsigned long long bytes_in_use(const char *path);
+static void usage(const char *name);
 
 /* Catch signals */
 static void signal_handler(int signum)
@@ -41,34 +66,119 @@ static void signal_handler(int signum)
         if (signum == SIGTERM) log_fn("SIGTERM received. Quitting safely.");
 
         /* cleanup */
+        journal_flush();
         delete_udev_rule();
+        auth_cleanup();
+        ctl_cleanup();
         rm_pidfile();
-        restore_smb_conf();
+        samba_unshare_all();
         exit(signum);
     }
 }
 
-/* Create a new process to handle a detected device */
+/* Count the device in the inventory; tell what's known of it. */
+static void remember_device(struct udev_device *device,
+                            struct udev_device *parent)
+{
+    const char *manufacturer = udev_device_get_sysattr_value(parent, "manufacturer");
+    const char *product = udev_device_get_sysattr_value(parent, "product");
+    const struct inventory_record *record = NULL;
+    char id[INVENTORY_ID_MAX];
+    char description[INVENTORY_DESCRIPTION_MAX];
+    char first_seen[32];
+    time_t first;
+
+    if (inventory_id(device, parent, id, sizeof(id)) == -1) return;
+
+    snprintf(description, sizeof(description), "%s %s",
+             manufacturer ? manufacturer : "", product ? product : "");
+
+    record = inventory_seen(id, description);
+    if (record == NULL || record->inserts < 2) return;
+
+    first = record->first_seen;
+    strftime(first_seen, sizeof(first_seen), "%F", localtime(&first));
+    log_fn("%s was seen %u times since %s, last scan: %s.",
+           udev_device_get_devnode(device), record->inserts, first_seen,
+           inventory_verdict(record->verdict));
+}
+
+/*
+ * Authorize a detected device and create a new process to handle it.
+ *
+ * Passwords are collected by the daemon's authentication broker, from
+ * sld or a desktop agent. The handler process is only created once one
+ * was accepted.
+ */
 static void handle_device(struct udev_device *device,
                           struct udev_device *parent)
 {
-    switch (fork()) {
-        case -1:
-            log_fn("Could not create a new process to handle device %s",
-                   udev_device_get_devnode(device));
-            return;
-        case 0: break;
-        default: return;
+    const char *devnode = udev_device_get_devnode(device);
+    const char *manufacturer = udev_device_get_sysattr_value(parent, "manufacturer");
+    const char *product = udev_device_get_sysattr_value(parent, "product");
+
+    char key[GRACE_KEY_MAX];
+    const char *user = NULL;
+    int policy;
+
+    /* Log device information. */
+    log_block_device_info(device, parent);
+    remember_device(device, parent);
+
+    /* Fleet devices which don't need a password. */
+    policy = trusted_policy(device, parent);
+    if (policy != -1 && (policy & TRUST_NO_AUTH)) {
+        log_fn("%s is a trusted device.", devnode);
+        PROBE2(device_accepted, devnode, "trusted");
+        job_start(device);
+        return;
     }
 
-    /* Child process executes this. */
-    _handle_device(device, parent);
-    exit(EXIT_SUCCESS);
+    /* Authorized a short while ago, don't ask again. */
+    if (grace_key(parent, key, sizeof(key)) == 0
+        && grace_lookup(key, &user)) {
+        log_fn("%s was authorized%s%s within the grace period.",
+               devnode, user ? " by " : "", user ? user : "");
+        PROBE2(device_accepted, devnode, "grace");
+        job_start(device);
+        return;
+    }
+
+    /* Keep the device around until a password was given. */
+    udev_device_ref(device);
+    if (ask_passwd_cli(manufacturer, product, devnode,
+                       device_authorized, device) == -1)
+        udev_device_unref(device);
+}
+
+/* The authentication broker is done with a device. */
+static void device_authorized(int approved, const char *user, void *data)
+{
+    struct udev_device *device = (struct udev_device *) data;
+    struct udev_device *parent = NULL;
+    char key[GRACE_KEY_MAX];
+
+    if (approved) {
+        PROBE2(device_accepted, udev_device_get_devnode(device), "password");
+        parent = udev_device_get_parent_with_subsystem_devtype(
+                    device, "usb", "usb_device");
+        if (grace_key(parent, key, sizeof(key)) == 0)
+            grace_remember(key, user);
+        job_start(device);
+    } else {
+        PROBE1(device_rejected, udev_device_get_devnode(device));
+        log_fn("Ignoring %s.", udev_device_get_devnode(device));
+    }
+
+    udev_device_unref(device);
 }
 
-/* Sequential steps to execute for handling a device */
+/*
+ * Sequential steps to execute for handling a device.
+ * verdict is that of a scan done before a restart, if any.
+ */
 static void _handle_device(struct udev_device *device,
-                           struct udev_device *parent)
+                           struct udev_device *parent, int verdict)
 {
     /*********************/
     /* Basic device info */
@@ -80,53 +190,83 @@ static void _handle_device(struct udev_device *device,
 
     int scan = get_sield_attr_bool("scan");
     int readonly = get_sield_attr_bool("read only");
+    int policy = trusted_policy(device, parent);
+    int on_access = 0;
     char *mount_pt = NULL;
 
-    /* Log device information. */
-    log_block_device_info(device, parent);
+    /* Registry overrides for trusted devices. */
+    if (policy != -1) {
+        if (policy & TRUST_NO_SCAN) scan = 0;
+        if (policy & TRUST_READ_ONLY) readonly = 1;
+    }
+
+    /* Scanned already, the outcome stands. */
+    if (verdict == VERDICT_INFECTED) return;
+    if (verdict == VERDICT_ON_ACCESS) on_access = 1;
+    if (verdict != VERDICT_NONE) {
+        scan = 0;
+        if (verdict == VERDICT_ERRORS) readonly = 1;
+    }
 
-    /* Incorrect password is given. */
-    if (ask_passwd(manufacturer, product, devnode) != 1) return;
+    /* Files are scanned as they are opened instead. */
+    if (scan != 0 && onaccess_fd() != -1) {
+        scan = 0;
+        on_access = 1;
+        job_notify_scanned(VERDICT_ON_ACCESS, 0, 0);
+    }
 
     /* Don't scan iff scan == 0 */
     if (scan != 0) {
         char *rd_only_mtpt = NULL;
         int av_result;
+        unsigned long long bytes;
+        struct acct acct;
+        pid_t progress;
 
-        /* Mount as read-only for virus scan */
-        /* TODO: Mount at a temporary directory */
-        rd_only_mtpt = mount_device(device, 1);
+        /* Mount as read-only for virus scan, where no other device is */
+        rd_only_mtpt = mount_device_private(device);
         if (rd_only_mtpt)
             log_fn("Mounted %s (%s %s) at %s as read-only for virus scan.",
                    devnode, manufacturer, product, rd_only_mtpt);
         else return;
 
         /* Scan the device for viruses. */
+        bytes = bytes_in_use(rd_only_mtpt);
+        job_notify_scanning(bytes);
+        acct_begin(&acct, device);
+        PROBE2(scan_start, devnode, bytes);
+        progress = acct_progress_start(&acct, device, job_notify_progress);
         av_result = is_infected(rd_only_mtpt);
+        acct_end(&acct, device);
+        acct_progress_stop(progress);
+        PROBE4(scan_end, devnode, av_result, bytes, acct.elapsed);
+        acct_log(&acct, device, parent, job_queued());
 
         /* Unmount*/
         if (umount(rd_only_mtpt) == -1) {
             free(rd_only_mtpt);
             return;
         } else {
+            PROBE3(unmount, devnode, rd_only_mtpt, 0);
             log_fn("Unmounted %s", rd_only_mtpt);
+            rmdir(rd_only_mtpt);
             free(rd_only_mtpt);
         }
 
-        /*
-         * Either
-         * 1. Virus(es) found.
-         *  OR
-         * 2. Error(s) occurred.
-         */
-        if (av_result == 1) return;
+        verdict = av_verdict(av_result);
+        job_notify_scanned(verdict, acct.elapsed, acct.read_bytes);
+
+        /* Virus(es) found: not mounted. */
+        if (verdict == VERDICT_INFECTED) return;
 
         /* If errors occurred, mount as read only. */
-        if (av_result == 2) readonly = 1;
+        if (verdict == VERDICT_ERRORS) readonly = 1;
     }
 
-    /* Mount the device */
-    mount_pt = mount_device(device, readonly);
+    /* Mount the device; marked before it shows, if scanned on access. */
+    if (on_access) mount_pt = mount_device_staged(device, readonly,
+                                                  onaccess_watch);
+    else mount_pt = mount_device(device, readonly);
 
     if (mount_pt) {
         int share = get_sield_attr_bool("share");
@@ -135,105 +275,238 @@ static void _handle_device(struct udev_device *device,
                devnode, manufacturer, product, mount_pt,
                readonly == 1 ? "read-only" : "read-write");
 
-        if (share == 1 && samba_share(mount_pt, manufacturer, product) != -1)
-            log_fn("Shared %s on the samba network.", mount_pt);
+        job_notify(JOB_MOUNTED, 0, mount_pt);
 
-        if (has_unmounted(mount_pt)) {
-            log_fn("%s was unmounted.", devnode);
-
-            /* Restore original smb.conf */
-            if (share == 1 && restore_smb_conf() == 0)
-                log_fn("Restored smb.conf");
+        if (share == 1
+            && samba_share(mount_pt, manufacturer, product, devnode) != -1) {
+            log_fn("Shared %s on the samba network.", mount_pt);
+            job_notify(JOB_SHARE_CHANGED, 0, NULL);
         }
 
         free(mount_pt);
     }
 }
 
+/*
+ * Take care of the devices which were plugged in before we started,
+ * in one pass: the mount table is read once and each device is
+ * either ignored, or unmounted and handed to handle_device() like a
+ * newly plugged in one.
+ */
 static int handle_plugged_in_devices(
         struct udev *udev, const char *subsystem, const char *devtype)
 {
     struct udev_enumerate *enumerate = NULL;
     struct udev_list_entry *devices_list = NULL;
     struct udev_list_entry *dev_list_entry = NULL;
+    struct mount_index *mounts = NULL;
+    int remount = get_sield_attr_int("remount");
+    int found = 0, handled = 0;
+    long started = event_now_ms();
 
     /* Enumerate all devices that are already plugged in. */
-    enumerate = enumerate_devices_with_subsystem(udev, subsystem);
+    enumerate = enumerate_devices_with_subsystem_devtype(
+                    udev, subsystem, devtype);
     if (enumerate == NULL) return -1;
 
+    mounts = mount_index_load();
+    if (mounts == NULL) {
+        udev_enumerate_unref(enumerate);
+        return -1;
+    }
+
     devices_list = udev_enumerate_get_list_entry(enumerate);
 
     /* Iterate through each of the devices */
     udev_list_entry_foreach(dev_list_entry, devices_list) {
-        char *mountpoint = NULL;
+        const char *mountpoint = NULL;
         const char *devnode = NULL;
         struct udev_device *device = NULL;
         struct udev_device *parent = NULL;
 
         device = udev_device_new_from_syspath(
                     udev, udev_list_entry_get_name(dev_list_entry));
-
-        /* Handle device only if it has a mountable partition. */
-        if (strcmp(udev_device_get_devtype(device), devtype) != 0) {
-            udev_device_unref(device);
-            continue;
-        }
+        if (device == NULL) continue;
 
         /* Ensure it a USB device. */
         parent = udev_device_get_parent_with_subsystem_devtype(
                     device, "usb", "usb_device");
 
-        if (parent == NULL) {
+        devnode = udev_device_get_devnode(device);
+        if (parent == NULL || devnode == NULL) {
             udev_device_unref(device);
             continue;
         }
 
-        devnode = udev_device_get_devnode(device);
-        mountpoint = get_mountpoint(devnode);
+        found++;
+        mountpoint = mount_index_find(mounts, devnode);
+
+        /* Known from before a restart? */
+        if (job_resume(device, parent, mountpoint)) {
+            handled++;
+            udev_device_unref(device);
+            continue;
+        }
 
         /* Device is already mounted */
         if (mountpoint != NULL) {
             /* Check if "remount" configuration is set */
-            if (get_sield_attr_int("remount") == 1) {
-                /* Unmount device */
-                if (umount(mountpoint) == -1) {
-                    log_fn("umount(): %s: %s", mountpoint, strerror(errno));
-                    udev_device_unref(device);
-                    free(mountpoint);
-                    continue;
-                } else {
-                    log_fn("Unmounted %s (%s)", mountpoint, devnode);
-                }
-            } else {
+            if (remount != 1) {
                 log_fn("Ignoring %s mounted at %s", devnode, mountpoint);
                 udev_device_unref(device);
-                free(mountpoint);
                 continue;
             }
 
-            free(mountpoint);
+            /*
+             * Detach right away, even if busy: the device is out of
+             * reach until it is authorized again. Data is flushed in
+             * the background.
+             */
+            if (umount2(mountpoint, MNT_DETACH) == -1) {
+                log_fn("umount2(): %s: %s", mountpoint, strerror(errno));
+                udev_device_unref(device);
+                continue;
+            }
+
+            PROBE3(unmount, devnode, mountpoint, 1);
+            log_fn("Unmounted %s (%s)", mountpoint, devnode);
         }
 
+        /* Asks for a password or queues, doesn't block. */
         handle_device(device, parent);
+        handled++;
 
         udev_device_unref(device);
     }
 
+    mount_index_free(mounts);
     udev_enumerate_unref(enumerate);
 
+    /* The journal's other devices are gone. */
+    job_release_stale();
+
+    log_fn("Found %d device(s) plugged in, %d handled, in %ld ms.",
+           found, handled, event_now_ms() - started);
+
     return 0;
 }
 
+/* An authorized or waiting device was unplugged. */
+static void device_removed(struct udev_device *device)
+{
+    const char *devnode = udev_device_get_devnode(device);
+
+    if (devnode == NULL) return;
+
+    /* Stop asking for its password. */
+    if (auth_withdraw(devnode) > 0)
+        log_fn("%s was removed before it was authorized.", devnode);
+
+    /* Stop its scan, unmount it, remove its share. */
+    job_cancel(devnode);
+}
+
+/* An event is pending on the udev monitor. */
+static void monitor_event(int fd, short revents, void *data)
+{
+    struct udev_monitor *monitor = (struct udev_monitor *) data;
+    struct udev_device *device = NULL;
+    struct udev_device *parent = NULL;
+    const char *action = NULL;
+
+    /* Any "block" partition event for our USB devices. */
+    device = udev_monitor_receive_device(monitor);
+    if (device == NULL) return;
+
+    action = udev_device_get_action(device);
+    if (action == NULL) {
+        udev_device_unref(device);
+        return;
+    }
+
+    PROBE2(event_received, action, udev_device_get_devnode(device));
+
+    /* Clean up even if disabled since. */
+    if (strcmp(action, "remove") == 0) {
+        device_removed(device);
+        udev_device_unref(device);
+        return;
+    }
+
+    /* Only devices which were plugged in ("add"ed) to the system. */
+    if (strcmp(action, "add") != 0) {
+        udev_device_unref(device);
+        return;
+    }
+
+    /* Not enabled, drop the event. */
+    if (get_sield_attr_int("enable") != 1) {
+        udev_device_unref(device);
+        return;
+    }
+
+    /* The device should be using USB */
+    parent = udev_device_get_parent_with_subsystem_devtype(
+                device, "usb", "usb_device");
+    if (parent == NULL) {
+        udev_device_unref(device);
+        return;
+    }
+
+    /* Take care of the device. */
+    handle_device(device, parent);
+
+    /* Parent will also be cleaned up */
+    udev_device_unref(device);
+}
+
+/* Bytes used on the file system mounted at path, 0 if unknown. */
+static unsigned long long bytes_in_use(const char *path)
+{
+    struct statvfs st;
+
+    if (statvfs(path, &st) == -1) return 0;
+
+    return (unsigned long long) (st.f_blocks - st.f_bfree) * st.f_frsize;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [--foreground]\n"
+            "Ask for a password before USB storage devices are mounted.\n\n"
+            "  -f, --foreground       don't detach, for service managers;\n"
+            "                         readiness is sent to $NOTIFY_SOCKET\n",
+            name);
+}
+
 int main(int argc, char *argv[])
 {
     size_t i;
-    int fd, saved_flags;
+    int fd, opt, foreground = 0;
+    const struct option options[] = {
+        {"foreground", no_argument, NULL, 'f'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
     const int signals[] = {SIGTERM, SIGCHLD, SIGSEGV};
     struct sigaction action;
     struct udev *udev = NULL;
     struct udev_monitor *monitor = NULL;
-    struct udev_device *device = NULL;
-    struct udev_device *parent = NULL;
+
+    while ((opt = getopt_long(argc, argv, "fh", options, NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                foreground = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
 
     /* Setup signal handlers */
     action.sa_handler = signal_handler;
@@ -246,7 +519,7 @@ int main(int argc, char *argv[])
         sigaction(signal, &action, NULL);
     }
 
-    if (become_daemon() == -1) {
+    if (become_daemon(foreground) == -1) {
         log_fn("SysV daemon creation failed. Quitting.");
         exit(EXIT_FAILURE);
     }
@@ -254,6 +527,46 @@ int main(int argc, char *argv[])
     /* Daemon creation successful */
     log_fn("Started daemon with PID %ld.", (long int)getpid());
 
+    /* Before the workers, which mark their mounts in its group. */
+    if (onaccess_init() == -1)
+        log_fn("On-access scanning unavailable, scanning devices in full.");
+
+    /* Serves the devices' files, away from the event loop. */
+    if (http_init() == -1)
+        log_fn("HTTP exporter could not be started, retrying.");
+
+    /* Before any thread is started. */
+    if (job_pool_init(_handle_device) == -1) {
+        log_fn("Worker processes could not be started. Quitting.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* What was going on before a restart. */
+    if (journal_init() == -1)
+        log_fn("State journal could not be opened, continuing without.");
+
+    /* Devices seen before. */
+    if (inventory_open(1) == -1)
+        log_fn("Device inventory could not be opened, continuing without.");
+
+    /* Listen for sld clients. */
+    if (auth_init() == -1) {
+        log_fn("Authentication socket could not be created. Quitting.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* For sieldctl; the daemon runs without. */
+    if (ctl_init() == -1)
+        log_fn("Control socket could not be created, continuing without.");
+
+    trusted_load();
+    session_init();
+
+    if (verify_init() == -1) {
+        log_fn("Password verification threads could not be started. Quitting.");
+        exit(EXIT_FAILURE);
+    }
+
     udev = udev_new();
     if (udev == NULL) {
         log_fn("[udev] udev object could not be created. Quitting.");
@@ -263,55 +576,39 @@ int main(int argc, char *argv[])
     /* Custom logging function */
     udev_set_log_fn(udev, udev_custom_log_fn);
 
-    /* Monitor block devices with a partition */
+    /* Tags are set by our rule, it must be in place first. */
+    if (get_sield_attr_int("enable") == 1) write_udev_rule();
+
+    /* Monitor USB block devices with a partition */
     monitor = monitor_device_with_subsystem_devtype(
-                udev, "udev", "block", "partition");
+                udev, "udev", "block", "partition", SIELD_UDEV_TAG);
     if (monitor == NULL) {
         udev_unref(udev);
         exit(EXIT_FAILURE);
     }
 
+    /* Non-blocking monitor, events are picked up by the event loop. */
     fd = udev_monitor_get_fd(monitor);
-
-    /* Make the monitor BLOCKING */
-    saved_flags = fcntl(fd, F_GETFL);
-    /* Mask out O_NONBLOCK */
-    fcntl(fd, F_SETFL, saved_flags & ~O_NONBLOCK);
+    if (event_add_fd(fd, POLLIN, monitor_event, monitor) == -1) {
+        udev_monitor_unref(monitor);
+        udev_unref(udev);
+        exit(EXIT_FAILURE);
+    }
 
     /* Device monitor setup successfully. */
     log_fn("Device monitor setup successfully.");
 
     handle_plugged_in_devices(udev, "block", "partition");
 
+    /* Devices plugged in from now on won't be missed. */
+    notify_ready();
+
     while (1) {
         /* Check if enabled. */
-        if (get_sield_attr_int("enable") != 1) {
-            delete_udev_rule();
-            continue;
-        }
-
-        write_udev_rule();
-
-        /*
-         * Receive udev_device for any "block" device which was
-         * plugged in ("add"ed) to the system.
-         */
-        device = receive_device_with_action(monitor, "add");
-        if (device == NULL) continue;
+        if (get_sield_attr_int("enable") != 1) delete_udev_rule();
+        else write_udev_rule();
 
-        /* The device should be using USB */
-        parent = udev_device_get_parent_with_subsystem_devtype(
-                    device, "usb", "usb_device");
-        if (parent == NULL) {
-            udev_device_unref(device);
-            continue;
-        }
-
-        /* Take care of the device. */
-        handle_device(device, parent);
-
-        /* Parent will also be cleaned up */
-        udev_device_unref(device);
+        if (event_dispatch() == -1) break;
     }
 
     udev_monitor_unref(monitor);